@@ -25,9 +25,20 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /* OP-TEE TEE client API (built by optee_client) */
 #include <tee_client_api.h>
@@ -38,6 +49,22 @@
 #define AES_TEST_BUFFER_SIZE	4096
 #define AES_TEST_KEY_SIZE	16
 #define AES_BLOCK_SIZE		16
+#define AES_TEST_RECORD_SIZE	256
+#define AES_TEST_RECORD_COUNT	(AES_TEST_BUFFER_SIZE / AES_TEST_RECORD_SIZE)
+#define AES_GCM_NONCE_SIZE	12
+#define AES_GCM_TAG_SIZE	16
+#define AES_XTS_SECTOR_SIZE	512
+#define AES_XTS_START_SECTOR	0x100000000ULL
+/* Not a whole number of blocks, to end with a partial CTR block */
+#define AES_PARALLEL_SIZE	(4 * 1024 * 1024 + 5)
+#define AES_PARALLEL_MAX_THREADS	8
+#define AES_TEST_KEY_ID		"aes_example_key"
+#define AES_TEST_MAC_KEY_SIZE	32
+#define AES_FRAME_SIZE		1024
+#define AES_FRAME_COUNT		(AES_TEST_BUFFER_SIZE / AES_FRAME_SIZE)
+#define AES_SEALED_FRAME_SIZE	(AES_FRAME_SIZE + TA_AES_FRAME_TAG_SIZE)
+
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
 
 #define DECODE			0
 #define ENCODE			1
@@ -73,7 +100,46 @@ void terminate_tee_session(struct test_ctx *ctx)
 	TEEC_FinalizeContext(&ctx->ctx);
 }
 
-void prepare_aes(struct test_ctx *ctx, int encode)
+/* Get a new ciphering context handle from the TA */
+uint32_t alloc_aes_ctx(struct test_ctx *ctx)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_OUTPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CTX_ALLOC,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CTX_ALLOC) failed 0x%x origin 0x%x",
+			res, origin);
+
+	return op.params[0].value.a;
+}
+
+void free_aes_ctx(struct test_ctx *ctx, uint32_t aes_ctx)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+	op.params[0].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CTX_FREE,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CTX_FREE) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void prepare_aes(struct test_ctx *ctx, uint32_t aes_ctx, uint32_t algo,
+		 int encode)
 {
 	TEEC_Operation op;
 	uint32_t origin;
@@ -83,12 +149,13 @@ void prepare_aes(struct test_ctx *ctx, int encode)
 	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
 					 TEEC_VALUE_INPUT,
 					 TEEC_VALUE_INPUT,
-					 TEEC_NONE);
+					 TEEC_VALUE_INPUT);
 
-	op.params[0].value.a = TA_AES_ALGO_CTR;
+	op.params[0].value.a = algo;
 	op.params[1].value.a = TA_AES_SIZE_128BIT;
 	op.params[2].value.a = encode ? TA_AES_MODE_ENCODE :
 					TA_AES_MODE_DECODE;
+	op.params[3].value.a = aes_ctx;
 
 	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_PREPARE,
 				 &op, &origin);
@@ -97,7 +164,7 @@ void prepare_aes(struct test_ctx *ctx, int encode)
 			res, origin);
 }
 
-void set_key(struct test_ctx *ctx, char *key, size_t key_sz)
+void set_key(struct test_ctx *ctx, uint32_t aes_ctx, char *key, size_t key_sz)
 {
 	TEEC_Operation op;
 	uint32_t origin;
@@ -105,10 +172,12 @@ void set_key(struct test_ctx *ctx, char *key, size_t key_sz)
 
 	memset(&op, 0, sizeof(op));
 	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
 
 	op.params[0].tmpref.buffer = key;
 	op.params[0].tmpref.size = key_sz;
+	op.params[3].value.a = aes_ctx;
 
 	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_SET_KEY,
 				 &op, &origin);
@@ -117,7 +186,50 @@ void set_key(struct test_ctx *ctx, char *key, size_t key_sz)
 			res, origin);
 }
 
-void set_iv(struct test_ctx *ctx, char *iv, size_t iv_sz)
+/* Generate a key in secure storage, fine if it already exists */
+void gen_key(struct test_ctx *ctx, char *id, size_t key_sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_NONE);
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].value.a = key_sz;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_GEN_KEY,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS && res != TEEC_ERROR_ACCESS_CONFLICT)
+		errx(1, "TEEC_InvokeCommand(GEN_KEY) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void set_key_by_id(struct test_ctx *ctx, uint32_t aes_ctx, char *id)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_SET_KEY_BY_ID,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(SET_KEY_BY_ID) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void set_iv(struct test_ctx *ctx, uint32_t aes_ctx, char *iv, size_t iv_sz)
 {
 	TEEC_Operation op;
 	uint32_t origin;
@@ -125,9 +237,11 @@ void set_iv(struct test_ctx *ctx, char *iv, size_t iv_sz)
 
 	memset(&op, 0, sizeof(op));
 	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					  TEEC_NONE, TEEC_NONE, TEEC_NONE);
+					  TEEC_NONE, TEEC_NONE,
+					  TEEC_VALUE_INPUT);
 	op.params[0].tmpref.buffer = iv;
 	op.params[0].tmpref.size = iv_sz;
+	op.params[3].value.a = aes_ctx;
 
 	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_SET_IV,
 				 &op, &origin);
@@ -136,7 +250,8 @@ void set_iv(struct test_ctx *ctx, char *iv, size_t iv_sz)
 			res, origin);
 }
 
-void cipher_buffer(struct test_ctx *ctx, char *in, char *out, size_t sz)
+void cipher_buffer(struct test_ctx *ctx, uint32_t aes_ctx,
+		   char *in, char *out, size_t sz)
 {
 	TEEC_Operation op;
 	uint32_t origin;
@@ -145,11 +260,12 @@ void cipher_buffer(struct test_ctx *ctx, char *in, char *out, size_t sz)
 	memset(&op, 0, sizeof(op));
 	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
 					 TEEC_MEMREF_TEMP_OUTPUT,
-					 TEEC_NONE, TEEC_NONE);
+					 TEEC_NONE, TEEC_VALUE_INPUT);
 	op.params[0].tmpref.buffer = in;
 	op.params[0].tmpref.size = sz;
 	op.params[1].tmpref.buffer = out;
 	op.params[1].tmpref.size = sz;
+	op.params[3].value.a = aes_ctx;
 
 	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER,
 				 &op, &origin);
@@ -158,53 +274,1983 @@ void cipher_buffer(struct test_ctx *ctx, char *in, char *out, size_t sz)
 			res, origin);
 }
 
-int main(void)
+/* Prepare, load key, reset IV and cipher @buf in place in one invocation */
+void cipher_oneshot(struct test_ctx *ctx, int encode, char *key, size_t key_sz,
+		    char *iv, size_t iv_sz, char *buf, size_t sz)
 {
-	struct test_ctx ctx;
-	char key[AES_TEST_KEY_SIZE];
-	char iv[AES_BLOCK_SIZE];
-	char clear[AES_TEST_BUFFER_SIZE];
-	char ciph[AES_TEST_BUFFER_SIZE];
-	char temp[AES_TEST_BUFFER_SIZE];
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
 
-	printf("Prepare session with the TA\n");
-	prepare_tee_session(&ctx);
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INOUT);
+	op.params[0].value.a = TA_AES_ALGO_CTR;
+	op.params[0].value.b = encode ? TA_AES_MODE_ENCODE :
+					TA_AES_MODE_DECODE;
+	op.params[1].tmpref.buffer = key;
+	op.params[1].tmpref.size = key_sz;
+	op.params[2].tmpref.buffer = iv;
+	op.params[2].tmpref.size = iv_sz;
+	op.params[3].tmpref.buffer = buf;
+	op.params[3].tmpref.size = sz;
 
-	printf("Prepare encode operation\n");
-	prepare_aes(&ctx, ENCODE);
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER_ONESHOT,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER_ONESHOT) failed 0x%x origin 0x%x",
+			res, origin);
+}
 
-	printf("Load key in TA\n");
-	memset(key, 0xa5, sizeof(key)); /* Load some dummy value */
-	set_key(&ctx, key, AES_TEST_KEY_SIZE);
+void ae_init(struct test_ctx *ctx, uint32_t aes_ctx, char *nonce,
+	     size_t nonce_sz, size_t aad_sz, size_t payload_sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
 
-	printf("Reset ciphering operation in TA (provides the initial vector)\n");
-	memset(iv, 0, sizeof(iv)); /* Load some dummy value */
-	set_iv(&ctx, iv, AES_BLOCK_SIZE);
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = nonce;
+	op.params[0].tmpref.size = nonce_sz;
+	op.params[1].value.a = AES_GCM_TAG_SIZE * 8;
+	op.params[1].value.b = aad_sz;
+	op.params[2].value.a = payload_sz;
+	op.params[3].value.a = aes_ctx;
 
-	printf("Encode buffer from TA\n");
-	memset(clear, 0x5a, sizeof(clear)); /* Load some dummy value */
-	cipher_buffer(&ctx, clear, ciph, AES_TEST_BUFFER_SIZE);
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_AE_INIT,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(AE_INIT) failed 0x%x origin 0x%x",
+			res, origin);
+}
 
-	printf("Prepare decode operation\n");
-	prepare_aes(&ctx, DECODE);
+void ae_update_aad(struct test_ctx *ctx, uint32_t aes_ctx,
+		   char *aad, size_t aad_sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
 
-	printf("Load key in TA\n");
-	memset(key, 0xa5, sizeof(key)); /* Load some dummy value */
-	set_key(&ctx, key, AES_TEST_KEY_SIZE);
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = aad;
+	op.params[0].tmpref.size = aad_sz;
+	op.params[3].value.a = aes_ctx;
 
-	printf("Reset ciphering operation in TA (provides the initial vector)\n");
-	memset(iv, 0, sizeof(iv)); /* Load some dummy value */
-	set_iv(&ctx, iv, AES_BLOCK_SIZE);
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_AE_UPDATE_AAD,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(AE_UPDATE_AAD) failed 0x%x origin 0x%x",
+			res, origin);
+}
 
-	printf("Decode buffer from TA\n");
-	cipher_buffer(&ctx, ciph, temp, AES_TEST_BUFFER_SIZE);
+/* Cipher a payload chunk, return the number of bytes output */
+size_t ae_update(struct test_ctx *ctx, uint32_t aes_ctx,
+		 char *in, char *out, size_t sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
 
-	/* Check decoded is the clear content */
-	if (memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
-		printf("Clear text and decoded text differ => ERROR\n");
-	else
-		printf("Clear text and decoded text match\n");
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_NONE, TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = in;
+	op.params[0].tmpref.size = sz;
+	op.params[1].tmpref.buffer = out;
+	op.params[1].tmpref.size = sz;
+	op.params[3].value.a = aes_ctx;
 
-	terminate_tee_session(&ctx);
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_AE_UPDATE,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(AE_UPDATE) failed 0x%x origin 0x%x",
+			res, origin);
+
+	return op.params[1].tmpref.size;
+}
+
+/*
+ * Cipher the last payload chunk and compute (encode) or check (decode)
+ * the tag
+ */
+TEEC_Result ae_final(struct test_ctx *ctx, uint32_t aes_ctx, int encode,
+		     char *in, size_t in_sz, char *out, size_t out_sz,
+		     char *tag)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 encode ? TEEC_MEMREF_TEMP_OUTPUT :
+						  TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = in;
+	op.params[0].tmpref.size = in_sz;
+	op.params[1].tmpref.buffer = out;
+	op.params[1].tmpref.size = out_sz;
+	op.params[2].tmpref.buffer = tag;
+	op.params[2].tmpref.size = AES_GCM_TAG_SIZE;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 encode ? TA_AES_CMD_AE_ENCRYPT_FINAL :
+					  TA_AES_CMD_AE_DECRYPT_FINAL,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS && res != TEEC_ERROR_MAC_INVALID)
+		errx(1, "TEEC_InvokeCommand(AE_FINAL) failed 0x%x origin 0x%x",
+			res, origin);
+
+	return res;
+}
+
+/*
+ * Authenticated ciphering of @in into @out: AAD then the payload in two
+ * halves, to show the streaming API. @tag is computed when encoding and
+ * checked when decoding.
+ */
+TEEC_Result gcm_buffer(struct test_ctx *ctx, uint32_t aes_ctx, int encode,
+		       char *nonce, char *aad, size_t aad_sz,
+		       char *in, char *out, size_t sz, char *tag)
+{
+	size_t half = sz / 2;
+	size_t n;
+
+	ae_init(ctx, aes_ctx, nonce, AES_GCM_NONCE_SIZE, aad_sz, sz);
+	ae_update_aad(ctx, aes_ctx, aad, aad_sz);
+	n = ae_update(ctx, aes_ctx, in, out, half);
+
+	return ae_final(ctx, aes_ctx, encode, in + half, sz - half,
+			out + n, sz - n, tag);
+}
+
+void print_key_cache_stats(struct test_ctx *ctx)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_OUTPUT,
+					 TEEC_VALUE_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_KEY_CACHE_STATS,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(KEY_CACHE_STATS) failed 0x%x origin 0x%x",
+			res, origin);
+
+	printf("Key cache: %u hits, %u misses, %u/%u entries used\n",
+	       op.params[0].value.a, op.params[0].value.b,
+	       op.params[1].value.a, op.params[1].value.b);
+}
+
+/*
+ * Get a shared memory reusable across invocations. When @buf is NULL the
+ * memory is allocated by the TEE client library, otherwise the caller
+ * buffer is registered so that the TA accesses it without any copy.
+ */
+void prepare_shm(struct test_ctx *ctx, TEEC_SharedMemory *shm,
+		 void *buf, size_t sz)
+{
+	TEEC_Result res;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->size = sz;
+	shm->flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+
+	if (buf) {
+		shm->buffer = buf;
+		res = TEEC_RegisterSharedMemory(&ctx->ctx, shm);
+	} else {
+		res = TEEC_AllocateSharedMemory(&ctx->ctx, shm);
+	}
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to get %zu bytes of shared memory 0x%x",
+			sz, res);
+}
+
+/* Cipher in place @sz bytes found at @offset in shared memory @shm */
+void cipher_shm(struct test_ctx *ctx, uint32_t aes_ctx,
+		TEEC_SharedMemory *shm, size_t offset, size_t sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INOUT,
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
+	op.params[0].memref.parent = shm;
+	op.params[0].memref.offset = offset;
+	op.params[0].memref.size = sz;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+/*
+ * Describe @count records of @rec_sz bytes packed in a single buffer.
+ * Each record is ciphered with its own initial vector: @iv with the record
+ * index in its last 4 bytes (big endian).
+ */
+void build_batch_table(struct aes_batch_segment *segs, size_t count,
+		       size_t rec_sz, char *iv)
+{
+	size_t n;
+
+	memset(segs, 0, count * sizeof(*segs));
+
+	for (n = 0; n < count; n++) {
+		segs[n].offset = n * rec_sz;
+		segs[n].size = rec_sz;
+		segs[n].flags = TA_AES_BATCH_FLAG_IV;
+		memcpy(segs[n].iv, iv, AES_BLOCK_SIZE);
+		segs[n].iv[AES_BLOCK_SIZE - 4] = n >> 24;
+		segs[n].iv[AES_BLOCK_SIZE - 3] = n >> 16;
+		segs[n].iv[AES_BLOCK_SIZE - 2] = n >> 8;
+		segs[n].iv[AES_BLOCK_SIZE - 1] = n;
+	}
+}
+
+void cipher_batch(struct test_ctx *ctx, uint32_t aes_ctx,
+		  struct aes_batch_segment *segs, size_t count,
+		  char *buf, size_t sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_NONE, TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = segs;
+	op.params[0].tmpref.size = count * sizeof(*segs);
+	op.params[1].tmpref.buffer = buf;
+	op.params[1].tmpref.size = sz;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER_BATCH,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER_BATCH) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void ctr_seek(struct test_ctx *ctx, uint32_t aes_ctx, char *nonce,
+	      uint64_t block)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = nonce;
+	op.params[0].tmpref.size = AES_BLOCK_SIZE;
+	op.params[1].value.a = block;
+	op.params[1].value.b = block >> 32;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CTR_SEEK,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CTR_SEEK) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+/* Cipher the last chunk of a message in place */
+void cipher_final(struct test_ctx *ctx, uint32_t aes_ctx, char *buf, size_t sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = buf;
+	op.params[0].tmpref.size = sz;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER_FINAL,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER_FINAL) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void set_mac_key(struct test_ctx *ctx, uint32_t aes_ctx,
+		 char *key, size_t key_sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = key;
+	op.params[0].tmpref.size = key_sz;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_SET_MAC_KEY,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(SET_MAC_KEY) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+/* Encrypt @buf in place and get its tag, in a single invocation */
+void cipher_mac(struct test_ctx *ctx, uint32_t aes_ctx, char *iv,
+		char *buf, size_t sz, char *tag)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = buf;
+	op.params[0].tmpref.size = sz;
+	op.params[1].tmpref.buffer = iv;
+	op.params[1].tmpref.size = AES_BLOCK_SIZE;
+	op.params[2].tmpref.buffer = tag;
+	op.params[2].tmpref.size = TA_AES_MAC_TAG_SIZE;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER_MAC,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER_MAC) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+/* Returns TEEC_ERROR_MAC_INVALID on a bad tag */
+TEEC_Result decrypt_verify(struct test_ctx *ctx, uint32_t aes_ctx, char *iv,
+			   char *in, char *out, size_t sz, char *tag)
+{
+	char iv_tag[AES_BLOCK_SIZE + TA_AES_MAC_TAG_SIZE];
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memcpy(iv_tag, iv, AES_BLOCK_SIZE);
+	memcpy(iv_tag + AES_BLOCK_SIZE, tag, TA_AES_MAC_TAG_SIZE);
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = in;
+	op.params[0].tmpref.size = sz;
+	op.params[1].tmpref.buffer = out;
+	op.params[1].tmpref.size = sz;
+	op.params[2].tmpref.buffer = iv_tag;
+	op.params[2].tmpref.size = sizeof(iv_tag);
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_DECRYPT_VERIFY,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS && res != TEEC_ERROR_MAC_INVALID)
+		errx(1, "TEEC_InvokeCommand(DECRYPT_VERIFY) failed 0x%x origin 0x%x",
+			res, origin);
+
+	return res;
+}
+
+/*
+ * Cipher a message in place with an IV picked by the TA: when encoding,
+ * @iv receives the IV, when decoding it provides it.
+ */
+void cipher_auto_iv(struct test_ctx *ctx, uint32_t aes_ctx, int encode,
+		    char *buf, size_t sz, char *iv)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INOUT,
+					 encode ? TEEC_MEMREF_TEMP_OUTPUT :
+						  TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = buf;
+	op.params[0].tmpref.size = sz;
+	op.params[1].tmpref.buffer = iv;
+	op.params[1].tmpref.size = AES_BLOCK_SIZE;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_CIPHER_AUTO_IV,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER_AUTO_IV) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void frame_init(struct test_ctx *ctx, uint32_t aes_ctx, size_t frame_sz,
+		uint64_t plain_sz, struct aes_frame_header *hdr)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].value.a = frame_sz;
+	op.params[1].value.a = plain_sz;
+	op.params[1].value.b = plain_sz >> 32;
+	op.params[2].tmpref.buffer = hdr;
+	op.params[2].tmpref.size = sizeof(*hdr);
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_FRAME_INIT,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(FRAME_INIT) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+void frame_load(struct test_ctx *ctx, uint32_t aes_ctx,
+		struct aes_frame_header *hdr)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE,
+					 TEEC_VALUE_INPUT);
+	op.params[0].tmpref.buffer = hdr;
+	op.params[0].tmpref.size = sizeof(*hdr);
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_FRAME_LOAD,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(FRAME_LOAD) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+/*
+ * Seal or open the frames from index @first found in @in. Returns
+ * TEEC_ERROR_MAC_INVALID if a frame to open does not authenticate.
+ */
+TEEC_Result frame_cipher(struct test_ctx *ctx, uint32_t aes_ctx, int seal,
+			 uint32_t first, char *in, size_t in_sz,
+			 char *out, size_t out_sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].value.a = first;
+	op.params[1].tmpref.buffer = in;
+	op.params[1].tmpref.size = in_sz;
+	op.params[2].tmpref.buffer = out;
+	op.params[2].tmpref.size = out_sz;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 seal ? TA_AES_CMD_FRAME_SEAL :
+					TA_AES_CMD_FRAME_OPEN,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS && res != TEEC_ERROR_MAC_INVALID)
+		errx(1, "TEEC_InvokeCommand(FRAME_%s) failed 0x%x origin 0x%x",
+			seal ? "SEAL" : "OPEN", res, origin);
+
+	return res;
+}
+
+void cipher_xts_sectors(struct test_ctx *ctx, uint32_t aes_ctx,
+			uint64_t sector, size_t sector_sz,
+			char *buf, size_t sz)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_VALUE_INPUT);
+	op.params[0].value.a = sector;
+	op.params[0].value.b = sector >> 32;
+	op.params[1].value.a = sector_sz;
+	op.params[2].tmpref.buffer = buf;
+	op.params[2].tmpref.size = sz;
+	op.params[3].value.a = aes_ctx;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_AES_CMD_XTS_SECTORS,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(XTS_SECTORS) failed 0x%x origin 0x%x",
+			res, origin);
+}
+
+/*
+ * Throughput and latency benchmark (--bench): each thread opens its own
+ * sessions and ciphers buffers in place round robin over them. All
+ * threads run a buffer size in lockstep so that the wall time of a size
+ * covers exactly the operations of that size.
+ */
+#define BENCH_MIN_SIZE		16
+#define BENCH_MAX_SIZE		(4 * 1024 * 1024)
+#define BENCH_ITERATIONS	1000
+#define BENCH_BYTES_PER_SIZE	(64 * 1024 * 1024)
+#define BENCH_XTS_SECTOR_SIZE	512
+
+/* File ciphering defaults, see run_pipeline() */
+#define PIPE_CHUNK_SIZE		(1024 * 1024)
+#define PIPE_BUFFERS		3
+#define PIPE_MAX_BUFFERS	8
+
+enum bench_shm {
+	BENCH_SHM_TMP,		/* temporary memory reference */
+	BENCH_SHM_ALLOC,	/* TEEC_AllocateSharedMemory() */
+	BENCH_SHM_REG,		/* TEEC_RegisterSharedMemory() */
+};
+
+struct bench_cfg {
+	unsigned int threads;
+	unsigned int sessions;
+	size_t min_sz;
+	size_t max_sz;
+	unsigned int iterations;
+	uint32_t algo;
+	const char *algo_name;
+	size_t key_sz;
+	enum bench_shm shm_type;
+};
+
+struct bench_session {
+	struct test_ctx ctx;
+	TEEC_SharedMemory shm;
+	char *buf;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench_cfg *cfg;
+	pthread_barrier_t *barrier;
+	struct bench_session *sess;
+	uint64_t *lat;		/* latency of each operation in ns */
+	size_t lat_count;
+};
+
+static const struct {
+	const char *name;
+	uint32_t algo;
+} bench_algos[] = {
+	{ "ecb", TA_AES_ALGO_ECB },
+	{ "cbc", TA_AES_ALGO_CBC },
+	{ "ctr", TA_AES_ALGO_CTR },
+	{ "xts", TA_AES_ALGO_XTS },
+};
+
+static const char * const bench_shm_names[] = {
+	[BENCH_SHM_TMP] = "tmp",
+	[BENCH_SHM_ALLOC] = "alloc",
+	[BENCH_SHM_REG] = "reg",
+};
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Number of operations each thread runs for a buffer size */
+static size_t bench_ops(struct bench_cfg *cfg, size_t sz)
+{
+	size_t ops = BENCH_BYTES_PER_SIZE / sz;
+
+	if (ops > cfg->iterations)
+		ops = cfg->iterations;
+	if (!ops)
+		ops = 1;
+
+	return ops;
+}
+
+static void bench_alloc_buffer(struct bench_cfg *cfg,
+			       struct bench_session *bs, size_t sz)
+{
+	if (cfg->shm_type == BENCH_SHM_ALLOC) {
+		prepare_shm(&bs->ctx, &bs->shm, NULL, sz);
+		bs->buf = bs->shm.buffer;
+	} else {
+		bs->buf = malloc(sz);
+		if (!bs->buf)
+			errx(1, "Cannot allocate %zu bytes", sz);
+		if (cfg->shm_type == BENCH_SHM_REG)
+			prepare_shm(&bs->ctx, &bs->shm, bs->buf, sz);
+	}
+	memset(bs->buf, 0x5a, sz);
+}
+
+static void bench_free_buffer(struct bench_cfg *cfg, struct bench_session *bs)
+{
+	if (cfg->shm_type != BENCH_SHM_TMP)
+		TEEC_ReleaseSharedMemory(&bs->shm);
+	if (cfg->shm_type != BENCH_SHM_ALLOC)
+		free(bs->buf);
+	bs->buf = NULL;
+}
+
+static void bench_cipher(struct bench_cfg *cfg, struct bench_session *bs,
+			 size_t sz)
+{
+	uint32_t cmd = TA_AES_CMD_CIPHER;
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+	uint32_t type;
+	int idx = 0;
+
+	memset(&op, 0, sizeof(op));
+
+	if (cfg->algo == TA_AES_ALGO_XTS) {
+		cmd = TA_AES_CMD_XTS_SECTORS;
+		idx = 2;
+		op.params[1].value.a = sz < BENCH_XTS_SECTOR_SIZE ?
+				       sz : BENCH_XTS_SECTOR_SIZE;
+	}
+
+	if (cfg->shm_type == BENCH_SHM_TMP) {
+		type = TEEC_MEMREF_TEMP_INOUT;
+		op.params[idx].tmpref.buffer = bs->buf;
+		op.params[idx].tmpref.size = sz;
+	} else {
+		type = TEEC_MEMREF_PARTIAL_INOUT;
+		op.params[idx].memref.parent = &bs->shm;
+		op.params[idx].memref.offset = 0;
+		op.params[idx].memref.size = sz;
+	}
+
+	if (cmd == TA_AES_CMD_XTS_SECTORS)
+		op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+						 TEEC_VALUE_INPUT,
+						 type, TEEC_NONE);
+	else
+		op.paramTypes = TEEC_PARAM_TYPES(type, TEEC_NONE,
+						 TEEC_NONE, TEEC_NONE);
+
+	res = TEEC_InvokeCommand(&bs->ctx.sess, cmd, &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(0x%x) failed 0x%x origin 0x%x",
+			cmd, res, origin);
+}
+
+/* Buffer size following @sz, 0 past the largest one */
+static size_t bench_next_size(struct bench_cfg *cfg, size_t sz)
+{
+	/* Checked before doubling, which could wrap around */
+	if (sz > cfg->max_sz / 2)
+		return 0;
+
+	return sz * 2;
+}
+
+static void *bench_thread_run(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct bench_cfg *cfg = bt->cfg;
+	char key[2 * TA_AES_SIZE_256BIT];
+	char iv[AES_BLOCK_SIZE];
+	size_t key_sz = cfg->key_sz;
+	uint64_t start;
+	unsigned int n;
+	size_t sz;
+	size_t i;
+
+	if (cfg->algo == TA_AES_ALGO_XTS)
+		key_sz *= 2;
+
+	memset(key, 0xa5, sizeof(key));
+	memset(key + cfg->key_sz, 0x3c, sizeof(key) - cfg->key_sz);
+	memset(iv, 0, sizeof(iv));
+
+	/* Sessions use their default context, prepared once for all sizes */
+	for (n = 0; n < cfg->sessions; n++) {
+		prepare_tee_session(&bt->sess[n].ctx);
+		prepare_aes(&bt->sess[n].ctx, TA_AES_DEFAULT_CONTEXT,
+			    cfg->algo, ENCODE);
+		set_key(&bt->sess[n].ctx, TA_AES_DEFAULT_CONTEXT, key, key_sz);
+		if (cfg->algo != TA_AES_ALGO_XTS)
+			set_iv(&bt->sess[n].ctx, TA_AES_DEFAULT_CONTEXT,
+			       iv, sizeof(iv));
+	}
+
+	for (sz = cfg->min_sz; sz; sz = bench_next_size(cfg, sz)) {
+		for (n = 0; n < cfg->sessions; n++)
+			bench_alloc_buffer(cfg, &bt->sess[n], sz);
+
+		bt->lat_count = bench_ops(cfg, sz);
+
+		pthread_barrier_wait(bt->barrier);
+
+		for (i = 0; i < bt->lat_count; i++) {
+			start = bench_now_ns();
+			bench_cipher(cfg, &bt->sess[i % cfg->sessions], sz);
+			bt->lat[i] = bench_now_ns() - start;
+		}
+
+		pthread_barrier_wait(bt->barrier);
+
+		/* Main thread collects the latencies */
+		pthread_barrier_wait(bt->barrier);
+
+		for (n = 0; n < cfg->sessions; n++)
+			bench_free_buffer(cfg, &bt->sess[n]);
+	}
+
+	for (n = 0; n < cfg->sessions; n++)
+		terminate_tee_session(&bt->sess[n].ctx);
+
+	return NULL;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Percentile @p (per thousand) of @count sorted values, in microseconds */
+static double bench_percentile(uint64_t *lat, size_t count, unsigned int p)
+{
+	size_t idx = (count * p + 999) / 1000;
+
+	if (idx)
+		idx--;
+
+	return lat[idx] / 1000.0;
+}
+
+void run_bench(struct bench_cfg *cfg)
+{
+	struct bench_thread *bt;
+	pthread_barrier_t barrier;
+	uint64_t *lat;
+	uint64_t start;
+	double secs;
+	size_t count;
+	unsigned int n;
+	size_t sz;
+	int rc;
+
+	bt = calloc(cfg->threads, sizeof(*bt));
+	lat = calloc((size_t)cfg->threads * cfg->iterations, sizeof(*lat));
+	if (!bt || !lat)
+		errx(1, "Cannot allocate benchmark state");
+
+	rc = pthread_barrier_init(&barrier, NULL, cfg->threads + 1);
+	if (rc)
+		errx(1, "pthread_barrier_init failed %d", rc);
+
+	for (n = 0; n < cfg->threads; n++) {
+		bt[n].cfg = cfg;
+		bt[n].barrier = &barrier;
+		bt[n].sess = calloc(cfg->sessions, sizeof(*bt[n].sess));
+		bt[n].lat = calloc(cfg->iterations, sizeof(*bt[n].lat));
+		if (!bt[n].sess || !bt[n].lat)
+			errx(1, "Cannot allocate benchmark state");
+
+		rc = pthread_create(&bt[n].thread, NULL, bench_thread_run,
+				    bt + n);
+		if (rc)
+			errx(1, "pthread_create failed %d", rc);
+	}
+
+	printf("{\n");
+	printf("  \"algo\": \"%s\",\n", cfg->algo_name);
+	printf("  \"key_bits\": %zu,\n", cfg->key_sz * 8);
+	printf("  \"shm\": \"%s\",\n", bench_shm_names[cfg->shm_type]);
+	printf("  \"threads\": %u,\n", cfg->threads);
+	printf("  \"sessions_per_thread\": %u,\n", cfg->sessions);
+	printf("  \"results\": [");
+
+	for (sz = cfg->min_sz; sz; sz = bench_next_size(cfg, sz)) {
+		pthread_barrier_wait(&barrier);
+		start = bench_now_ns();
+		pthread_barrier_wait(&barrier);
+		secs = (bench_now_ns() - start) / 1e9;
+
+		count = 0;
+		for (n = 0; n < cfg->threads; n++) {
+			memcpy(lat + count, bt[n].lat,
+			       bt[n].lat_count * sizeof(*lat));
+			count += bt[n].lat_count;
+		}
+		pthread_barrier_wait(&barrier);
+
+		qsort(lat, count, sizeof(*lat), bench_cmp_u64);
+
+		printf("%s\n    { \"size\": %zu, \"ops\": %zu, "
+		       "\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+		       "\"ops_per_s\": %.1f, \"p50_us\": %.1f, "
+		       "\"p99_us\": %.1f, \"p999_us\": %.1f }",
+		       sz == cfg->min_sz ? "" : ",", sz, count, secs,
+		       count * sz / secs / 1e6, count / secs,
+		       bench_percentile(lat, count, 500),
+		       bench_percentile(lat, count, 990),
+		       bench_percentile(lat, count, 999));
+		fflush(stdout);
+	}
+
+	printf("\n  ]\n}\n");
+
+	for (n = 0; n < cfg->threads; n++) {
+		pthread_join(bt[n].thread, NULL);
+		free(bt[n].sess);
+		free(bt[n].lat);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(lat);
+	free(bt);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--bench [options]]\n"
+		"       %s --encrypt|--decrypt [options] INPUT OUTPUT\n"
+		"Without argument, run the AES examples.\n"
+		"\n"
+		"Benchmark options:\n"
+		"  --threads N       client threads (default 1)\n"
+		"  --sessions N      TA sessions per thread (default 1)\n"
+		"  --min-size BYTES  smallest buffer size (default %d)\n"
+		"  --max-size BYTES  largest buffer size (default %d),\n"
+		"                    sizes double from the smallest one\n"
+		"  --iterations N    operations per thread and size (default %d),\n"
+		"                    bounded to %d MiB per thread and size\n"
+		"  --algo NAME       ecb, cbc, ctr or xts (default ctr), xts\n"
+		"                    needs a smallest size dividing %d or\n"
+		"                    multiple of it\n"
+		"  --key-size BITS   128 or 256 (default 128)\n"
+		"  --shm TYPE        tmp, alloc or reg (default tmp)\n"
+		"\n"
+		"File options (AES-CTR):\n"
+		"  --key HEX         128 or 256 bit key (default example key)\n"
+		"  --iv HEX          128 bit initial counter (default zero)\n"
+		"  --chunk-size BYTES  bytes per TA invocation (default %d)\n"
+		"  --buffers N       buffers in flight, 2 to %d (default %d)\n",
+		prog, prog, BENCH_MIN_SIZE, BENCH_MAX_SIZE, BENCH_ITERATIONS,
+		BENCH_BYTES_PER_SIZE / (1024 * 1024), BENCH_XTS_SECTOR_SIZE,
+		PIPE_CHUNK_SIZE, PIPE_MAX_BUFFERS, PIPE_BUFFERS);
+	exit(1);
+}
+
+/* Parse a number from 1 to @max */
+static unsigned long parse_num(const char *prog, const char *arg,
+			       unsigned long max)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 0);
+	if (!*arg || *end || errno || !val || val > max)
+		usage(prog);
+
+	return val;
+}
+
+/*
+ * File ciphering (--encrypt/--decrypt): a reader thread fills shared
+ * memory buffers from the input file, the main thread ciphers them in
+ * place in the TA and a writer thread drains them to the output file.
+ * With several buffers in flight, disk I/O overlaps the TA invocations.
+ */
+struct pipe_cfg {
+	int encode;
+	const char *in_path;
+	const char *out_path;
+	char key[TA_AES_SIZE_256BIT];
+	size_t key_sz;
+	char iv[AES_BLOCK_SIZE];
+	size_t chunk_sz;
+	unsigned int buffers;
+};
+
+struct pipe_buf {
+	TEEC_SharedMemory shm;
+	size_t len;
+	bool last;
+};
+
+/* FIFO of buffer indexes handed over from one stage to the next */
+struct pipe_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int slot[PIPE_MAX_BUFFERS];
+	unsigned int head;
+	unsigned int count;
+};
+
+struct pipe_state {
+	struct pipe_cfg *cfg;
+	struct pipe_buf buf[PIPE_MAX_BUFFERS];
+	struct pipe_queue free_q;	/* reader <- writer */
+	struct pipe_queue read_q;	/* reader -> cipher */
+	struct pipe_queue write_q;	/* cipher -> writer */
+	int in_fd;
+	int out_fd;
+};
+
+static void pipe_queue_init(struct pipe_queue *q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+static void pipe_queue_destroy(struct pipe_queue *q)
+{
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+}
+
+static void pipe_queue_push(struct pipe_queue *q, unsigned int idx)
+{
+	pthread_mutex_lock(&q->lock);
+	q->slot[(q->head + q->count) % PIPE_MAX_BUFFERS] = idx;
+	q->count++;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static unsigned int pipe_queue_pop(struct pipe_queue *q)
+{
+	unsigned int idx;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->count)
+		pthread_cond_wait(&q->cond, &q->lock);
+	idx = q->slot[q->head];
+	q->head = (q->head + 1) % PIPE_MAX_BUFFERS;
+	q->count--;
+	pthread_mutex_unlock(&q->lock);
+
+	return idx;
+}
+
+static void *pipe_reader(void *arg)
+{
+	struct pipe_state *ps = arg;
+	struct pipe_buf *pb;
+	unsigned int idx;
+	ssize_t n;
+
+	do {
+		idx = pipe_queue_pop(&ps->free_q);
+		pb = ps->buf + idx;
+
+		/* Fill the whole chunk: only the last one can be short */
+		pb->len = 0;
+		do {
+			n = read(ps->in_fd, (char *)pb->shm.buffer + pb->len,
+				 ps->cfg->chunk_sz - pb->len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				err(1, "Cannot read %s", ps->cfg->in_path);
+			pb->len += n;
+		} while (n && pb->len < ps->cfg->chunk_sz);
+		pb->last = !n;
+
+		pipe_queue_push(&ps->read_q, idx);
+	} while (!pb->last);
+
+	return NULL;
+}
+
+static void *pipe_writer(void *arg)
+{
+	struct pipe_state *ps = arg;
+	struct pipe_buf *pb;
+	unsigned int idx;
+	size_t done;
+	bool last;
+	ssize_t n;
+
+	do {
+		idx = pipe_queue_pop(&ps->write_q);
+		pb = ps->buf + idx;
+
+		for (done = 0; done < pb->len; done += n) {
+			n = write(ps->out_fd, (char *)pb->shm.buffer + done,
+				  pb->len - done);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n < 0)
+				err(1, "Cannot write %s", ps->cfg->out_path);
+		}
+
+		/* The reader owns the buffer again once pushed */
+		last = pb->last;
+		pipe_queue_push(&ps->free_q, idx);
+	} while (!last);
+
+	return NULL;
+}
+
+static void pipe_cipher(struct test_ctx *ctx, struct pipe_buf *pb)
+{
+	uint32_t cmd = pb->last ? TA_AES_CMD_CIPHER_FINAL : TA_AES_CMD_CIPHER;
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INOUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+	op.params[0].memref.parent = &pb->shm;
+	op.params[0].memref.offset = 0;
+	op.params[0].memref.size = pb->len;
+
+	res = TEEC_InvokeCommand(&ctx->sess, cmd, &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(0x%x) failed 0x%x origin 0x%x",
+			cmd, res, origin);
+
+	pb->len = op.params[0].memref.size;
+}
+
+/* AES-CTR file ciphering, CTR needs no padding of the last chunk */
+void run_pipeline(struct pipe_cfg *cfg)
+{
+	struct pipe_state ps;
+	struct test_ctx ctx;
+	pthread_t reader;
+	pthread_t writer;
+	struct pipe_buf *pb;
+	unsigned int n;
+	bool last;
+	int rc;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.cfg = cfg;
+
+	ps.in_fd = open(cfg->in_path, O_RDONLY);
+	if (ps.in_fd < 0)
+		err(1, "Cannot open %s", cfg->in_path);
+	ps.out_fd = open(cfg->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (ps.out_fd < 0)
+		err(1, "Cannot open %s", cfg->out_path);
+
+	prepare_tee_session(&ctx);
+	prepare_aes(&ctx, TA_AES_DEFAULT_CONTEXT, TA_AES_ALGO_CTR, cfg->encode);
+	set_key(&ctx, TA_AES_DEFAULT_CONTEXT, cfg->key, cfg->key_sz);
+	set_iv(&ctx, TA_AES_DEFAULT_CONTEXT, cfg->iv, AES_BLOCK_SIZE);
+
+	pipe_queue_init(&ps.free_q);
+	pipe_queue_init(&ps.read_q);
+	pipe_queue_init(&ps.write_q);
+
+	for (n = 0; n < cfg->buffers; n++) {
+		prepare_shm(&ctx, &ps.buf[n].shm, NULL, cfg->chunk_sz);
+		pipe_queue_push(&ps.free_q, n);
+	}
+
+	rc = pthread_create(&reader, NULL, pipe_reader, &ps);
+	if (!rc)
+		rc = pthread_create(&writer, NULL, pipe_writer, &ps);
+	if (rc)
+		errx(1, "pthread_create failed %d", rc);
+
+	do {
+		pb = ps.buf + pipe_queue_pop(&ps.read_q);
+		pipe_cipher(&ctx, pb);
+		last = pb->last;
+		pipe_queue_push(&ps.write_q, pb - ps.buf);
+	} while (!last);
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+
+	if (close(ps.out_fd))
+		err(1, "Cannot write %s", cfg->out_path);
+	close(ps.in_fd);
+
+	for (n = 0; n < cfg->buffers; n++)
+		TEEC_ReleaseSharedMemory(&ps.buf[n].shm);
+
+	pipe_queue_destroy(&ps.free_q);
+	pipe_queue_destroy(&ps.read_q);
+	pipe_queue_destroy(&ps.write_q);
+
+	terminate_tee_session(&ctx);
+}
+
+/* Parse a hexadecimal string of exactly @max or @min bytes */
+static size_t parse_hex(const char *prog, const char *arg, char *buf,
+			size_t min, size_t max)
+{
+	size_t len = strlen(arg) / 2;
+	unsigned int byte;
+	size_t n;
+
+	if (strlen(arg) % 2 || (len != min && len != max))
+		usage(prog);
+
+	for (n = 0; n < len; n++) {
+		if (!isxdigit(arg[2 * n]) || !isxdigit(arg[2 * n + 1]) ||
+		    sscanf(arg + 2 * n, "%2x", &byte) != 1)
+			usage(prog);
+		buf[n] = byte;
+	}
+
+	return len;
+}
+
+/*
+ * AES-CTR ciphering of a buffer split in chunks, each chunk being ciphered
+ * by its own thread and session from its keystream block offset. Sessions
+ * are independent TA instances, which OP-TEE runs on different cores.
+ */
+struct ctr_chunk {
+	pthread_t thread;
+	char *key;
+	size_t key_sz;
+	char *nonce;
+	char *buf;
+	size_t offset;
+	size_t sz;
+};
+
+static void *ctr_chunk_run(void *arg)
+{
+	struct ctr_chunk *chunk = arg;
+	struct test_ctx ctx;
+
+	prepare_tee_session(&ctx);
+	prepare_aes(&ctx, TA_AES_DEFAULT_CONTEXT, TA_AES_ALGO_CTR, ENCODE);
+	set_key(&ctx, TA_AES_DEFAULT_CONTEXT, chunk->key, chunk->key_sz);
+	ctr_seek(&ctx, TA_AES_DEFAULT_CONTEXT, chunk->nonce,
+		 chunk->offset / AES_BLOCK_SIZE);
+	cipher_final(&ctx, TA_AES_DEFAULT_CONTEXT,
+		     chunk->buf + chunk->offset, chunk->sz);
+	terminate_tee_session(&ctx);
+
+	return NULL;
+}
+
+/* CTR encoding and decoding are the same operation */
+void cipher_ctr_parallel(char *key, size_t key_sz, char *nonce,
+			 char *buf, size_t sz, unsigned int threads)
+{
+	struct ctr_chunk chunk[AES_PARALLEL_MAX_THREADS];
+	/* Chunks start on a block boundary, only the last one is partial */
+	size_t chunk_sz = (sz / threads + AES_BLOCK_SIZE - 1) &
+			  ~(size_t)(AES_BLOCK_SIZE - 1);
+	size_t offset = 0;
+	unsigned int n;
+	int rc;
+
+	for (n = 0; n < threads && offset < sz; n++) {
+		chunk[n].key = key;
+		chunk[n].key_sz = key_sz;
+		chunk[n].nonce = nonce;
+		chunk[n].buf = buf;
+		chunk[n].offset = offset;
+		chunk[n].sz = sz - offset < chunk_sz ? sz - offset : chunk_sz;
+		offset += chunk[n].sz;
+
+		rc = pthread_create(&chunk[n].thread, NULL, ctr_chunk_run,
+				    chunk + n);
+		if (rc)
+			errx(1, "pthread_create failed %d", rc);
+	}
+
+	while (n--)
+		pthread_join(chunk[n].thread, NULL);
+}
+
+/*
+ * Multi-stream dispatcher: client threads submit small requests on their
+ * own contexts, a dispatcher thread gathers the pending ones for up to a
+ * latency budget, or until the table is full, and ciphers them all with
+ * a single TA_AES_CMD_CIPHER_MULTI invocation.
+ */
+#define MULTI_MAX_REQUESTS	32
+#define MULTI_MAX_MSG_SIZE	4096
+#define MULTI_BUDGET_US		200
+#define MULTI_FLOWS		4
+#define MULTI_FLOW_MESSAGES	64
+#define MULTI_MSG_SIZE		64
+
+struct multi_req {
+	uint32_t aes_ctx;
+	uint32_t flags;		/* TA_AES_MULTI_FLAG_xxx */
+	char iv[AES_BLOCK_SIZE];
+	char *buf;
+	size_t sz;
+	uint32_t status;
+	bool done;
+};
+
+struct multi_disp {
+	struct test_ctx *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t submit_cond;	/* Wakes the dispatcher */
+	pthread_cond_t done_cond;	/* Wakes the clients */
+	struct multi_req *pending[MULTI_MAX_REQUESTS];
+	unsigned int count;
+	uint64_t budget_ns;
+	bool stop;
+	unsigned int invokes;
+	unsigned int requests;
+};
+
+static void multi_invoke(struct multi_disp *d, struct multi_req **reqs,
+			 unsigned int count, struct aes_multi_request *table,
+			 char *data)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+	size_t offset = 0;
+	size_t end = 0;
+	unsigned int n;
+
+	/*
+	 * Pack the messages, each starting on a block boundary, so that
+	 * only the bytes in use are copied to and from the TA.
+	 */
+	memset(table, 0, count * sizeof(*table));
+	for (n = 0; n < count; n++) {
+		table[n].handle = reqs[n]->aes_ctx;
+		table[n].flags = reqs[n]->flags;
+		table[n].offset = offset;
+		table[n].size = reqs[n]->sz;
+		memcpy(table[n].iv, reqs[n]->iv, AES_BLOCK_SIZE);
+		memcpy(data + offset, reqs[n]->buf, reqs[n]->sz);
+		end = offset + reqs[n]->sz;
+		offset = (end + AES_BLOCK_SIZE - 1) &
+			 ~(size_t)(AES_BLOCK_SIZE - 1);
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_NONE, TEEC_NONE);
+	op.params[0].tmpref.buffer = table;
+	op.params[0].tmpref.size = count * sizeof(*table);
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = end;
+
+	res = TEEC_InvokeCommand(&d->ctx->sess, TA_AES_CMD_CIPHER_MULTI,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_InvokeCommand(CIPHER_MULTI) failed 0x%x origin 0x%x",
+			res, origin);
+
+	for (n = 0; n < count; n++) {
+		memcpy(reqs[n]->buf, data + table[n].offset, reqs[n]->sz);
+		reqs[n]->status = table[n].status;
+	}
+}
+
+static void *multi_dispatch(void *arg)
+{
+	struct multi_req *reqs[MULTI_MAX_REQUESTS];
+	struct aes_multi_request *table;
+	struct multi_disp *d = arg;
+	struct timespec deadline;
+	unsigned int count;
+	unsigned int n;
+	uint64_t ns;
+	char *data;
+
+	table = calloc(MULTI_MAX_REQUESTS, sizeof(*table));
+	data = malloc(MULTI_MAX_REQUESTS * MULTI_MAX_MSG_SIZE);
+	if (!table || !data)
+		errx(1, "Cannot allocate dispatcher buffers");
+
+	pthread_mutex_lock(&d->lock);
+	while (true) {
+		while (!d->count && !d->stop)
+			pthread_cond_wait(&d->submit_cond, &d->lock);
+		if (!d->count)
+			break;
+
+		/* Let more requests come, up to the latency budget */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		ns = deadline.tv_nsec + d->budget_ns;
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		while (d->count < MULTI_MAX_REQUESTS && !d->stop)
+			if (pthread_cond_timedwait(&d->submit_cond, &d->lock,
+						   &deadline))
+				break;
+
+		count = d->count;
+		memcpy(reqs, d->pending, count * sizeof(*reqs));
+		d->count = 0;
+		d->invokes++;
+		d->requests += count;
+		/* Room for new requests while the TA works */
+		pthread_cond_broadcast(&d->done_cond);
+		pthread_mutex_unlock(&d->lock);
+
+		multi_invoke(d, reqs, count, table, data);
+
+		pthread_mutex_lock(&d->lock);
+		for (n = 0; n < count; n++)
+			reqs[n]->done = true;
+		pthread_cond_broadcast(&d->done_cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	free(table);
+	free(data);
+	return NULL;
+}
+
+void multi_start(struct multi_disp *d, struct test_ctx *ctx,
+		 uint64_t budget_us)
+{
+	int rc;
+
+	memset(d, 0, sizeof(*d));
+	d->ctx = ctx;
+	d->budget_ns = budget_us * 1000;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->submit_cond, NULL);
+	pthread_cond_init(&d->done_cond, NULL);
+
+	rc = pthread_create(&d->thread, NULL, multi_dispatch, d);
+	if (rc)
+		errx(1, "pthread_create failed %d", rc);
+}
+
+void multi_stop(struct multi_disp *d)
+{
+	pthread_mutex_lock(&d->lock);
+	d->stop = true;
+	pthread_cond_signal(&d->submit_cond);
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_join(d->thread, NULL);
+	pthread_cond_destroy(&d->done_cond);
+	pthread_cond_destroy(&d->submit_cond);
+	pthread_mutex_destroy(&d->lock);
+}
+
+/* Cipher a request through the dispatcher, returns its TA status */
+uint32_t multi_submit(struct multi_disp *d, struct multi_req *req)
+{
+	if (req->sz > MULTI_MAX_MSG_SIZE)
+		errx(1, "Request of %zu bytes too large", req->sz);
+
+	pthread_mutex_lock(&d->lock);
+	while (d->count == MULTI_MAX_REQUESTS)
+		pthread_cond_wait(&d->done_cond, &d->lock);
+
+	req->done = false;
+	d->pending[d->count++] = req;
+	pthread_cond_signal(&d->submit_cond);
+
+	while (!req->done)
+		pthread_cond_wait(&d->done_cond, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+
+	return req->status;
+}
+
+struct multi_flow {
+	pthread_t thread;
+	struct multi_disp *disp;
+	uint32_t aes_ctx;
+	char key[AES_TEST_KEY_SIZE];
+	char msg[MULTI_FLOW_MESSAGES][MULTI_MSG_SIZE];
+};
+
+/* Each flow encodes its messages with its own key, one IV per message */
+static void *multi_flow_run(void *arg)
+{
+	struct multi_flow *flow = arg;
+	struct multi_req req;
+	unsigned int n;
+
+	for (n = 0; n < MULTI_FLOW_MESSAGES; n++) {
+		memset(&req, 0, sizeof(req));
+		req.aes_ctx = flow->aes_ctx;
+		req.flags = TA_AES_MULTI_FLAG_IV | TA_AES_MULTI_FLAG_FINAL;
+		req.iv[AES_BLOCK_SIZE - 1] = n;
+		req.buf = flow->msg[n];
+		req.sz = MULTI_MSG_SIZE;
+
+		if (multi_submit(flow->disp, &req))
+			errx(1, "Request failed 0x%x", req.status);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run concurrent flows through the dispatcher then check each message
+ * against a one shot encoding.
+ */
+void run_multi_demo(struct test_ctx *ctx, char *key)
+{
+	struct multi_flow *flow;
+	struct multi_disp disp;
+	char iv[AES_BLOCK_SIZE];
+	char buf[MULTI_MSG_SIZE];
+	bool ok = true;
+	unsigned int n;
+	unsigned int m;
+	int rc;
+
+	flow = calloc(MULTI_FLOWS, sizeof(*flow));
+	if (!flow)
+		errx(1, "Cannot allocate flows");
+
+	multi_start(&disp, ctx, MULTI_BUDGET_US);
+
+	for (n = 0; n < MULTI_FLOWS; n++) {
+		flow[n].disp = &disp;
+		memcpy(flow[n].key, key, AES_TEST_KEY_SIZE);
+		flow[n].key[0] ^= n;
+		memset(flow[n].msg, 0x5a, sizeof(flow[n].msg));
+
+		flow[n].aes_ctx = alloc_aes_ctx(ctx);
+		prepare_aes(ctx, flow[n].aes_ctx, TA_AES_ALGO_CTR, ENCODE);
+		set_key(ctx, flow[n].aes_ctx, flow[n].key, AES_TEST_KEY_SIZE);
+
+		rc = pthread_create(&flow[n].thread, NULL, multi_flow_run,
+				    flow + n);
+		if (rc)
+			errx(1, "pthread_create failed %d", rc);
+	}
+
+	for (n = 0; n < MULTI_FLOWS; n++)
+		pthread_join(flow[n].thread, NULL);
+
+	multi_stop(&disp);
+
+	for (n = 0; n < MULTI_FLOWS; n++) {
+		for (m = 0; m < MULTI_FLOW_MESSAGES; m++) {
+			memset(iv, 0, sizeof(iv));
+			iv[AES_BLOCK_SIZE - 1] = m;
+			memset(buf, 0x5a, sizeof(buf));
+			cipher_oneshot(ctx, ENCODE, flow[n].key,
+				       AES_TEST_KEY_SIZE, iv, AES_BLOCK_SIZE,
+				       buf, sizeof(buf));
+			if (memcmp(buf, flow[n].msg[m], sizeof(buf)))
+				ok = false;
+		}
+		free_aes_ctx(ctx, flow[n].aes_ctx);
+	}
+
+	if (!ok)
+		printf("Multi-stream and one shot encoded text differ => ERROR\n");
+	else
+		printf("Multi-stream and one shot encoded text match "
+		       "(%u requests in %u invocations)\n",
+		       disp.requests, disp.invokes);
+
+	free(flow);
+}
+
+void run_demo(void)
+{
+	struct test_ctx ctx;
+	char key[AES_TEST_KEY_SIZE];
+	char xts_key[2 * AES_TEST_KEY_SIZE];
+	char mac_key[AES_TEST_MAC_KEY_SIZE];
+	char mac_tag[TA_AES_MAC_TAG_SIZE];
+	char auto_iv[2][AES_BLOCK_SIZE];
+	struct aes_frame_header frame_hdr;
+	char *sealed;
+	char *seq_buf;
+	char *par_buf;
+	unsigned int threads;
+	uint64_t seq_ns;
+	uint64_t par_ns;
+	char iv[AES_BLOCK_SIZE];
+	char clear[AES_TEST_BUFFER_SIZE];
+	char ciph[AES_TEST_BUFFER_SIZE];
+	char temp[AES_TEST_BUFFER_SIZE];
+	char aad[] = "Authenticated but not encrypted";
+	char tag[AES_GCM_TAG_SIZE];
+	TEEC_Result res;
+	struct aes_batch_segment segs[AES_TEST_RECORD_COUNT];
+	TEEC_SharedMemory shm;
+	uint32_t enc_ctx;
+	uint32_t dec_ctx;
+
+	printf("Prepare session with the TA\n");
+	prepare_tee_session(&ctx);
+
+	printf("Prepare encode operation\n");
+	prepare_aes(&ctx, TA_AES_DEFAULT_CONTEXT, TA_AES_ALGO_CTR, ENCODE);
+
+	printf("Load key in TA\n");
+	memset(key, 0xa5, sizeof(key)); /* Load some dummy value */
+	set_key(&ctx, TA_AES_DEFAULT_CONTEXT, key, AES_TEST_KEY_SIZE);
+
+	printf("Reset ciphering operation in TA (provides the initial vector)\n");
+	memset(iv, 0, sizeof(iv)); /* Load some dummy value */
+	set_iv(&ctx, TA_AES_DEFAULT_CONTEXT, iv, AES_BLOCK_SIZE);
+
+	printf("Encode buffer from TA\n");
+	memset(clear, 0x5a, sizeof(clear)); /* Load some dummy value */
+	cipher_buffer(&ctx, TA_AES_DEFAULT_CONTEXT,
+		      clear, ciph, AES_TEST_BUFFER_SIZE);
+
+	printf("Prepare decode operation\n");
+	prepare_aes(&ctx, TA_AES_DEFAULT_CONTEXT, TA_AES_ALGO_CTR, DECODE);
+
+	printf("Load key in TA\n");
+	memset(key, 0xa5, sizeof(key)); /* Load some dummy value */
+	set_key(&ctx, TA_AES_DEFAULT_CONTEXT, key, AES_TEST_KEY_SIZE);
+
+	printf("Reset ciphering operation in TA (provides the initial vector)\n");
+	memset(iv, 0, sizeof(iv)); /* Load some dummy value */
+	set_iv(&ctx, TA_AES_DEFAULT_CONTEXT, iv, AES_BLOCK_SIZE);
+
+	printf("Decode buffer from TA\n");
+	cipher_buffer(&ctx, TA_AES_DEFAULT_CONTEXT,
+		      ciph, temp, AES_TEST_BUFFER_SIZE);
+
+	/* Check decoded is the clear content */
+	if (memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and decoded text differ => ERROR\n");
+	else
+		printf("Clear text and decoded text match\n");
+
+	printf("Prepare encode and decode contexts, loaded once for all\n");
+	enc_ctx = alloc_aes_ctx(&ctx);
+	prepare_aes(&ctx, enc_ctx, TA_AES_ALGO_CTR, ENCODE);
+	set_key(&ctx, enc_ctx, key, AES_TEST_KEY_SIZE);
+	dec_ctx = alloc_aes_ctx(&ctx);
+	prepare_aes(&ctx, dec_ctx, TA_AES_ALGO_CTR, DECODE);
+	set_key(&ctx, dec_ctx, key, AES_TEST_KEY_SIZE);
+
+	printf("Encode %d records in a single batch from TA\n",
+	       AES_TEST_RECORD_COUNT);
+	build_batch_table(segs, AES_TEST_RECORD_COUNT, AES_TEST_RECORD_SIZE, iv);
+	memcpy(temp, clear, sizeof(temp));
+	cipher_batch(&ctx, enc_ctx, segs, AES_TEST_RECORD_COUNT,
+		     temp, sizeof(temp));
+
+	printf("Decode %d records in a single batch from TA\n",
+	       AES_TEST_RECORD_COUNT);
+	cipher_batch(&ctx, dec_ctx, segs, AES_TEST_RECORD_COUNT,
+		     temp, sizeof(temp));
+
+	if (memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and batch decoded text differ => ERROR\n");
+	else
+		printf("Clear text and batch decoded text match\n");
+
+	printf("Encode buffer in place in shared memory from TA\n");
+	prepare_shm(&ctx, &shm, NULL, AES_TEST_BUFFER_SIZE);
+	memcpy(shm.buffer, clear, AES_TEST_BUFFER_SIZE);
+	set_iv(&ctx, enc_ctx, iv, AES_BLOCK_SIZE);
+	cipher_shm(&ctx, enc_ctx, &shm, 0, AES_TEST_BUFFER_SIZE);
+
+	printf("Decode buffer in place in shared memory from TA\n");
+	set_iv(&ctx, dec_ctx, iv, AES_BLOCK_SIZE);
+	cipher_shm(&ctx, dec_ctx, &shm, 0, AES_TEST_BUFFER_SIZE);
+
+	if (memcmp(clear, shm.buffer, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and in place decoded text differ => ERROR\n");
+	else
+		printf("Clear text and in place decoded text match\n");
+
+	TEEC_ReleaseSharedMemory(&shm);
+
+	printf("Authenticated encode then decode buffer (AES-GCM) from TA\n");
+	prepare_aes(&ctx, enc_ctx, TA_AES_ALGO_GCM, ENCODE);
+	set_key(&ctx, enc_ctx, key, AES_TEST_KEY_SIZE);
+	prepare_aes(&ctx, dec_ctx, TA_AES_ALGO_GCM, DECODE);
+	set_key(&ctx, dec_ctx, key, AES_TEST_KEY_SIZE);
+
+	gcm_buffer(&ctx, enc_ctx, ENCODE, iv, aad, sizeof(aad),
+		   clear, ciph, AES_TEST_BUFFER_SIZE, tag);
+	res = gcm_buffer(&ctx, dec_ctx, DECODE, iv, aad, sizeof(aad),
+			 ciph, temp, AES_TEST_BUFFER_SIZE, tag);
+	if (res != TEEC_SUCCESS || memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and GCM decoded text differ => ERROR\n");
+	else
+		printf("Clear text and GCM decoded text match\n");
+
+	ciph[0] ^= 1;
+	res = gcm_buffer(&ctx, dec_ctx, DECODE, iv, aad, sizeof(aad),
+			 ciph, temp, AES_TEST_BUFFER_SIZE, tag);
+	if (res != TEEC_ERROR_MAC_INVALID)
+		printf("Tampered GCM text not detected => ERROR\n");
+	else
+		printf("Tampered GCM text rejected\n");
+
+	printf("Seal buffer in %d frames then open frames 2 and 3 only\n",
+	       AES_FRAME_COUNT);
+	sealed = malloc(AES_FRAME_COUNT * AES_SEALED_FRAME_SIZE);
+	if (!sealed)
+		errx(1, "Cannot allocate sealed frames");
+	frame_init(&ctx, enc_ctx, AES_FRAME_SIZE, AES_TEST_BUFFER_SIZE,
+		   &frame_hdr);
+	frame_cipher(&ctx, enc_ctx, ENCODE, 0, clear, AES_TEST_BUFFER_SIZE,
+		     sealed, AES_FRAME_COUNT * AES_SEALED_FRAME_SIZE);
+
+	/* Only the header and the sealed frames of the range are needed */
+	frame_load(&ctx, dec_ctx, &frame_hdr);
+	res = frame_cipher(&ctx, dec_ctx, DECODE, 2,
+			   sealed + 2 * AES_SEALED_FRAME_SIZE,
+			   2 * AES_SEALED_FRAME_SIZE, temp, 2 * AES_FRAME_SIZE);
+	if (res != TEEC_SUCCESS ||
+	    memcmp(clear + 2 * AES_FRAME_SIZE, temp, 2 * AES_FRAME_SIZE))
+		printf("Clear text and frame range text differ => ERROR\n");
+	else
+		printf("Clear text and frame range text match\n");
+
+	/* A frame opened at another index does not authenticate */
+	res = frame_cipher(&ctx, dec_ctx, DECODE, 1,
+			   sealed + 2 * AES_SEALED_FRAME_SIZE,
+			   AES_SEALED_FRAME_SIZE, temp, AES_FRAME_SIZE);
+	if (res != TEEC_ERROR_MAC_INVALID)
+		printf("Moved frame not detected => ERROR\n");
+	else
+		printf("Moved frame rejected\n");
+	free(sealed);
+
+	printf("Encode then decode %d sectors (AES-XTS) in one call from TA\n",
+	       AES_TEST_BUFFER_SIZE / AES_XTS_SECTOR_SIZE);
+	memcpy(xts_key, key, AES_TEST_KEY_SIZE);
+	memset(xts_key + AES_TEST_KEY_SIZE, 0x3c, AES_TEST_KEY_SIZE);
+	prepare_aes(&ctx, enc_ctx, TA_AES_ALGO_XTS, ENCODE);
+	set_key(&ctx, enc_ctx, xts_key, sizeof(xts_key));
+	prepare_aes(&ctx, dec_ctx, TA_AES_ALGO_XTS, DECODE);
+	set_key(&ctx, dec_ctx, xts_key, sizeof(xts_key));
+
+	memcpy(temp, clear, sizeof(temp));
+	cipher_xts_sectors(&ctx, enc_ctx, AES_XTS_START_SECTOR,
+			   AES_XTS_SECTOR_SIZE, temp, sizeof(temp));
+	cipher_xts_sectors(&ctx, dec_ctx, AES_XTS_START_SECTOR,
+			   AES_XTS_SECTOR_SIZE, temp, sizeof(temp));
+
+	if (memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and XTS decoded text differ => ERROR\n");
+	else
+		printf("Clear text and XTS decoded text match\n");
+
+	printf("Encrypt-then-MAC then verify-then-decrypt buffer from TA\n");
+	memset(mac_key, 0x6b, sizeof(mac_key)); /* Load some dummy value */
+	prepare_aes(&ctx, enc_ctx, TA_AES_ALGO_CBC, ENCODE);
+	set_key(&ctx, enc_ctx, key, AES_TEST_KEY_SIZE);
+	set_mac_key(&ctx, enc_ctx, mac_key, sizeof(mac_key));
+	prepare_aes(&ctx, dec_ctx, TA_AES_ALGO_CBC, DECODE);
+	set_key(&ctx, dec_ctx, key, AES_TEST_KEY_SIZE);
+	set_mac_key(&ctx, dec_ctx, mac_key, sizeof(mac_key));
+
+	memcpy(ciph, clear, sizeof(ciph));
+	cipher_mac(&ctx, enc_ctx, iv, ciph, AES_TEST_BUFFER_SIZE, mac_tag);
+	res = decrypt_verify(&ctx, dec_ctx, iv, ciph, temp,
+			     AES_TEST_BUFFER_SIZE, mac_tag);
+	if (res != TEEC_SUCCESS || memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and MAC checked text differ => ERROR\n");
+	else
+		printf("Clear text and MAC checked text match\n");
+
+	mac_tag[0] ^= 1;
+	res = decrypt_verify(&ctx, dec_ctx, iv, ciph, temp,
+			     AES_TEST_BUFFER_SIZE, mac_tag);
+	if (res != TEEC_ERROR_MAC_INVALID)
+		printf("Tampered MAC tag not detected => ERROR\n");
+	else
+		printf("Tampered MAC tag rejected\n");
+
+	printf("Encode two messages with IVs picked by the TA\n");
+	prepare_aes(&ctx, enc_ctx, TA_AES_ALGO_CTR, ENCODE);
+	set_key(&ctx, enc_ctx, key, AES_TEST_KEY_SIZE);
+	prepare_aes(&ctx, dec_ctx, TA_AES_ALGO_CTR, DECODE);
+	set_key(&ctx, dec_ctx, key, AES_TEST_KEY_SIZE);
+
+	memcpy(ciph, clear, sizeof(ciph));
+	memcpy(temp, clear, sizeof(temp));
+	cipher_auto_iv(&ctx, enc_ctx, ENCODE, ciph, sizeof(ciph), auto_iv[0]);
+	cipher_auto_iv(&ctx, enc_ctx, ENCODE, temp, sizeof(temp), auto_iv[1]);
+	if (!memcmp(auto_iv[0], auto_iv[1], AES_BLOCK_SIZE) ||
+	    !memcmp(ciph, temp, AES_TEST_BUFFER_SIZE))
+		printf("Messages share an IV => ERROR\n");
+
+	cipher_auto_iv(&ctx, dec_ctx, DECODE, ciph, sizeof(ciph), auto_iv[0]);
+	cipher_auto_iv(&ctx, dec_ctx, DECODE, temp, sizeof(temp), auto_iv[1]);
+	if (memcmp(clear, ciph, AES_TEST_BUFFER_SIZE) ||
+	    memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and TA IV decoded text differ => ERROR\n");
+	else
+		printf("Clear text and TA IV decoded text match\n");
+
+	printf("Encode %d flows of %d messages through a dispatcher from TA\n",
+	       MULTI_FLOWS, MULTI_FLOW_MESSAGES);
+	run_multi_demo(&ctx, key);
+
+	printf("Encode then decode buffer with a key kept in secure storage\n");
+	gen_key(&ctx, AES_TEST_KEY_ID, AES_TEST_KEY_SIZE);
+	prepare_aes(&ctx, enc_ctx, TA_AES_ALGO_CTR, ENCODE);
+	set_key_by_id(&ctx, enc_ctx, AES_TEST_KEY_ID);
+	set_iv(&ctx, enc_ctx, iv, AES_BLOCK_SIZE);
+	prepare_aes(&ctx, dec_ctx, TA_AES_ALGO_CTR, DECODE);
+	set_key_by_id(&ctx, dec_ctx, AES_TEST_KEY_ID);
+	set_iv(&ctx, dec_ctx, iv, AES_BLOCK_SIZE);
+
+	cipher_buffer(&ctx, enc_ctx, clear, ciph, AES_TEST_BUFFER_SIZE);
+	cipher_buffer(&ctx, dec_ctx, ciph, temp, AES_TEST_BUFFER_SIZE);
+
+	if (memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and stored key decoded text differ => ERROR\n");
+	else
+		printf("Clear text and stored key decoded text match\n");
+
+	free_aes_ctx(&ctx, enc_ctx);
+	free_aes_ctx(&ctx, dec_ctx);
+
+	printf("Encode then decode buffer with one shot commands from TA\n");
+	memcpy(temp, clear, sizeof(temp));
+	cipher_oneshot(&ctx, ENCODE, key, AES_TEST_KEY_SIZE,
+		       iv, AES_BLOCK_SIZE, temp, sizeof(temp));
+	cipher_oneshot(&ctx, DECODE, key, AES_TEST_KEY_SIZE,
+		       iv, AES_BLOCK_SIZE, temp, sizeof(temp));
+
+	if (memcmp(clear, temp, AES_TEST_BUFFER_SIZE))
+		printf("Clear text and one shot decoded text differ => ERROR\n");
+	else
+		printf("Clear text and one shot decoded text match\n");
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN) > 1 ?
+		  sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (threads > AES_PARALLEL_MAX_THREADS)
+		threads = AES_PARALLEL_MAX_THREADS;
+	printf("Encode %d bytes sequentially then over %u threads from TA\n",
+	       AES_PARALLEL_SIZE, threads);
+	seq_buf = malloc(AES_PARALLEL_SIZE);
+	par_buf = malloc(AES_PARALLEL_SIZE);
+	if (!seq_buf || !par_buf)
+		errx(1, "Cannot allocate %d bytes", AES_PARALLEL_SIZE);
+	memset(seq_buf, 0x5a, AES_PARALLEL_SIZE);
+	memset(par_buf, 0x5a, AES_PARALLEL_SIZE);
+
+	seq_ns = bench_now_ns();
+	cipher_oneshot(&ctx, ENCODE, key, AES_TEST_KEY_SIZE,
+		       iv, AES_BLOCK_SIZE, seq_buf, AES_PARALLEL_SIZE);
+	seq_ns = bench_now_ns() - seq_ns;
+
+	par_ns = bench_now_ns();
+	cipher_ctr_parallel(key, AES_TEST_KEY_SIZE, iv,
+			    par_buf, AES_PARALLEL_SIZE, threads);
+	par_ns = bench_now_ns() - par_ns;
+
+	if (memcmp(seq_buf, par_buf, AES_PARALLEL_SIZE))
+		printf("Sequential and parallel encoded text differ => ERROR\n");
+	else
+		printf("Sequential and parallel encoded text match "
+		       "(%.1f ms vs %.1f ms)\n", seq_ns / 1e6, par_ns / 1e6);
+	free(seq_buf);
+	free(par_buf);
+
+	print_key_cache_stats(&ctx);
+
+	terminate_tee_session(&ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{ "bench", no_argument, NULL, 'b' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "sessions", required_argument, NULL, 's' },
+		{ "min-size", required_argument, NULL, 'm' },
+		{ "max-size", required_argument, NULL, 'M' },
+		{ "iterations", required_argument, NULL, 'i' },
+		{ "algo", required_argument, NULL, 'a' },
+		{ "key-size", required_argument, NULL, 'k' },
+		{ "shm", required_argument, NULL, 'S' },
+		{ "encrypt", no_argument, NULL, 'e' },
+		{ "decrypt", no_argument, NULL, 'd' },
+		{ "key", required_argument, NULL, 'K' },
+		{ "iv", required_argument, NULL, 'I' },
+		{ "chunk-size", required_argument, NULL, 'c' },
+		{ "buffers", required_argument, NULL, 'B' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct bench_cfg cfg = {
+		.threads = 1,
+		.sessions = 1,
+		.min_sz = BENCH_MIN_SIZE,
+		.max_sz = BENCH_MAX_SIZE,
+		.iterations = BENCH_ITERATIONS,
+		.algo = TA_AES_ALGO_CTR,
+		.algo_name = "ctr",
+		.key_sz = TA_AES_SIZE_128BIT,
+		.shm_type = BENCH_SHM_TMP,
+	};
+	struct pipe_cfg pipe = {
+		.encode = -1,
+		.key_sz = AES_TEST_KEY_SIZE,
+		.chunk_sz = PIPE_CHUNK_SIZE,
+		.buffers = PIPE_BUFFERS,
+	};
+	bool bench = false;
+	size_t n;
+	int opt;
+
+	/* Default file ciphering key, same as the examples */
+	memset(pipe.key, 0xa5, sizeof(pipe.key));
+
+	while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = true;
+			break;
+		case 't':
+			/* The barriers also count the main thread */
+			cfg.threads = parse_num(argv[0], optarg, UINT_MAX - 1);
+			break;
+		case 's':
+			cfg.sessions = parse_num(argv[0], optarg, UINT_MAX);
+			break;
+		case 'm':
+			cfg.min_sz = parse_num(argv[0], optarg, UINT32_MAX);
+			break;
+		case 'M':
+			cfg.max_sz = parse_num(argv[0], optarg, UINT32_MAX);
+			break;
+		case 'i':
+			cfg.iterations = parse_num(argv[0], optarg,
+						   UINT_MAX);
+			break;
+		case 'a':
+			for (n = 0; n < ARRAY_SIZE(bench_algos); n++)
+				if (!strcmp(optarg, bench_algos[n].name))
+					break;
+			if (n == ARRAY_SIZE(bench_algos))
+				usage(argv[0]);
+			cfg.algo = bench_algos[n].algo;
+			cfg.algo_name = bench_algos[n].name;
+			break;
+		case 'k':
+			cfg.key_sz = parse_num(argv[0], optarg, UINT_MAX) / 8;
+			if (cfg.key_sz != TA_AES_SIZE_128BIT &&
+			    cfg.key_sz != TA_AES_SIZE_256BIT)
+				usage(argv[0]);
+			break;
+		case 'S':
+			for (n = 0; n < ARRAY_SIZE(bench_shm_names); n++)
+				if (!strcmp(optarg, bench_shm_names[n]))
+					break;
+			if (n == ARRAY_SIZE(bench_shm_names))
+				usage(argv[0]);
+			cfg.shm_type = n;
+			break;
+		case 'e':
+		case 'd':
+			pipe.encode = opt == 'e' ? ENCODE : DECODE;
+			break;
+		case 'K':
+			pipe.key_sz = parse_hex(argv[0], optarg, pipe.key,
+						TA_AES_SIZE_128BIT,
+						TA_AES_SIZE_256BIT);
+			break;
+		case 'I':
+			parse_hex(argv[0], optarg, pipe.iv,
+				  AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+			break;
+		case 'c':
+			pipe.chunk_sz = parse_num(argv[0], optarg, UINT32_MAX);
+			break;
+		case 'B':
+			pipe.buffers = parse_num(argv[0], optarg, UINT_MAX);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (pipe.encode >= 0) {
+		/* Only the last chunk may end with a partial CTR block */
+		if (bench || optind + 2 != argc ||
+		    pipe.chunk_sz % AES_BLOCK_SIZE || pipe.buffers < 2 ||
+		    pipe.buffers > PIPE_MAX_BUFFERS)
+			usage(argv[0]);
+
+		pipe.in_path = argv[optind];
+		pipe.out_path = argv[optind + 1];
+		run_pipeline(&pipe);
+		return 0;
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (!bench) {
+		run_demo();
+		return 0;
+	}
+
+	/* Block ciphers work on whole AES blocks */
+	if (cfg.min_sz % AES_BLOCK_SIZE || cfg.min_sz > cfg.max_sz)
+		usage(argv[0]);
+
+	/*
+	 * XTS sectors are the buffer up to BENCH_XTS_SECTOR_SIZE bytes: the
+	 * doubling sizes shall reach whole sectors.
+	 */
+	if (cfg.algo == TA_AES_ALGO_XTS &&
+	    (cfg.min_sz < BENCH_XTS_SECTOR_SIZE ?
+	     BENCH_XTS_SECTOR_SIZE % cfg.min_sz :
+	     cfg.min_sz % BENCH_XTS_SECTOR_SIZE))
+		usage(argv[0]);
+
+	run_bench(&cfg);
 	return 0;
 }
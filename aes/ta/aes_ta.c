@@ -25,6 +25,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <inttypes.h>
+#include <stdbool.h>
 
 #include <tee_internal_api.h>
 #include <tee_internal_api_extensions.h>
@@ -35,22 +36,312 @@
 #define AES128_KEY_BYTE_SIZE		(AES128_KEY_BIT_SIZE / 8)
 #define AES256_KEY_BIT_SIZE		256
 #define AES256_KEY_BYTE_SIZE		(AES256_KEY_BIT_SIZE / 8)
+/* XTS uses a pair of AES keys */
+#define AES_KEY_MAX_BYTE_SIZE		(2 * AES256_KEY_BYTE_SIZE)
 
 /*
- * Ciphering context: each opened session relates to a cipehring operation.
+ * Number of keyed operations a session keeps aside for later reuse. Each
+ * entry costs about 64 bytes of TA heap (see TA_DATA_SIZE) plus the
+ * operation state held by the TEE core.
+ */
+#define AES_KEY_CACHE_SIZE		8
+/* Number of persistent key objects kept opened by a session */
+#define AES_KEY_REF_COUNT		4
+/* Encrypt-then-MAC commands process data by chunks of this size */
+#define AES_MAC_CHUNK_SIZE		4096
+#define AES_MAC_KEY_MIN_BYTE_SIZE	(192 / 8)
+#define AES_MAC_KEY_MAX_BYTE_SIZE	(1024 / 8)
+/*
+ * TA generated CTR nonce: random salt drawn for each key, big endian
+ * message counter, then the block counter starting from zero.
+ */
+#define AES_NONCE_SALT_SIZE		8
+#define AES_NONCE_COUNT_SIZE		4
+
+/*
+ * Ciphering context: each context relates to a cipehring operation.
  * - configure the AES flavour from a command.
  * - load key from a command (here the key is provided by the REE)
  * - reset init vector (here IV is provided by the REE)
  * - cipher a buffer frame (here input and output buffers are non-secure)
  */
 struct aes_cipher {
+	bool in_use;			/* Context allocated to the client */
 	uint32_t algo;			/* AES flavour */
 	uint32_t mode;			/* Encode or decode */
 	uint32_t key_size;		/* AES key size in byte */
 	TEE_OperationHandle op_handle;	/* AES ciphering operation */
 	TEE_ObjectHandle key_handle;	/* transient object to load the key */
+	TEE_ObjectHandle key2_handle;	/* same for XTS second key */
+	bool key_loaded;		/* op_handle holds the key below */
+	bool key_by_id;			/* key[] is a storage object ID */
+	uint32_t key_len;		/* Byte size of key[] */
+	uint8_t key[AES_KEY_MAX_BYTE_SIZE];
+	TEE_OperationHandle mac_handle;	/* HMAC-SHA256 for encrypt-then-MAC */
+	bool ae_initialized;		/* AE_INIT done, not finalized yet */
+	bool ae_payload;		/* AE_UPDATE fed data: no more AAD */
+	bool nonce_ready;		/* Salt below drawn for the loaded key */
+	uint8_t nonce_salt[AES_NONCE_SALT_SIZE];
+	uint32_t nonce_count;		/* Messages ciphered with the salt */
+	bool frame_ready;		/* Container header below is set */
+	struct aes_frame_header frame_hdr;
+	/* First frame not sealed yet, 64bit not to wrap after the last one */
+	uint64_t next_seal_index;
+};
+
+/*
+ * Key cache entry: an operation left aside by a context with its key
+ * loaded. A context that loads the same key again for the same algo and
+ * mode gets the operation back without going through the key setup.
+ * Keys are identified by their material or by their storage object ID.
+ */
+struct aes_key_cache_entry {
+	bool valid;
+	uint32_t algo;
+	uint32_t mode;
+	uint32_t key_size;		/* AES key size in byte */
+	bool key_by_id;
+	uint32_t key_len;
+	uint8_t key[AES_KEY_MAX_BYTE_SIZE];
+	TEE_OperationHandle op_handle;
+	uint32_t last_use;		/* LRU stamp */
+};
+
+/* Persistent key object kept opened for TA_AES_CMD_SET_KEY_BY_ID */
+struct aes_key_ref {
+	bool valid;
+	uint8_t id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t id_len;
+	TEE_ObjectHandle obj;
+	uint32_t last_use;		/* LRU stamp */
+};
+
+/*
+ * Each opened session holds a table of ciphering contexts, so that the
+ * client can switch between configurations and keys without allocating
+ * the resources again. Context TA_AES_DEFAULT_CONTEXT always exists.
+ */
+struct aes_session {
+	struct aes_cipher ctx[TA_AES_MAX_CONTEXTS];
+	struct aes_key_cache_entry cache[AES_KEY_CACHE_SIZE];
+	struct aes_key_ref key_refs[AES_KEY_REF_COUNT];
+	uint32_t cache_stamp;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
 };
 
+/* Parameter types of a command, leaving out the context handle param[3] */
+#define CIPHER_PARAM_TYPES(t)	((t) & TEE_PARAM_TYPES(0xf, 0xf, 0xf, 0))
+
+/*
+ * Get the ciphering context targeted by a command: the one which handle
+ * is provided in param[3], or the default context if param[3] is unused.
+ */
+static TEE_Result get_cipher(void *session, uint32_t param_types,
+			     TEE_Param params[4], struct aes_cipher **cipher)
+{
+	struct aes_session *sess = (struct aes_session *)session;
+	uint32_t handle;
+
+	switch (TEE_PARAM_TYPE_GET(param_types, 3)) {
+	case TEE_PARAM_TYPE_NONE:
+		handle = TA_AES_DEFAULT_CONTEXT;
+		break;
+	case TEE_PARAM_TYPE_VALUE_INPUT:
+		handle = params[3].value.a;
+		break;
+	default:
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	if (handle >= TA_AES_MAX_CONTEXTS || !sess->ctx[handle].in_use) {
+		EMSG("Invalid context handle %" PRIu32, handle);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	*cipher = &sess->ctx[handle];
+	return TEE_SUCCESS;
+}
+
+static void free_cipher_resources(struct aes_cipher *cipher)
+{
+	if (cipher->key_handle != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(cipher->key_handle);
+	cipher->key_handle = TEE_HANDLE_NULL;
+
+	if (cipher->key2_handle != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(cipher->key2_handle);
+	cipher->key2_handle = TEE_HANDLE_NULL;
+
+	if (cipher->op_handle != TEE_HANDLE_NULL)
+		TEE_FreeOperation(cipher->op_handle);
+	cipher->op_handle = TEE_HANDLE_NULL;
+
+	cipher->key_loaded = false;
+	cipher->ae_initialized = false;
+	cipher->key_len = 0;
+	TEE_MemFill(cipher->key, 0, sizeof(cipher->key));
+}
+
+static void free_mac_resources(struct aes_cipher *cipher)
+{
+	if (cipher->mac_handle != TEE_HANDLE_NULL)
+		TEE_FreeOperation(cipher->mac_handle);
+	cipher->mac_handle = TEE_HANDLE_NULL;
+}
+
+static bool is_xts_algo(uint32_t algo)
+{
+	return algo == TEE_ALG_AES_XTS;
+}
+
+/* Size of the key material of a context: XTS takes two AES keys */
+static uint32_t key_material_size(struct aes_cipher *cipher)
+{
+	if (is_xts_algo(cipher->algo))
+		return 2 * cipher->key_size;
+
+	return cipher->key_size;
+}
+
+static void free_cache_entry(struct aes_key_cache_entry *entry)
+{
+	if (entry->valid)
+		TEE_FreeOperation(entry->op_handle);
+
+	TEE_MemFill(entry, 0, sizeof(*entry));
+	entry->op_handle = TEE_HANDLE_NULL;
+}
+
+/* Find the cached operation matching a context configuration and a key */
+static struct aes_key_cache_entry *cache_lookup(struct aes_session *sess,
+						struct aes_cipher *cipher,
+						const void *key,
+						uint32_t key_sz, bool by_id)
+{
+	struct aes_key_cache_entry *entry;
+	size_t n;
+
+	for (n = 0; n < AES_KEY_CACHE_SIZE; n++) {
+		entry = &sess->cache[n];
+
+		if (entry->valid && entry->algo == cipher->algo &&
+		    entry->mode == cipher->mode &&
+		    entry->key_size == cipher->key_size &&
+		    entry->key_by_id == by_id && entry->key_len == key_sz &&
+		    !TEE_MemCompare(entry->key, key, key_sz))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Move the keyed operation of a context into the cache, evicting the
+ * least recently used entry if the cache is full. An evicted operation of
+ * the same configuration is handed over to the context so that it only
+ * needs to be rekeyed. Otherwise the context is left without operation.
+ */
+static void cache_put(struct aes_session *sess, struct aes_cipher *cipher)
+{
+	struct aes_key_cache_entry *victim = NULL;
+	TEE_OperationHandle op = TEE_HANDLE_NULL;
+	size_t n;
+
+	for (n = 0; n < AES_KEY_CACHE_SIZE; n++) {
+		if (!sess->cache[n].valid) {
+			victim = &sess->cache[n];
+			break;
+		}
+		if (!victim || sess->cache[n].last_use < victim->last_use)
+			victim = &sess->cache[n];
+	}
+
+	if (victim->valid && victim->algo == cipher->algo &&
+	    victim->mode == cipher->mode &&
+	    victim->key_size == cipher->key_size) {
+		op = victim->op_handle;
+		victim->valid = false;
+	}
+	free_cache_entry(victim);
+
+	victim->valid = true;
+	victim->algo = cipher->algo;
+	victim->mode = cipher->mode;
+	victim->key_size = cipher->key_size;
+	victim->key_by_id = cipher->key_by_id;
+	victim->key_len = cipher->key_len;
+	TEE_MemMove(victim->key, cipher->key, cipher->key_len);
+	victim->op_handle = cipher->op_handle;
+	victim->last_use = ++sess->cache_stamp;
+
+	cipher->op_handle = op;
+	cipher->key_loaded = false;
+	cipher->key_len = 0;
+	TEE_MemFill(cipher->key, 0, sizeof(cipher->key));
+}
+
+/*
+ * Give a context the cached operation of an entry. The entry takes over
+ * the previous operation of the context if it holds a client key.
+ */
+static void cache_take(struct aes_session *sess, struct aes_cipher *cipher,
+		       struct aes_key_cache_entry *entry)
+{
+	TEE_OperationHandle op = entry->op_handle;
+
+	if (cipher->key_loaded) {
+		entry->key_by_id = cipher->key_by_id;
+		entry->key_len = cipher->key_len;
+		TEE_MemMove(entry->key, cipher->key, cipher->key_len);
+		entry->op_handle = cipher->op_handle;
+		entry->last_use = ++sess->cache_stamp;
+	} else {
+		/* Operation only holds the dummy key, not worth keeping */
+		if (cipher->op_handle != TEE_HANDLE_NULL)
+			TEE_FreeOperation(cipher->op_handle);
+		entry->valid = false;
+		free_cache_entry(entry);
+	}
+
+	cipher->op_handle = op;
+}
+
+/*
+ * Cipher commands apply to a prepared context of a non-authenticated
+ * algorithm, AE commands to a prepared context of an AE algorithm.
+ */
+static bool is_ae_algo(uint32_t algo)
+{
+	return algo == TEE_ALG_AES_GCM;
+}
+
+static TEE_Result check_cipher_op(struct aes_cipher *cipher)
+{
+	if (cipher->op_handle == TEE_HANDLE_NULL || is_ae_algo(cipher->algo))
+		return TEE_ERROR_BAD_STATE;
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result check_ae_op(struct aes_cipher *cipher)
+{
+	if (cipher->op_handle == TEE_HANDLE_NULL || !is_ae_algo(cipher->algo))
+		return TEE_ERROR_BAD_STATE;
+
+	return TEE_SUCCESS;
+}
+
+/* ECB and CBC have no padding: libutee panics on a partial last block */
+static bool is_block_aligned(struct aes_cipher *cipher, size_t size)
+{
+	if (cipher->algo != TEE_ALG_AES_ECB_NOPAD &&
+	    cipher->algo != TEE_ALG_AES_CBC_NOPAD)
+		return true;
+
+	return !(size % TA_AES_BLOCK_SIZE);
+}
+
 /*
  * Few routines to convert IDs from TA API into IDs from OP-TEE.
  */
@@ -66,6 +357,12 @@ static TEE_Result ta2tee_algo_id(uint32_t param, uint32_t *algo)
 	case TA_AES_ALGO_CTR:
 		*algo = TEE_ALG_AES_CTR;
 		return TEE_SUCCESS;
+	case TA_AES_ALGO_GCM:
+		*algo = TEE_ALG_AES_GCM;
+		return TEE_SUCCESS;
+	case TA_AES_ALGO_XTS:
+		*algo = TEE_ALG_AES_XTS;
+		return TEE_SUCCESS;
 	default:
 		EMSG("Invalid algo %u", param);
 		return TEE_ERROR_BAD_PARAMETERS;
@@ -99,46 +396,95 @@ static TEE_Result ta2tee_mode_id(uint32_t param, uint32_t *mode)
 }
 
 /*
- * Process command TA_AES_CMD_PREPARE. API in aes_ta.h
- *
- * Allocate resources required for the ciphering operation.
- * During ciphering operation, when expect client can:
- * - update the key materials (provided by client)
- * - reset the initial vector (provided by client)
- * - cipher an input buffer into an output buffer (provided by client)
+ * Load key material into the operation of a ciphering context through its
+ * transient key object. @reset tells whether the operation already holds
+ * a key and must be reset first.
  */
-static TEE_Result alloc_resources(void *session, uint32_t param_types,
-				  TEE_Param params[4])
+static TEE_Result load_key_object(struct aes_cipher *sess, uint8_t *key,
+				  uint32_t key_sz, bool reset)
 {
-	const uint32_t exp_param_types =
-		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
-				TEE_PARAM_TYPE_VALUE_INPUT,
-				TEE_PARAM_TYPE_VALUE_INPUT,
-				TEE_PARAM_TYPE_NONE);
-	struct aes_cipher *sess;
 	TEE_Attribute attr;
 	TEE_Result res;
-	char *key;
 
-	/* Get ciphering context from session ID */
-	DMSG("Session %p: get ciphering resources", session);
-	sess = (struct aes_cipher *)session;
+	/*
+	 * Load the key material into the configured operation
+	 * - create a secret key attribute with the key material
+	 *   TEE_InitRefAttribute()
+	 * - reset transient object and load attribute data
+	 *   TEE_ResetTransientObject()
+	 *   TEE_PopulateTransientObject()
+	 * - load the key (transient object) into the ciphering operation
+	 *   TEE_SetOperationKey()
+	 *
+	 * TEE_SetOperationKey() requires operation to be in "initial state".
+	 * We can use TEE_ResetOperation() to reset the operation but this
+	 * API cannot be used on operation with key(s) not yet set. Hence,
+	 * when allocating the operation handle, we load a dummy key.
+	 * Thus, set_key sequence resets then sets key on operation, unless
+	 * the operation was allocated without the dummy key.
+	 */
 
-	/* Safely get the invocation parameters */
-	if (param_types != exp_param_types)
-		return TEE_ERROR_BAD_PARAMETERS;
+	if (is_xts_algo(sess->algo))
+		key_sz /= 2;
 
-	res = ta2tee_algo_id(params[0].value.a, &sess->algo);
-	if (res != TEE_SUCCESS)
-		return res;
+	TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, key, key_sz);
 
-	res = ta2tee_key_size(params[1].value.a, &sess->key_size);
-	if (res != TEE_SUCCESS)
+	TEE_ResetTransientObject(sess->key_handle);
+	res = TEE_PopulateTransientObject(sess->key_handle, &attr, 1);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_PopulateTransientObject failed, %x", res);
 		return res;
+	}
 
-	res = ta2tee_mode_id(params[2].value.a, &sess->mode);
-	if (res != TEE_SUCCESS)
+	/* XTS second key follows the first one in the key material */
+	if (is_xts_algo(sess->algo)) {
+		TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE,
+				     key + key_sz, key_sz);
+
+		TEE_ResetTransientObject(sess->key2_handle);
+		res = TEE_PopulateTransientObject(sess->key2_handle, &attr, 1);
+		if (res != TEE_SUCCESS) {
+			EMSG("TEE_PopulateTransientObject failed, %x", res);
+			return res;
+		}
+	}
+
+	if (reset)
+		TEE_ResetOperation(sess->op_handle);
+	if (is_xts_algo(sess->algo))
+		res = TEE_SetOperationKey2(sess->op_handle, sess->key_handle,
+					   sess->key2_handle);
+	else
+		res = TEE_SetOperationKey(sess->op_handle, sess->key_handle);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_SetOperationKey failed %x", res);
 		return res;
+	}
+
+	return res;
+}
+
+/*
+ * Allocate the operation and key objects of a ciphering context for the
+ * given algo, mode and key size, freeing potential previous ones.
+ * A previous operation loaded with a client key is kept in the key cache.
+ */
+static TEE_Result alloc_cipher_resources(void *session,
+					 struct aes_cipher *sess,
+					 uint32_t algo, uint32_t mode,
+					 uint32_t key_size)
+{
+	TEE_Result res;
+	uint8_t *key;
+
+	/* Park the keyed operation under its current configuration */
+	if (sess->key_loaded)
+		cache_put((struct aes_session *)session, sess);
+
+	sess->algo = algo;
+	sess->mode = mode;
+	sess->key_size = key_size;
+	sess->ae_initialized = false;
 
 	/*
 	 * Ready to allocate the resources which are:
@@ -150,6 +496,7 @@ static TEE_Result alloc_resources(void *session, uint32_t param_types,
 	/* Free potential previous operation */
 	if (sess->op_handle != TEE_HANDLE_NULL)
 		TEE_FreeOperation(sess->op_handle);
+	sess->key_loaded = false;
 
 	/* Allocate operation: AES/CTR, mode and size from params */
 	res = TEE_AllocateOperation(&sess->op_handle,
@@ -162,9 +509,12 @@ static TEE_Result alloc_resources(void *session, uint32_t param_types,
 		goto err;
 	}
 
-	/* Free potential previous transient object */
+	/* Free potential previous transient objects */
 	if (sess->key_handle != TEE_HANDLE_NULL)
 		TEE_FreeTransientObject(sess->key_handle);
+	if (sess->key2_handle != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(sess->key2_handle);
+	sess->key2_handle = TEE_HANDLE_NULL;
 
 	/* Allocate transient object according to target key size */
 	res = TEE_AllocateTransientObject(TEE_TYPE_AES,
@@ -176,6 +526,17 @@ static TEE_Result alloc_resources(void *session, uint32_t param_types,
 		goto err;
 	}
 
+	if (is_xts_algo(sess->algo)) {
+		res = TEE_AllocateTransientObject(TEE_TYPE_AES,
+						  sess->key_size * 8,
+						  &sess->key2_handle);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to allocate transient object");
+			sess->key2_handle = TEE_HANDLE_NULL;
+			goto err;
+		}
+	}
+
 	/*
 	 * When loading a key in the cipher session, set_aes_key()
 	 * will reset the operation and load a key. But we cannot
@@ -185,37 +546,174 @@ static TEE_Result alloc_resources(void *session, uint32_t param_types,
 	 * dummy key in the operation so that operation can be reset
 	 * when updating the key.
 	 */
-	key = TEE_Malloc(sess->key_size, 0);
+	key = TEE_Malloc(key_material_size(sess), 0);
 	if (!key) {
 		res = TEE_ERROR_OUT_OF_MEMORY;
 		goto err;
 	}
 
-	TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, key, sess->key_size);
+	/* XTS keys shall differ: make the dummy second key non-zero */
+	if (is_xts_algo(sess->algo))
+		TEE_MemFill(key + sess->key_size, 0xff, sess->key_size);
 
-	res = TEE_PopulateTransientObject(sess->key_handle, &attr, 1);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_PopulateTransientObject failed, %x", res);
+	res = load_key_object(sess, key, key_material_size(sess), false);
+	TEE_Free(key);
+	if (res != TEE_SUCCESS)
 		goto err;
+
+	return res;
+
+err:
+	free_cipher_resources(sess);
+
+	return res;
+}
+
+/*
+ * Process command TA_AES_CMD_PREPARE. API in aes_ta.h
+ *
+ * Allocate resources required for the ciphering operation.
+ * During ciphering operation, when expect client can:
+ * - update the key materials (provided by client)
+ * - reset the initial vector (provided by client)
+ * - cipher an input buffer into an output buffer (provided by client)
+ */
+static TEE_Result alloc_resources(void *session, uint32_t param_types,
+				  TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_cipher *sess;
+	uint32_t key_size;
+	TEE_Result res;
+	uint32_t algo;
+	uint32_t mode;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: get ciphering resources", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = ta2tee_algo_id(params[0].value.a, &algo);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = ta2tee_key_size(params[1].value.a, &key_size);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = ta2tee_mode_id(params[2].value.a, &mode);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	return alloc_cipher_resources(session, sess, algo, mode, key_size);
+}
+
+/*
+ * Load key material into the ciphering context operation, reusing an
+ * operation already loaded with that key when the key cache holds one.
+ */
+static TEE_Result load_cipher_key(void *session, struct aes_cipher *sess,
+				  void *key, uint32_t key_sz,
+				  TEE_ObjectHandle key_obj)
+{
+	struct aes_session *aes_sess = (struct aes_session *)session;
+	struct aes_key_cache_entry *entry;
+	uint8_t key_copy[AES_KEY_MAX_BYTE_SIZE];
+	bool by_id = key_obj != TEE_HANDLE_NULL;
+	bool reset = true;
+	TEE_Result res;
+
+	if (sess->op_handle == TEE_HANDLE_NULL)
+		return TEE_ERROR_BAD_STATE;
+
+	/* Loading a key resets the operation, AE_INIT is needed again */
+	sess->ae_initialized = false;
+
+	if (!by_id && key_sz != key_material_size(sess)) {
+		EMSG("Wrong key size %" PRIu32 ", expect %" PRIu32 " bytes",
+		     key_sz, key_material_size(sess));
+		return TEE_ERROR_BAD_PARAMETERS;
 	}
 
-	res = TEE_SetOperationKey(sess->op_handle, sess->key_handle);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_SetOperationKey failed %x", res);
-		goto err;
+	/* Key may lie in non-secure memory: work on a stable copy */
+	TEE_MemMove(key_copy, key, key_sz);
+
+	if (sess->key_loaded && sess->key_by_id == by_id &&
+	    sess->key_len == key_sz &&
+	    !TEE_MemCompare(sess->key, key_copy, key_sz)) {
+		aes_sess->cache_hits++;
+		TEE_ResetOperation(sess->op_handle);
+		return TEE_SUCCESS;
 	}
 
-	return res;
+	entry = cache_lookup(aes_sess, sess, key_copy, key_sz, by_id);
+	if (entry) {
+		aes_sess->cache_hits++;
+		cache_take(aes_sess, sess, entry);
+		TEE_ResetOperation(sess->op_handle);
+		goto out;
+	}
 
-err:
-	if (sess->op_handle != TEE_HANDLE_NULL)
-		TEE_FreeOperation(sess->op_handle);
-	sess->op_handle = TEE_HANDLE_NULL;
+	aes_sess->cache_misses++;
 
-	if (sess->key_handle != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(sess->key_handle);
-	sess->key_handle = TEE_HANDLE_NULL;
+	/*
+	 * Keep the operation loaded with the previous client key aside.
+	 * The context may get back an evicted operation to rekey, or none
+	 * in which case a new operation is allocated.
+	 */
+	if (sess->key_loaded) {
+		cache_put(aes_sess, sess);
+
+		if (sess->op_handle == TEE_HANDLE_NULL) {
+			res = TEE_AllocateOperation(&sess->op_handle,
+						    sess->algo, sess->mode,
+						    sess->key_size * 8);
+			if (res != TEE_SUCCESS) {
+				EMSG("Failed to allocate operation");
+				sess->op_handle = TEE_HANDLE_NULL;
+				goto err;
+			}
+			/* New operation has no key yet and cannot be reset */
+			reset = false;
+		}
+	}
 
+	if (by_id) {
+		if (reset)
+			TEE_ResetOperation(sess->op_handle);
+		res = TEE_SetOperationKey(sess->op_handle, key_obj);
+		if (res != TEE_SUCCESS)
+			EMSG("TEE_SetOperationKey failed %x", res);
+	} else {
+		res = load_key_object(sess, key_copy, key_sz, reset);
+	}
+	if (res != TEE_SUCCESS) {
+		if (!reset) {
+			/* Do not leave an operation that cannot be reset */
+			TEE_FreeOperation(sess->op_handle);
+			sess->op_handle = TEE_HANDLE_NULL;
+		}
+		goto err;
+	}
+
+out:
+	sess->key_loaded = true;
+	sess->nonce_ready = false;
+	sess->key_by_id = by_id;
+	sess->key_len = key_sz;
+	TEE_MemMove(sess->key, key_copy, key_sz);
+	res = TEE_SUCCESS;
+err:
+	TEE_MemFill(key_copy, 0, sizeof(key_copy));
 	return res;
 }
 
@@ -231,68 +729,1112 @@ static TEE_Result set_aes_key(void *session, uint32_t param_types,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
 	struct aes_cipher *sess;
-	TEE_Attribute attr;
 	TEE_Result res;
 	uint32_t key_sz;
 	char *key;
 
-	/* Get ciphering context from session ID */
+	/* Get ciphering context from session ID and context handle */
 	DMSG("Session %p: load key material", session);
-	sess = (struct aes_cipher *)session;
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
 
 	/* Safely get the invocation parameters */
-	if (param_types != exp_param_types)
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
 	key = params[0].memref.buffer;
 	key_sz = params[0].memref.size;
 
-	if (key_sz != sess->key_size) {
-		EMSG("Wrong key size %" PRIu32 ", expect %" PRIu32 " bytes",
-		     key_sz, sess->key_size);
-		return TEE_ERROR_BAD_PARAMETERS;
-	}
+	return load_cipher_key(session, sess, key, key_sz, TEE_HANDLE_NULL);
+}
 
-	/*
-	 * Load the key material into the configured operation
-	 * - create a secret key attribute with the key material
-	 *   TEE_InitRefAttribute()
-	 * - reset transient object and load attribute data
-	 *   TEE_ResetTransientObject()
-	 *   TEE_PopulateTransientObject()
-	 * - load the key (transient object) into the ciphering operation
-	 *   TEE_SetOperationKey()
-	 *
-	 * TEE_SetOperationKey() requires operation to be in "initial state".
-	 * We can use TEE_ResetOperation() to reset the operation but this
-	 * API cannot be used on operation with key(s) not yet set. Hence,
-	 * when allocating the operation handle, we load a dummy key.
-	 * Thus, set_key sequence always reset then set key on operation.
+/*
+ * Get an opened handle on persistent key object @id, opening it on first
+ * use and closing the least recently used one when all slots are taken.
+ */
+static TEE_Result get_key_ref(struct aes_session *sess, const uint8_t *id,
+			      uint32_t id_len, TEE_ObjectHandle *obj)
+{
+	struct aes_key_ref *ref = NULL;
+	TEE_Result res;
+	size_t n;
+
+	for (n = 0; n < AES_KEY_REF_COUNT; n++) {
+		if (sess->key_refs[n].valid &&
+		    sess->key_refs[n].id_len == id_len &&
+		    !TEE_MemCompare(sess->key_refs[n].id, id, id_len)) {
+			ref = &sess->key_refs[n];
+			goto out;
+		}
+	}
+
+	for (n = 0; n < AES_KEY_REF_COUNT; n++) {
+		if (!sess->key_refs[n].valid) {
+			ref = &sess->key_refs[n];
+			break;
+		}
+		if (!ref || sess->key_refs[n].last_use < ref->last_use)
+			ref = &sess->key_refs[n];
+	}
+
+	if (ref->valid)
+		TEE_CloseObject(ref->obj);
+	ref->valid = false;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, id, id_len,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_SHARE_READ,
+				       &ref->obj);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open key object, res=0x%08x", res);
+		return res;
+	}
+
+	ref->valid = true;
+	ref->id_len = id_len;
+	TEE_MemMove(ref->id, id, id_len);
+out:
+	ref->last_use = ++sess->cache_stamp;
+	*obj = ref->obj;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_SET_KEY_BY_ID. API in aes_ta.h
+ */
+static TEE_Result set_aes_key_by_id(void *session, uint32_t param_types,
+				    TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	uint8_t id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectInfo info;
+	struct aes_cipher *sess;
+	TEE_ObjectHandle obj;
+	TEE_Result res;
+	uint32_t id_len;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: load key object", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	id_len = params[0].memref.size;
+	if (!id_len || id_len > sizeof(id))
+		return TEE_ERROR_BAD_PARAMETERS;
+	TEE_MemMove(id, params[0].memref.buffer, id_len);
+
+	/* A key object holds a single AES key, XTS needs two */
+	if (sess->op_handle == TEE_HANDLE_NULL || is_xts_algo(sess->algo))
+		return TEE_ERROR_BAD_STATE;
+
+	res = get_key_ref((struct aes_session *)session, id, id_len, &obj);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_GetObjectInfo1(obj, &info);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (info.objectType != TEE_TYPE_AES ||
+	    info.objectSize != sess->key_size * 8) {
+		EMSG("Key object does not fit a %" PRIu32 " bit AES key",
+		     sess->key_size * 8);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	return load_cipher_key(session, sess, id, id_len, obj);
+}
+
+/*
+ * Process command TA_AES_CMD_GEN_KEY. API in aes_ta.h
+ */
+static TEE_Result generate_key(void *session, uint32_t param_types,
+			       TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	TEE_ObjectHandle key = TEE_HANDLE_NULL;
+	TEE_ObjectHandle obj;
+	uint8_t id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t key_size;
+	uint32_t id_len;
+	TEE_Result res;
+
+	DMSG("Session %p: generate key object", session);
+
+	/* Safely get the invocation parameters */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	id_len = params[0].memref.size;
+	if (!id_len || id_len > sizeof(id))
+		return TEE_ERROR_BAD_PARAMETERS;
+	TEE_MemMove(id, params[0].memref.buffer, id_len);
+
+	res = ta2tee_key_size(params[1].value.a, &key_size);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_AllocateTransientObject(TEE_TYPE_AES, key_size * 8, &key);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to allocate transient object");
+		return res;
+	}
+
+	res = TEE_GenerateKey(key, key_size * 8, NULL, 0);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_GenerateKey failed %x", res);
+		goto out;
+	}
+
+	/* Never overwrite a key: data ciphered with it would be lost */
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, id, id_len,
+					 TEE_DATA_FLAG_ACCESS_READ |
+					 TEE_DATA_FLAG_SHARE_READ,
+					 key, NULL, 0, &obj);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_CreatePersistentObject failed 0x%08x", res);
+		goto out;
+	}
+
+	TEE_CloseObject(obj);
+out:
+	TEE_FreeTransientObject(key);
+	return res;
+}
+
+/*
+ * Process command TA_AES_CMD_SET_IV. API in aes_ta.h
+ */
+static TEE_Result reset_aes_iv(void *session, uint32_t param_types,
+				TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_cipher *sess;
+	TEE_Result res;
+	size_t iv_sz;
+	char *iv;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: reset initial vector", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_cipher_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	iv = params[0].memref.buffer;
+	iv_sz = params[0].memref.size;
+
+	/*
+	 * Init cipher operation with the initialization vector.
+	 */
+	TEE_CipherInit(sess->op_handle, iv, iv_sz);
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_CTR_SEEK. API in aes_ta.h
+ */
+static TEE_Result ctr_seek(void *session, uint32_t param_types,
+			   TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	uint8_t ctr[TA_AES_BLOCK_SIZE];
+	struct aes_cipher *sess;
+	unsigned int carry = 0;
+	uint64_t offset;
+	TEE_Result res;
+	int n;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: seek CTR keystream", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types ||
+	    params[0].memref.size != sizeof(ctr))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_cipher_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (sess->algo != TEE_ALG_AES_CTR)
+		return TEE_ERROR_BAD_STATE;
+
+	/* Counter block is the nonce plus the offset, 128bit big endian */
+	TEE_MemMove(ctr, params[0].memref.buffer, sizeof(ctr));
+	offset = ((uint64_t)params[1].value.b << 32) | params[1].value.a;
+
+	for (n = sizeof(ctr) - 1; n >= 0; n--) {
+		carry += ctr[n] + (offset & 0xff);
+		ctr[n] = carry;
+		carry >>= 8;
+		offset >>= 8;
+	}
+
+	TEE_CipherInit(sess->op_handle, ctr, sizeof(ctr));
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process commands TA_AES_CMD_CIPHER and TA_AES_CMD_CIPHER_FINAL. API in
+ * aes_ta.h
+ */
+static TEE_Result cipher_buffer(void *session, uint32_t param_types,
+				TEE_Param params[4], bool final)
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_inplace_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_cipher *sess;
+	TEE_Result res;
+	TEE_Param *out;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: cipher buffer", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) == exp_param_types) {
+		if (params[1].memref.size < params[0].memref.size) {
+			EMSG("Bad sizes: in %d, out %d", params[0].memref.size,
+							 params[1].memref.size);
+			return TEE_ERROR_BAD_PARAMETERS;
+		}
+		out = &params[1];
+	} else if (CIPHER_PARAM_TYPES(param_types) ==
+		   exp_inplace_param_types) {
+		/* Output overwrites input, saving a separate output buffer */
+		out = &params[0];
+	} else {
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	res = check_cipher_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!is_block_aligned(sess, params[0].memref.size))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/*
+	 * Process ciphering operation on provided buffers. The final call
+	 * also flushes data the operation buffered, as a partial CTR block.
+	 */
+	if (final)
+		return TEE_CipherDoFinal(sess->op_handle,
+					 params[0].memref.buffer,
+					 params[0].memref.size,
+					 out->memref.buffer, &out->memref.size);
+
+	return TEE_CipherUpdate(sess->op_handle,
+				params[0].memref.buffer, params[0].memref.size,
+				out->memref.buffer, &out->memref.size);
+}
+
+/* Apply the next TA generated IV of a context and copy it into @iv */
+static TEE_Result next_auto_iv(struct aes_cipher *sess, uint8_t *iv)
+{
+	uint32_t count;
+	size_t n;
+
+	if (sess->algo == TEE_ALG_AES_CBC_NOPAD) {
+		TEE_GenerateRandom(iv, TA_AES_BLOCK_SIZE);
+		return TEE_SUCCESS;
+	}
+
+	if (!sess->nonce_ready) {
+		TEE_GenerateRandom(sess->nonce_salt, sizeof(sess->nonce_salt));
+		sess->nonce_count = 0;
+		sess->nonce_ready = true;
+	}
+
+	/* Reusing a counter value would reuse keystream: rekey instead */
+	if (sess->nonce_count == UINT32_MAX)
+		return TEE_ERROR_OVERFLOW;
+	count = sess->nonce_count++;
+
+	TEE_MemFill(iv, 0, TA_AES_BLOCK_SIZE);
+	TEE_MemMove(iv, sess->nonce_salt, sizeof(sess->nonce_salt));
+	for (n = 0; n < AES_NONCE_COUNT_SIZE; n++)
+		iv[AES_NONCE_SALT_SIZE + n] =
+			count >> (8 * (AES_NONCE_COUNT_SIZE - 1 - n));
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_CIPHER_AUTO_IV. API in aes_ta.h
+ */
+static TEE_Result cipher_auto_iv(void *session, uint32_t param_types,
+				 TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_dec_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	uint8_t iv[TA_AES_BLOCK_SIZE];
+	struct aes_cipher *sess;
+	TEE_Result res;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: cipher with TA generated IV", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = check_cipher_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (sess->algo != TEE_ALG_AES_CBC_NOPAD &&
+	    sess->algo != TEE_ALG_AES_CTR)
+		return TEE_ERROR_NOT_SUPPORTED;
+
+	/* Safely get the invocation parameters */
+	if (sess->mode == TEE_MODE_ENCRYPT) {
+		if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+			return TEE_ERROR_BAD_PARAMETERS;
+
+		if (params[1].memref.size < sizeof(iv)) {
+			params[1].memref.size = sizeof(iv);
+			return TEE_ERROR_SHORT_BUFFER;
+		}
+
+		res = next_auto_iv(sess, iv);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		TEE_MemMove(params[1].memref.buffer, iv, sizeof(iv));
+		params[1].memref.size = sizeof(iv);
+	} else {
+		if (CIPHER_PARAM_TYPES(param_types) != exp_dec_param_types ||
+		    params[1].memref.size != sizeof(iv))
+			return TEE_ERROR_BAD_PARAMETERS;
+
+		TEE_MemMove(iv, params[1].memref.buffer, sizeof(iv));
+	}
+
+	if (!is_block_aligned(sess, params[0].memref.size))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	TEE_CipherInit(sess->op_handle, iv, sizeof(iv));
+
+	return TEE_CipherDoFinal(sess->op_handle,
+				 params[0].memref.buffer,
+				 params[0].memref.size,
+				 params[0].memref.buffer,
+				 &params[0].memref.size);
+}
+
+/*
+ * Process command TA_AES_CMD_SET_MAC_KEY. API in aes_ta.h
+ */
+static TEE_Result set_mac_key(void *session, uint32_t param_types,
+			      TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	TEE_ObjectHandle key = TEE_HANDLE_NULL;
+	TEE_OperationHandle op = TEE_HANDLE_NULL;
+	struct aes_cipher *sess;
+	TEE_Attribute attr;
+	uint32_t key_sz;
+	TEE_Result res;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: load MAC key", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	key_sz = params[0].memref.size;
+	if (key_sz < AES_MAC_KEY_MIN_BYTE_SIZE ||
+	    key_sz > AES_MAC_KEY_MAX_BYTE_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
+				    key_sz * 8);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to allocate MAC operation");
+		return res;
+	}
+
+	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256, key_sz * 8,
+					  &key);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to allocate transient object");
+		goto err;
+	}
+
+	TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE,
+			     params[0].memref.buffer, key_sz);
+
+	res = TEE_PopulateTransientObject(key, &attr, 1);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_PopulateTransientObject failed, %x", res);
+		goto err;
+	}
+
+	res = TEE_SetOperationKey(op, key);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_SetOperationKey failed %x", res);
+		goto err;
+	}
+
+	TEE_FreeTransientObject(key);
+	free_mac_resources(sess);
+	sess->mac_handle = op;
+
+	return TEE_SUCCESS;
+
+err:
+	if (key != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(key);
+	TEE_FreeOperation(op);
+	return res;
+}
+
+/*
+ * Cipher and MAC a message chunk by chunk. Each chunk is copied into
+ * secure memory and MACed from there, so that the MAC covers exactly the
+ * ciphertext the TA produced or deciphered whatever the client does to
+ * the shared buffers meanwhile. The MAC covers the IV then the ciphertext.
+ * Output is written to @out unless NULL. Ciphertext is @in when decoding,
+ * the output when encoding.
+ */
+static TEE_Result cipher_mac_pass(struct aes_cipher *sess, uint8_t *chunk,
+				  const void *iv, uint32_t iv_sz,
+				  const uint8_t *in, uint8_t *out, uint32_t sz)
+{
+	bool encode = sess->mode == TEE_MODE_ENCRYPT;
+	uint32_t chunk_sz;
+	uint32_t out_sz;
+	TEE_Result res;
+	uint32_t off;
+
+	TEE_CipherInit(sess->op_handle, iv, iv_sz);
+	TEE_MACInit(sess->mac_handle, NULL, 0);
+	TEE_MACUpdate(sess->mac_handle, iv, iv_sz);
+
+	/* An empty message still needs its final ciphering call */
+	off = 0;
+	do {
+		chunk_sz = sz - off;
+		if (chunk_sz > AES_MAC_CHUNK_SIZE)
+			chunk_sz = AES_MAC_CHUNK_SIZE;
+
+		TEE_MemMove(chunk, in + off, chunk_sz);
+
+		if (!encode)
+			TEE_MACUpdate(sess->mac_handle, chunk, chunk_sz);
+
+		if (out) {
+			out_sz = AES_MAC_CHUNK_SIZE;
+			if (off + chunk_sz == sz)
+				res = TEE_CipherDoFinal(sess->op_handle,
+							chunk, chunk_sz,
+							chunk, &out_sz);
+			else
+				res = TEE_CipherUpdate(sess->op_handle,
+						       chunk, chunk_sz,
+						       chunk, &out_sz);
+			if (res != TEE_SUCCESS) {
+				EMSG("Ciphering failed %x", res);
+				return res;
+			}
+			/* CTR and CBC on whole blocks: output matches input */
+			if (out_sz != chunk_sz)
+				return TEE_ERROR_BAD_PARAMETERS;
+
+			TEE_MemMove(out + off, chunk, chunk_sz);
+		}
+
+		if (encode)
+			TEE_MACUpdate(sess->mac_handle, chunk, chunk_sz);
+
+		off += chunk_sz;
+	} while (off < sz);
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result check_mac_op(struct aes_cipher *sess, uint32_t mode)
+{
+	if (check_cipher_op(sess) != TEE_SUCCESS ||
+	    sess->mac_handle == TEE_HANDLE_NULL || sess->mode != mode)
+		return TEE_ERROR_BAD_STATE;
+
+	/* Only CBC and CTR take the 16 byte IV the MAC covers */
+	if (sess->algo != TEE_ALG_AES_CBC_NOPAD &&
+	    sess->algo != TEE_ALG_AES_CTR)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_CIPHER_MAC. API in aes_ta.h
+ */
+static TEE_Result cipher_mac(void *session, uint32_t param_types,
+			     TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE);
+	uint8_t iv[TA_AES_BLOCK_SIZE];
+	struct aes_cipher *sess;
+	uint8_t *chunk;
+	TEE_Result res;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: encrypt then MAC", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types ||
+	    params[1].memref.size != sizeof(iv))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_mac_op(sess, TEE_MODE_ENCRYPT);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!is_block_aligned(sess, params[0].memref.size))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (params[2].memref.size < TA_AES_MAC_TAG_SIZE) {
+		params[2].memref.size = TA_AES_MAC_TAG_SIZE;
+		return TEE_ERROR_SHORT_BUFFER;
+	}
+
+	chunk = TEE_Malloc(AES_MAC_CHUNK_SIZE, 0);
+	if (!chunk)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(iv, params[1].memref.buffer, sizeof(iv));
+
+	res = cipher_mac_pass(sess, chunk, iv, sizeof(iv),
+			      params[0].memref.buffer, params[0].memref.buffer,
+			      params[0].memref.size);
+	if (res == TEE_SUCCESS)
+		res = TEE_MACComputeFinal(sess->mac_handle, NULL, 0,
+					  params[2].memref.buffer,
+					  &params[2].memref.size);
+
+	TEE_Free(chunk);
+	return res;
+}
+
+/*
+ * Process command TA_AES_CMD_DECRYPT_VERIFY. API in aes_ta.h
+ */
+static TEE_Result decrypt_verify(void *session, uint32_t param_types,
+				 TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	uint8_t tag[TA_AES_MAC_TAG_SIZE];
+	struct aes_cipher *sess;
+	uint32_t iv_sz;
+	uint8_t *chunk;
+	TEE_Result res;
+	uint8_t *iv;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: verify then decrypt", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types ||
+	    params[2].memref.size != TA_AES_BLOCK_SIZE + sizeof(tag))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (params[1].memref.size < params[0].memref.size) {
+		params[1].memref.size = params[0].memref.size;
+		return TEE_ERROR_SHORT_BUFFER;
+	}
+
+	res = check_mac_op(sess, TEE_MODE_DECRYPT);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!is_block_aligned(sess, params[0].memref.size))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/* Secure copy of the IV followed by the tag */
+	iv_sz = TA_AES_BLOCK_SIZE;
+	iv = TEE_Malloc(AES_MAC_CHUNK_SIZE + iv_sz, 0);
+	if (!iv)
+		return TEE_ERROR_OUT_OF_MEMORY;
+	chunk = iv + iv_sz;
+	TEE_MemMove(iv, params[2].memref.buffer, iv_sz);
+	TEE_MemMove(tag, (uint8_t *)params[2].memref.buffer + iv_sz,
+		    sizeof(tag));
+
+	/* First pass only checks the tag: no plaintext out on a bad one */
+	res = cipher_mac_pass(sess, chunk, iv, iv_sz,
+			      params[0].memref.buffer, NULL,
+			      params[0].memref.size);
+	if (res == TEE_SUCCESS)
+		res = TEE_MACCompareFinal(sess->mac_handle, NULL, 0,
+					  tag, sizeof(tag));
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	/*
+	 * Second pass deciphers and MACs again what it deciphers. Should
+	 * the client have changed the input in between, it gets no
+	 * plaintext either.
 	 */
+	res = cipher_mac_pass(sess, chunk, iv, iv_sz,
+			      params[0].memref.buffer, params[1].memref.buffer,
+			      params[0].memref.size);
+	if (res == TEE_SUCCESS)
+		res = TEE_MACCompareFinal(sess->mac_handle, NULL, 0,
+					  tag, sizeof(tag));
+	if (res != TEE_SUCCESS) {
+		TEE_MemFill(params[1].memref.buffer, 0, params[0].memref.size);
+		goto out;
+	}
 
-	TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, key, key_sz);
+	params[1].memref.size = params[0].memref.size;
+out:
+	TEE_Free(iv);
+	return res;
+}
+
+/*
+ * Process command TA_AES_CMD_CIPHER_BATCH. API in aes_ta.h
+ */
+static TEE_Result cipher_batch(void *session, uint32_t param_types,
+				TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_batch_segment seg;
+	struct aes_cipher *sess;
+	TEE_Result res;
+	uint32_t seg_count;
+	uint32_t data_sz;
+	uint32_t out_sz;
+	char *data;
+	uint32_t n;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: cipher batch", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (params[0].memref.size % sizeof(seg))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_cipher_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	seg_count = params[0].memref.size / sizeof(seg);
+	data = params[1].memref.buffer;
+	data_sz = params[1].memref.size;
+
+	for (n = 0; n < seg_count; n++) {
+		/*
+		 * The descriptor table lives in non-secure memory: work on
+		 * a local copy so that it cannot change once checked.
+		 */
+		TEE_MemMove(&seg, (struct aes_batch_segment *)
+				  params[0].memref.buffer + n, sizeof(seg));
+
+		if (seg.offset > data_sz || seg.size > data_sz - seg.offset ||
+		    seg.size % TA_AES_BLOCK_SIZE) {
+			EMSG("Bad segment %" PRIu32 ": offset %" PRIu32
+			     ", size %" PRIu32, n, seg.offset, seg.size);
+			return TEE_ERROR_BAD_PARAMETERS;
+		}
+
+		if (seg.flags & TA_AES_BATCH_FLAG_IV)
+			TEE_CipherInit(sess->op_handle, seg.iv, sizeof(seg.iv));
+
+		out_sz = seg.size;
+		res = TEE_CipherUpdate(sess->op_handle,
+				       data + seg.offset, seg.size,
+				       data + seg.offset, &out_sz);
+		if (res != TEE_SUCCESS) {
+			EMSG("TEE_CipherUpdate failed %x on segment %" PRIu32,
+			     res, n);
+			return res;
+		}
+	}
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result cipher_multi_request(struct aes_session *sess,
+				       struct aes_multi_request *req,
+				       char *data, uint32_t data_sz)
+{
+	struct aes_cipher *cipher;
+	uint32_t out_sz;
+	TEE_Result res;
+
+	if (req->handle >= TA_AES_MAX_CONTEXTS ||
+	    !sess->ctx[req->handle].in_use)
+		return TEE_ERROR_BAD_PARAMETERS;
+	cipher = &sess->ctx[req->handle];
+
+	res = check_cipher_op(cipher);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Only the final segment of a CTR message may end mid-block */
+	if (req->offset > data_sz || req->size > data_sz - req->offset ||
+	    (req->size % TA_AES_BLOCK_SIZE &&
+	     (!(req->flags & TA_AES_MULTI_FLAG_FINAL) ||
+	      cipher->algo != TEE_ALG_AES_CTR)))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (req->flags & TA_AES_MULTI_FLAG_IV)
+		TEE_CipherInit(cipher->op_handle, req->iv, sizeof(req->iv));
+
+	out_sz = req->size;
+	if (req->flags & TA_AES_MULTI_FLAG_FINAL)
+		return TEE_CipherDoFinal(cipher->op_handle,
+					 data + req->offset, req->size,
+					 data + req->offset, &out_sz);
+
+	return TEE_CipherUpdate(cipher->op_handle,
+				data + req->offset, req->size,
+				data + req->offset, &out_sz);
+}
+
+/*
+ * Process command TA_AES_CMD_CIPHER_MULTI. API in aes_ta.h
+ */
+static TEE_Result cipher_multi(void *session, uint32_t param_types,
+			       TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_multi_request *table;
+	struct aes_multi_request req;
+	uint32_t failed = 0;
+	uint32_t req_count;
+	uint32_t data_sz;
+	uint32_t stream;
+	char *data;
+	uint32_t n;
+
+	DMSG("Session %p: cipher multiple streams", session);
+
+	/* Safely get the invocation parameters */
+	if (param_types != exp_param_types ||
+	    params[0].memref.size % sizeof(req))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	table = params[0].memref.buffer;
+	req_count = params[0].memref.size / sizeof(req);
+	data = params[1].memref.buffer;
+	data_sz = params[1].memref.size;
+
+	for (n = 0; n < req_count; n++) {
+		/* Work on a local copy of the descriptor, see cipher_batch() */
+		TEE_MemMove(&req, table + n, sizeof(req));
+		stream = req.handle < TA_AES_MAX_CONTEXTS ?
+			 1U << req.handle : 0;
+
+		/*
+		 * The segments following a failed one of the same stream
+		 * would be ciphered at a wrong position: fail them too,
+		 * until the stream restarts with its own IV.
+		 */
+		if ((failed & stream) && !(req.flags & TA_AES_MULTI_FLAG_IV))
+			req.status = TEE_ERROR_BAD_STATE;
+		else
+			req.status = cipher_multi_request(session, &req, data,
+							  data_sz);
+
+		if (req.status != TEE_SUCCESS) {
+			EMSG("Request %" PRIu32 " failed %x", n, req.status);
+			failed |= stream;
+		} else {
+			failed &= ~stream;
+		}
+
+		TEE_MemMove(&table[n].status, &req.status, sizeof(req.status));
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_XTS_SECTORS. API in aes_ta.h
+ */
+static TEE_Result cipher_xts_sectors(void *session, uint32_t param_types,
+				     TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_NONE);
+	uint8_t tweak[TA_AES_BLOCK_SIZE] = { 0 };
+	struct aes_cipher *sess;
+	uint32_t sector_sz;
+	uint64_t sector;
+	TEE_Result res;
+	uint32_t out_sz;
+	char *data;
+	size_t off;
+	size_t n;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: cipher XTS sectors", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_cipher_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!is_xts_algo(sess->algo))
+		return TEE_ERROR_BAD_STATE;
+
+	sector = ((uint64_t)params[0].value.b << 32) | params[0].value.a;
+	sector_sz = params[1].value.a;
+	data = params[2].memref.buffer;
+
+	if (!sector_sz || sector_sz % TA_AES_BLOCK_SIZE ||
+	    params[2].memref.size % sector_sz) {
+		EMSG("Bad sector size %" PRIu32 " for %" PRIu32 " bytes",
+		     sector_sz, params[2].memref.size);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	for (off = 0; off < params[2].memref.size; off += sector_sz, sector++) {
+		/* Tweak is the sector number as a 128bit little endian value */
+		for (n = 0; n < sizeof(sector); n++)
+			tweak[n] = sector >> (8 * n);
+
+		TEE_CipherInit(sess->op_handle, tweak, sizeof(tweak));
+
+		out_sz = sector_sz;
+		res = TEE_CipherDoFinal(sess->op_handle, data + off, sector_sz,
+					data + off, &out_sz);
+		if (res != TEE_SUCCESS) {
+			EMSG("TEE_CipherDoFinal failed %x on sector %" PRIu64,
+			     res, sector);
+			return res;
+		}
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_CIPHER_ONESHOT. API in aes_ta.h
+ */
+static TEE_Result cipher_oneshot(void *session, uint32_t param_types,
+				 TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INOUT);
+	struct aes_cipher *sess;
+	uint32_t key_size;
+	TEE_Result res;
+	uint32_t iv_sz;
+	uint32_t algo;
+	uint32_t mode;
+
+	/* One shot ciphering always uses the session default context */
+	DMSG("Session %p: cipher one shot", session);
+	sess = &((struct aes_session *)session)->ctx[TA_AES_DEFAULT_CONTEXT];
+
+	/* Safely get the invocation parameters */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = ta2tee_algo_id(params[0].value.a, &algo);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (is_ae_algo(algo))
+		return TEE_ERROR_NOT_SUPPORTED;
+
+	res = ta2tee_mode_id(params[0].value.b, &mode);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* XTS key material holds two keys of the AES key size */
+	key_size = params[1].memref.size;
+	if (is_xts_algo(algo))
+		key_size /= 2;
+
+	res = ta2tee_key_size(key_size, &key_size);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/*
+	 * Reallocating the operation is the costly part: only do it when
+	 * the current one does not fit the requested configuration.
+	 */
+	if (sess->op_handle == TEE_HANDLE_NULL || sess->algo != algo ||
+	    sess->mode != mode || sess->key_size != key_size) {
+		res = alloc_cipher_resources(session, sess, algo, mode,
+					     key_size);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	/* ECB takes no IV, the other modes a block sized one */
+	iv_sz = algo == TEE_ALG_AES_ECB_NOPAD ? 0 : TA_AES_BLOCK_SIZE;
+	if (params[2].memref.size != iv_sz ||
+	    !is_block_aligned(sess, params[3].memref.size))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = load_cipher_key(session, sess, params[1].memref.buffer,
+			      params[1].memref.size, TEE_HANDLE_NULL);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	TEE_CipherInit(sess->op_handle, params[2].memref.buffer, iv_sz);
+
+	return TEE_CipherDoFinal(sess->op_handle,
+				 params[3].memref.buffer,
+				 params[3].memref.size,
+				 params[3].memref.buffer,
+				 &params[3].memref.size);
+}
+
+/*
+ * Process command TA_AES_CMD_AE_INIT. API in aes_ta.h
+ */
+static TEE_Result ae_init(void *session, uint32_t param_types,
+			  TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_cipher *sess;
+	TEE_Result res;
 
-	TEE_ResetTransientObject(sess->key_handle);
-	res = TEE_PopulateTransientObject(sess->key_handle, &attr, 1);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_PopulateTransientObject failed, %x", res);
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: initialize authenticated encryption", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
 		return res;
-	}
 
-	TEE_ResetOperation(sess->op_handle);
-	res = TEE_SetOperationKey(sess->op_handle, sess->key_handle);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_SetOperationKey failed %x", res);
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types ||
+	    !params[0].memref.size)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_ae_op(sess);
+	if (res != TEE_SUCCESS)
 		return res;
-	}
+
+	/* A sequence not finalized left the operation active: restart it */
+	if (sess->ae_initialized)
+		TEE_ResetOperation(sess->op_handle);
+
+	res = TEE_AEInit(sess->op_handle,
+			 params[0].memref.buffer, params[0].memref.size,
+			 params[1].value.a, params[1].value.b,
+			 params[2].value.a);
+	sess->ae_initialized = res == TEE_SUCCESS;
+	sess->ae_payload = false;
 
 	return res;
 }
 
 /*
- * Process command TA_AES_CMD_SET_IV. API in aes_ta.h
+ * Process command TA_AES_CMD_AE_UPDATE_AAD. API in aes_ta.h
  */
-static TEE_Result reset_aes_iv(void *session, uint32_t param_types,
+static TEE_Result ae_update_aad(void *session, uint32_t param_types,
 				TEE_Param params[4])
 {
 	const uint32_t exp_param_types =
@@ -301,33 +1843,37 @@ static TEE_Result reset_aes_iv(void *session, uint32_t param_types,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
 	struct aes_cipher *sess;
-	size_t iv_sz;
-	char *iv;
+	TEE_Result res;
 
-	/* Get ciphering context from session ID */
-	DMSG("Session %p: reset initial vector", session);
-	sess = (struct aes_cipher *)session;
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: feed additional authenticated data", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
 
 	/* Safely get the invocation parameters */
-	if (param_types != exp_param_types)
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	iv = params[0].memref.buffer;
-	iv_sz = params[0].memref.size;
+	res = check_ae_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
 
-	/*
-	 * Init cipher operation with the initialization vector.
-	 */
-	TEE_CipherInit(sess->op_handle, iv, iv_sz);
+	/* Libutee panics on AAD before AE_INIT or after the payload */
+	if (!sess->ae_initialized || sess->ae_payload)
+		return TEE_ERROR_BAD_STATE;
+
+	TEE_AEUpdateAAD(sess->op_handle,
+			params[0].memref.buffer, params[0].memref.size);
 
 	return TEE_SUCCESS;
 }
 
 /*
- * Process command TA_AES_CMD_CIPHER. API in aes_ta.h
+ * Process command TA_AES_CMD_AE_UPDATE. API in aes_ta.h
  */
-static TEE_Result cipher_buffer(void *session, uint32_t param_types,
-				TEE_Param params[4])
+static TEE_Result ae_update(void *session, uint32_t param_types,
+			    TEE_Param params[4])
 {
 	const uint32_t exp_param_types =
 		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
@@ -335,30 +1881,465 @@ static TEE_Result cipher_buffer(void *session, uint32_t param_types,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
 	struct aes_cipher *sess;
+	TEE_Result res;
 
-	/* Get ciphering context from session ID */
-	DMSG("Session %p: cipher buffer", session);
-	sess = (struct aes_cipher *)session;
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: authenticated cipher buffer", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
 
 	/* Safely get the invocation parameters */
-	if (param_types != exp_param_types)
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	if (params[1].memref.size < params[0].memref.size) {
-		EMSG("Bad sizes: in %d, out %d", params[0].memref.size,
-						 params[1].memref.size);
+	res = check_ae_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!sess->ae_initialized)
+		return TEE_ERROR_BAD_STATE;
+
+	res = TEE_AEUpdate(sess->op_handle,
+			   params[0].memref.buffer, params[0].memref.size,
+			   params[1].memref.buffer, &params[1].memref.size);
+	if (res == TEE_SUCCESS && params[0].memref.size)
+		sess->ae_payload = true;
+
+	return res;
+}
+
+/*
+ * Process commands TA_AES_CMD_AE_ENCRYPT_FINAL and
+ * TA_AES_CMD_AE_DECRYPT_FINAL. API in aes_ta.h
+ */
+static TEE_Result ae_final(void *session, uint32_t param_types,
+			   TEE_Param params[4], bool encrypt)
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				encrypt ? TEE_PARAM_TYPE_MEMREF_OUTPUT :
+					  TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_cipher *sess;
+	TEE_Result res;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: finalize authenticated %s", session,
+	     encrypt ? "encryption" : "decryption");
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
-	}
 
-	if (sess->op_handle == TEE_HANDLE_NULL)
+	res = check_ae_op(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!sess->ae_initialized)
+		return TEE_ERROR_BAD_STATE;
+
+	if (encrypt)
+		res = TEE_AEEncryptFinal(sess->op_handle,
+					 params[0].memref.buffer,
+					 params[0].memref.size,
+					 params[1].memref.buffer,
+					 &params[1].memref.size,
+					 params[2].memref.buffer,
+					 &params[2].memref.size);
+	else
+		res = TEE_AEDecryptFinal(sess->op_handle,
+					 params[0].memref.buffer,
+					 params[0].memref.size,
+					 params[1].memref.buffer,
+					 &params[1].memref.size,
+					 params[2].memref.buffer,
+					 params[2].memref.size);
+
+	/* A short buffer leaves the operation active for a new try */
+	if (res != TEE_ERROR_SHORT_BUFFER)
+		sess->ae_initialized = false;
+
+	return res;
+}
+
+/* Number of frames of a container, an empty one still has a last frame */
+static uint64_t frame_count(struct aes_frame_header *hdr)
+{
+	if (!hdr->plain_size)
+		return 1;
+
+	return (hdr->plain_size - 1) / hdr->frame_size + 1;
+}
+
+static TEE_Result check_frame_op(struct aes_cipher *sess, uint32_t mode)
+{
+	if (check_ae_op(sess) != TEE_SUCCESS || !sess->key_loaded ||
+	    sess->mode != mode)
 		return TEE_ERROR_BAD_STATE;
 
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_FRAME_INIT. API in aes_ta.h
+ */
+static TEE_Result frame_init(void *session, uint32_t param_types,
+			     TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_frame_header *hdr;
+	struct aes_cipher *sess;
+	TEE_Result res;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: start framed container", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types ||
+	    !params[0].value.a || params[0].value.a > TA_AES_FRAME_MAX_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_frame_op(sess, TEE_MODE_ENCRYPT);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (params[2].memref.size < sizeof(*hdr)) {
+		params[2].memref.size = sizeof(*hdr);
+		return TEE_ERROR_SHORT_BUFFER;
+	}
+
+	hdr = &sess->frame_hdr;
+	TEE_MemFill(hdr, 0, sizeof(*hdr));
+	hdr->magic = TA_AES_FRAME_MAGIC;
+	hdr->version = TA_AES_FRAME_VERSION;
+	hdr->frame_size = params[0].value.a;
+	hdr->plain_size = ((uint64_t)params[1].value.b << 32) |
+			  params[1].value.a;
+	TEE_GenerateRandom(hdr->nonce_prefix, sizeof(hdr->nonce_prefix));
+	sess->next_seal_index = 0;
+
+	/* Frame index is a 32bit nonce part */
+	if (frame_count(hdr) > UINT32_MAX + 1ULL) {
+		sess->frame_ready = false;
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+	sess->frame_ready = true;
+
+	TEE_MemMove(params[2].memref.buffer, hdr, sizeof(*hdr));
+	params[2].memref.size = sizeof(*hdr);
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_FRAME_LOAD. API in aes_ta.h
+ */
+static TEE_Result frame_load(void *session, uint32_t param_types,
+			     TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_frame_header *hdr;
+	struct aes_cipher *sess;
+	TEE_Result res;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: load framed container header", session);
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types ||
+	    params[0].memref.size != sizeof(*hdr))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_frame_op(sess, TEE_MODE_DECRYPT);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	hdr = &sess->frame_hdr;
+	sess->frame_ready = false;
+	TEE_MemMove(hdr, params[0].memref.buffer, sizeof(*hdr));
+
+	if (hdr->magic != TA_AES_FRAME_MAGIC ||
+	    hdr->version != TA_AES_FRAME_VERSION ||
+	    !hdr->frame_size || hdr->frame_size > TA_AES_FRAME_MAX_SIZE ||
+	    frame_count(hdr) > UINT32_MAX + 1ULL) {
+		EMSG("Bad container header");
+		return TEE_ERROR_BAD_FORMAT;
+	}
+	sess->frame_ready = true;
+
+	return TEE_SUCCESS;
+}
+
+/* Set up the AE operation for frame @index of @plain_sz bytes */
+static TEE_Result frame_ae_init(struct aes_cipher *sess, uint32_t index,
+				uint32_t plain_sz, bool last)
+{
+	struct aes_frame_header *hdr = &sess->frame_hdr;
+	uint8_t nonce[TA_AES_FRAME_NONCE_PREFIX_SIZE + 4];
+	uint8_t aad[5];
+	TEE_Result res;
+
+	TEE_MemMove(nonce, hdr->nonce_prefix, sizeof(hdr->nonce_prefix));
+	nonce[8] = index >> 24;
+	nonce[9] = index >> 16;
+	nonce[10] = index >> 8;
+	nonce[11] = index;
+
+	TEE_MemMove(aad, nonce + 8, 4);
+	aad[4] = last;
+
 	/*
-	 * Process ciphering operation on provided buffers
+	 * An AE_INIT sequence or a failed frame may have left the operation
+	 * active: start over from a reset one. The sequence gets lost.
 	 */
-	return TEE_CipherUpdate(sess->op_handle,
-				params[0].memref.buffer, params[0].memref.size,
-				params[1].memref.buffer, &params[1].memref.size);
+	TEE_ResetOperation(sess->op_handle);
+	sess->ae_initialized = false;
+
+	res = TEE_AEInit(sess->op_handle, nonce, sizeof(nonce),
+			 TA_AES_FRAME_TAG_SIZE * 8, sizeof(*hdr) + sizeof(aad),
+			 plain_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	TEE_AEUpdateAAD(sess->op_handle, hdr, sizeof(*hdr));
+	TEE_AEUpdateAAD(sess->op_handle, aad, sizeof(aad));
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process commands TA_AES_CMD_FRAME_SEAL and TA_AES_CMD_FRAME_OPEN. API in
+ * aes_ta.h
+ */
+static TEE_Result frame_seal_open(void *session, uint32_t param_types,
+				  TEE_Param params[4], bool seal)
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_frame_header *hdr;
+	struct aes_cipher *sess;
+	uint64_t count;
+	uint64_t index;
+	uint32_t tag_sz;
+	uint32_t plain_sz;
+	uint32_t out_sz;
+	uint8_t *in;
+	uint8_t *out;
+	size_t in_left;
+	size_t out_left;
+	bool empty_last;
+	TEE_Result res;
+	bool last;
+
+	/* Get ciphering context from session ID and context handle */
+	DMSG("Session %p: %s frames", session, seal ? "seal" : "open");
+	res = get_cipher(session, param_types, params, &sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Safely get the invocation parameters */
+	if (CIPHER_PARAM_TYPES(param_types) != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = check_frame_op(sess, seal ? TEE_MODE_ENCRYPT : TEE_MODE_DECRYPT);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!sess->frame_ready)
+		return TEE_ERROR_BAD_STATE;
+
+	hdr = &sess->frame_hdr;
+	count = frame_count(hdr);
+	index = params[0].value.a;
+	in = params[1].memref.buffer;
+	in_left = params[1].memref.size;
+	out = params[2].memref.buffer;
+	out_left = params[2].memref.size;
+
+	/* Sealing a frame again would reuse its nonce */
+	if (seal && index < sess->next_seal_index)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/* Only the last frame of an empty container has no plaintext */
+	empty_last = seal && !hdr->plain_size && !index && !in_left;
+
+	while (in_left || empty_last) {
+		empty_last = false;
+
+		if (index >= count)
+			return TEE_ERROR_BAD_PARAMETERS;
+
+		last = index == count - 1;
+		plain_sz = last ? hdr->plain_size - index * hdr->frame_size :
+				  hdr->frame_size;
+
+		if (in_left < plain_sz + (seal ? 0 : TA_AES_FRAME_TAG_SIZE))
+			return TEE_ERROR_BAD_PARAMETERS;
+		if (out_left < plain_sz + (seal ? TA_AES_FRAME_TAG_SIZE : 0))
+			return TEE_ERROR_SHORT_BUFFER;
+
+		res = frame_ae_init(sess, index, plain_sz, last);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		out_sz = plain_sz;
+		if (seal) {
+			/* Nonce is used from now on, even on a failure */
+			sess->next_seal_index = index + 1;
+			tag_sz = TA_AES_FRAME_TAG_SIZE;
+			res = TEE_AEEncryptFinal(sess->op_handle,
+						 in, plain_sz, out, &out_sz,
+						 out + plain_sz, &tag_sz);
+			in += plain_sz;
+			in_left -= plain_sz;
+			out += plain_sz + TA_AES_FRAME_TAG_SIZE;
+			out_left -= plain_sz + TA_AES_FRAME_TAG_SIZE;
+		} else {
+			res = TEE_AEDecryptFinal(sess->op_handle,
+						 in, plain_sz, out, &out_sz,
+						 in + plain_sz,
+						 TA_AES_FRAME_TAG_SIZE);
+			if (res != TEE_SUCCESS)
+				TEE_MemFill(out, 0, plain_sz);
+			in += plain_sz + TA_AES_FRAME_TAG_SIZE;
+			in_left -= plain_sz + TA_AES_FRAME_TAG_SIZE;
+			out += plain_sz;
+			out_left -= plain_sz;
+		}
+		if (res != TEE_SUCCESS) {
+			EMSG("Frame %" PRIu64 " failed %x", index, res);
+			return res;
+		}
+
+		index++;
+	}
+
+	params[2].memref.size = out - (uint8_t *)params[2].memref.buffer;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_CTX_ALLOC. API in aes_ta.h
+ */
+static TEE_Result alloc_context(void *session, uint32_t param_types,
+				TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_session *sess;
+	uint32_t n;
+
+	DMSG("Session %p: allocate ciphering context", session);
+	sess = (struct aes_session *)session;
+
+	/* Safely get the invocation parameters */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	for (n = 0; n < TA_AES_MAX_CONTEXTS; n++) {
+		if (!sess->ctx[n].in_use) {
+			sess->ctx[n].in_use = true;
+			params[0].value.a = n;
+			return TEE_SUCCESS;
+		}
+	}
+
+	EMSG("No free ciphering context");
+	return TEE_ERROR_OUT_OF_MEMORY;
+}
+
+/*
+ * Process command TA_AES_CMD_CTX_FREE. API in aes_ta.h
+ */
+static TEE_Result free_context(void *session, uint32_t param_types,
+			       TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_session *sess;
+	uint32_t handle;
+
+	DMSG("Session %p: free ciphering context", session);
+	sess = (struct aes_session *)session;
+
+	/* Safely get the invocation parameters */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	handle = params[0].value.a;
+	if (handle == TA_AES_DEFAULT_CONTEXT ||
+	    handle >= TA_AES_MAX_CONTEXTS || !sess->ctx[handle].in_use)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	free_cipher_resources(&sess->ctx[handle]);
+	free_mac_resources(&sess->ctx[handle]);
+	sess->ctx[handle].frame_ready = false;
+	sess->ctx[handle].in_use = false;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Process command TA_AES_CMD_KEY_CACHE_STATS. API in aes_ta.h
+ */
+static TEE_Result get_key_cache_stats(void *session, uint32_t param_types,
+				      TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct aes_session *sess;
+	uint32_t used = 0;
+	size_t n;
+
+	DMSG("Session %p: get key cache statistics", session);
+	sess = (struct aes_session *)session;
+
+	/* Safely get the invocation parameters */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	for (n = 0; n < AES_KEY_CACHE_SIZE; n++)
+		if (sess->cache[n].valid)
+			used++;
+
+	params[0].value.a = sess->cache_hits;
+	params[0].value.b = sess->cache_misses;
+	params[1].value.a = used;
+	params[1].value.b = AES_KEY_CACHE_SIZE;
+
+	return TEE_SUCCESS;
 }
 
 TEE_Result TA_CreateEntryPoint(void)
@@ -376,7 +2357,8 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
 					TEE_Param __unused params[4],
 					void __unused **session)
 {
-	struct aes_cipher *sess;
+	struct aes_session *sess;
+	uint32_t n;
 
 	/*
 	 * Allocate and init ciphering materials for the session.
@@ -387,8 +2369,13 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
 	if (!sess)
 		return TEE_ERROR_OUT_OF_MEMORY;
 
-	sess->key_handle = TEE_HANDLE_NULL;
-	sess->op_handle = TEE_HANDLE_NULL;
+	for (n = 0; n < TA_AES_MAX_CONTEXTS; n++) {
+		sess->ctx[n].key_handle = TEE_HANDLE_NULL;
+		sess->ctx[n].key2_handle = TEE_HANDLE_NULL;
+		sess->ctx[n].mac_handle = TEE_HANDLE_NULL;
+		sess->ctx[n].op_handle = TEE_HANDLE_NULL;
+	}
+	sess->ctx[TA_AES_DEFAULT_CONTEXT].in_use = true;
 
 	*session = (void *)sess;
 	DMSG("Session %p: newly allocated", *session);
@@ -398,17 +2385,23 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
 
 void TA_CloseSessionEntryPoint(void *session)
 {
-	struct aes_cipher *sess;
+	struct aes_session *sess;
+	uint32_t n;
 
-	/* Get ciphering context from session ID */
+	/* Get ciphering contexts from session ID */
 	DMSG("Session %p: release session", session);
-	sess = (struct aes_cipher *)session;
+	sess = (struct aes_session *)session;
 
 	/* Release the session resources */
-	if (sess->key_handle != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(sess->key_handle);
-	if (sess->op_handle != TEE_HANDLE_NULL)
-		TEE_FreeOperation(sess->op_handle);
+	for (n = 0; n < TA_AES_MAX_CONTEXTS; n++) {
+		free_cipher_resources(&sess->ctx[n]);
+		free_mac_resources(&sess->ctx[n]);
+	}
+	for (n = 0; n < AES_KEY_CACHE_SIZE; n++)
+		free_cache_entry(&sess->cache[n]);
+	for (n = 0; n < AES_KEY_REF_COUNT; n++)
+		if (sess->key_refs[n].valid)
+			TEE_CloseObject(sess->key_refs[n].obj);
 	TEE_Free(sess);
 }
 
@@ -425,7 +2418,55 @@ TEE_Result TA_InvokeCommandEntryPoint(void *session,
 	case TA_AES_CMD_SET_IV:
 		return reset_aes_iv(session, param_types, params);
 	case TA_AES_CMD_CIPHER:
-		return cipher_buffer(session, param_types, params);
+		return cipher_buffer(session, param_types, params, false);
+	case TA_AES_CMD_CIPHER_FINAL:
+		return cipher_buffer(session, param_types, params, true);
+	case TA_AES_CMD_CTR_SEEK:
+		return ctr_seek(session, param_types, params);
+	case TA_AES_CMD_GEN_KEY:
+		return generate_key(session, param_types, params);
+	case TA_AES_CMD_SET_KEY_BY_ID:
+		return set_aes_key_by_id(session, param_types, params);
+	case TA_AES_CMD_SET_MAC_KEY:
+		return set_mac_key(session, param_types, params);
+	case TA_AES_CMD_CIPHER_MAC:
+		return cipher_mac(session, param_types, params);
+	case TA_AES_CMD_DECRYPT_VERIFY:
+		return decrypt_verify(session, param_types, params);
+	case TA_AES_CMD_CIPHER_AUTO_IV:
+		return cipher_auto_iv(session, param_types, params);
+	case TA_AES_CMD_CIPHER_MULTI:
+		return cipher_multi(session, param_types, params);
+	case TA_AES_CMD_FRAME_INIT:
+		return frame_init(session, param_types, params);
+	case TA_AES_CMD_FRAME_LOAD:
+		return frame_load(session, param_types, params);
+	case TA_AES_CMD_FRAME_SEAL:
+		return frame_seal_open(session, param_types, params, true);
+	case TA_AES_CMD_FRAME_OPEN:
+		return frame_seal_open(session, param_types, params, false);
+	case TA_AES_CMD_CIPHER_BATCH:
+		return cipher_batch(session, param_types, params);
+	case TA_AES_CMD_XTS_SECTORS:
+		return cipher_xts_sectors(session, param_types, params);
+	case TA_AES_CMD_CIPHER_ONESHOT:
+		return cipher_oneshot(session, param_types, params);
+	case TA_AES_CMD_CTX_ALLOC:
+		return alloc_context(session, param_types, params);
+	case TA_AES_CMD_CTX_FREE:
+		return free_context(session, param_types, params);
+	case TA_AES_CMD_KEY_CACHE_STATS:
+		return get_key_cache_stats(session, param_types, params);
+	case TA_AES_CMD_AE_INIT:
+		return ae_init(session, param_types, params);
+	case TA_AES_CMD_AE_UPDATE_AAD:
+		return ae_update_aad(session, param_types, params);
+	case TA_AES_CMD_AE_UPDATE:
+		return ae_update(session, param_types, params);
+	case TA_AES_CMD_AE_ENCRYPT_FINAL:
+		return ae_final(session, param_types, params, true);
+	case TA_AES_CMD_AE_DECRYPT_FINAL:
+		return ae_final(session, param_types, params, false);
 	default:
 		EMSG("Command ID 0x%x is not supported", cmd);
 		return TEE_ERROR_NOT_SUPPORTED;
@@ -28,6 +28,8 @@
 #ifndef __AES_TA_H__
 #define __AES_TA_H__
 
+#include <stdint.h>
+
 /* UUID of the AES example trusted application */
 #define TA_AES_UUID \
 	{ 0x5dbac793, 0xf574, 0x4871, \
@@ -38,13 +40,15 @@
  * param[0] (value) a: TA_AES_ALGO_xxx, b: unused
  * param[1] (value) a: key size in bytes, b: unused
  * param[2] (value) a: TA_AES_MODE_ENCODE/_DECODE, b: unused
- * param[3] unused
+ * param[3] (value) a: context handle, or unused for the default context
  */
 #define TA_AES_CMD_PREPARE		0
 
 #define TA_AES_ALGO_ECB			0
 #define TA_AES_ALGO_CBC			1
 #define TA_AES_ALGO_CTR			2
+#define TA_AES_ALGO_GCM			3
+#define TA_AES_ALGO_XTS			4
 
 #define TA_AES_SIZE_128BIT		(128 / 8)
 #define TA_AES_SIZE_256BIT		(256 / 8)
@@ -52,12 +56,15 @@
 #define TA_AES_MODE_ENCODE		1
 #define TA_AES_MODE_DECODE		0
 
+#define TA_AES_BLOCK_SIZE		16
+
 /*
  * TA_AES_CMD_SET_KEY - Allocate resources for the AES ciphering
- * param[0] (memref) key data, size shall equal key length
+ * param[0] (memref) key data, size shall equal key length, twice the
+ *                   key length for XTS (data key followed by tweak key)
  * param[1] unused
  * param[2] unused
- * param[3] unused
+ * param[3] (value) a: context handle, or unused for the default context
  */
 #define TA_AES_CMD_SET_KEY		1
 
@@ -66,7 +73,7 @@
  * param[0] (memref) initial vector, size shall equal block length
  * param[1] unused
  * param[2] unused
- * param[3] unused
+ * param[3] (value) a: context handle, or unused for the default context
  */
 #define TA_AES_CMD_SET_IV		2
 
@@ -75,8 +82,389 @@
  * param[0] (memref) input buffer
  * param[1] (memref) output buffer (shall be bigger than input buffer)
  * param[2] unused
- * param[3] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * TA_AES_CMD_CIPHER - Cipher a buffer in place
+ * param[0] (memref) input/output buffer
+ * param[1] unused
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * With TA_AES_ALGO_ECB and TA_AES_ALGO_CBC, the input size shall be a
+ * multiple of the AES block size.
  */
 #define TA_AES_CMD_CIPHER		3
 
+/*
+ * TA_AES_CMD_CIPHER_BATCH - Cipher several segments of a buffer in place
+ * param[0] (memref) table of struct aes_batch_segment
+ * param[1] (memref) data buffer, each segment is ciphered in place
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * Segments are processed in table order. A segment flagged with
+ * TA_AES_BATCH_FLAG_IV first resets the operation with its own initial
+ * vector, other segments continue the current ciphering stream. Segment
+ * sizes shall be a multiple of the AES block size.
+ */
+#define TA_AES_CMD_CIPHER_BATCH		4
+
+#define TA_AES_BATCH_FLAG_IV		(1 << 0)
+
+struct aes_batch_segment {
+	uint32_t offset;		/* Segment offset in data buffer */
+	uint32_t size;			/* Segment size in bytes */
+	uint32_t flags;			/* TA_AES_BATCH_FLAG_xxx */
+	uint32_t reserved;
+	uint8_t iv[TA_AES_BLOCK_SIZE];	/* Initial vector, if flagged */
+};
+
+/*
+ * TA_AES_CMD_CIPHER_ONESHOT - Prepare, load key, reset IV and cipher
+ * param[0] (value) a: TA_AES_ALGO_xxx but GCM, b: TA_AES_MODE_ENCODE/_DECODE
+ * param[1] (memref) key data, its size sets the key size
+ * param[2] (memref) initial vector, block length, empty for ECB
+ * param[3] (memref) input/output buffer, ciphered in place, whole blocks
+ *                   for ECB and CBC
+ *
+ * The ciphering is finalized within the command, using the default
+ * context. The operation is reused from one command to the next as long
+ * as the algo, mode and key size remain the same.
+ */
+#define TA_AES_CMD_CIPHER_ONESHOT	5
+
+/*
+ * A session holds up to TA_AES_MAX_CONTEXTS ciphering contexts, each with
+ * its own configuration, key and IV. Commands select a context from its
+ * handle in param[3]. The default context always exists and is used when
+ * param[3] is unused.
+ */
+#define TA_AES_MAX_CONTEXTS		32
+#define TA_AES_DEFAULT_CONTEXT		0
+
+/*
+ * TA_AES_CMD_CTX_ALLOC - Allocate a ciphering context
+ * param[0] (value) a: output context handle, b: unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_AES_CMD_CTX_ALLOC		6
+
+/*
+ * TA_AES_CMD_CTX_FREE - Release a ciphering context and its resources
+ * param[0] (value) a: context handle, b: unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_AES_CMD_CTX_FREE		7
+
+/*
+ * TA_AES_CMD_KEY_CACHE_STATS - Get statistics of the session key cache
+ * param[0] (value) a: key loads served from a prepared operation
+ *		    b: key loads that went through the key setup
+ * param[1] (value) a: cache entries in use, b: cache capacity
+ * param[2] unused
+ * param[3] unused
+ *
+ * Operations loaded with a client key are kept aside when their context
+ * is loaded with another key or prepared again. Loading back such a key
+ * with the same algo and mode reuses the operation as is.
+ */
+#define TA_AES_CMD_KEY_CACHE_STATS	8
+
+/*
+ * Authenticated encryption: a context prepared with TA_AES_ALGO_GCM is
+ * driven with the TA_AES_CMD_AE_xxx commands below instead of the
+ * TA_AES_CMD_SET_IV and TA_AES_CMD_CIPHER commands. Data and AAD are
+ * streamed through as many update commands as needed, all the AAD before
+ * the payload. Update and final commands out of a sequence started by
+ * TA_AES_CMD_AE_INIT fail with TEE_ERROR_BAD_STATE; so does AAD fed after
+ * the payload. Preparing the context, loading a key or sealing or opening
+ * container frames ends the sequence, TA_AES_CMD_AE_INIT restarts it.
+ *
+ * When decrypting, plaintext output by TA_AES_CMD_AE_UPDATE is released
+ * before the tag is checked: the client shall discard it if
+ * TA_AES_CMD_AE_DECRYPT_FINAL fails.
+ */
+
+/*
+ * TA_AES_CMD_AE_INIT - Start an authenticated encryption or decryption
+ * param[0] (memref) nonce, not empty
+ * param[1] (value) a: tag length in bits, b: AAD length in bytes
+ * param[2] (value) a: payload length in bytes, b: unused
+ * param[3] (value) a: context handle, or unused for the default context
+ */
+#define TA_AES_CMD_AE_INIT		9
+
+/*
+ * TA_AES_CMD_AE_UPDATE_AAD - Feed additional authenticated data
+ * param[0] (memref) AAD chunk
+ * param[1] unused
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ */
+#define TA_AES_CMD_AE_UPDATE_AAD	10
+
+/*
+ * TA_AES_CMD_AE_UPDATE - Cipher a chunk of the payload
+ * param[0] (memref) input buffer
+ * param[1] (memref) output buffer, size updated with the output length
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ */
+#define TA_AES_CMD_AE_UPDATE		11
+
+/*
+ * TA_AES_CMD_AE_ENCRYPT_FINAL - Encrypt last payload chunk, compute tag
+ * param[0] (memref) input buffer, may be empty
+ * param[1] (memref) output buffer, size updated with the output length
+ * param[2] (memref) output tag
+ * param[3] (value) a: context handle, or unused for the default context
+ */
+#define TA_AES_CMD_AE_ENCRYPT_FINAL	12
+
+/*
+ * TA_AES_CMD_AE_DECRYPT_FINAL - Decrypt last payload chunk, check tag
+ * param[0] (memref) input buffer, may be empty
+ * param[1] (memref) output buffer, size updated with the output length
+ * param[2] (memref) input tag
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * Returns TEE_ERROR_MAC_INVALID if the tag does not match.
+ */
+#define TA_AES_CMD_AE_DECRYPT_FINAL	13
+
+/*
+ * TA_AES_CMD_XTS_SECTORS - Cipher a run of contiguous sectors in place
+ * param[0] (value) a: start sector number low 32bit, b: high 32bit
+ * param[1] (value) a: sector size in bytes, multiple of the AES block size
+ * param[2] (memref) sectors data, size shall be a multiple of sector size
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The context shall be prepared with TA_AES_ALGO_XTS. The tweak of each
+ * sector is its number encoded as a 128bit little endian integer.
+ */
+#define TA_AES_CMD_XTS_SECTORS		14
+
+/*
+ * TA_AES_CMD_CIPHER_FINAL - Cipher the last chunk of a message
+ * Same parameters as TA_AES_CMD_CIPHER, both forms. Input size may be
+ * any size for CTR, then the operation needs a TA_AES_CMD_SET_IV before
+ * ciphering a new message.
+ */
+#define TA_AES_CMD_CIPHER_FINAL		15
+
+/*
+ * TA_AES_CMD_CTR_SEEK - Position a CTR operation at a keystream block
+ * param[0] (memref) nonce, the counter block of keystream block 0
+ * param[1] (value) a: block offset low 32bit, b: high 32bit
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The counter block is the nonce plus the block offset, as a 128bit big
+ * endian addition. Ciphering then starts at byte 16 * offset of the
+ * message, so that chunks of a message can be ciphered independently.
+ */
+#define TA_AES_CMD_CTR_SEEK		16
+
+/*
+ * TA_AES_CMD_GEN_KEY - Generate an AES key into secure storage
+ * param[0] (memref) key object ID, up to 64 bytes
+ * param[1] (value) a: key size in bytes, b: unused
+ * param[2] unused
+ * param[3] unused
+ *
+ * The key is a persistent TEE_TYPE_AES object of the TA private storage.
+ * It never leaves the TA. An existing object is not overwritten: the
+ * command then returns TEE_ERROR_ACCESS_CONFLICT.
+ */
+#define TA_AES_CMD_GEN_KEY		17
+
+/*
+ * TA_AES_CMD_SET_KEY_BY_ID - Load a key from secure storage
+ * param[0] (memref) key object ID, as given to TA_AES_CMD_GEN_KEY
+ * param[1] unused
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The key object size shall match the context key size. XTS contexts are
+ * not supported. The session keeps the last used key objects opened.
+ */
+#define TA_AES_CMD_SET_KEY_BY_ID	18
+
+/*
+ * Encrypt-then-MAC: a CBC or CTR context with an HMAC-SHA256 key set by
+ * TA_AES_CMD_SET_MAC_KEY ciphers and authenticates a message in a single
+ * pass. The MAC covers the IV then the ciphertext. The IV is
+ * TA_AES_BLOCK_SIZE bytes and, with CBC, the message size shall be a
+ * multiple of TA_AES_BLOCK_SIZE: other sizes and ECB or XTS contexts fail
+ * with TEE_ERROR_BAD_PARAMETERS.
+ */
+#define TA_AES_MAC_TAG_SIZE		32
+
+/*
+ * TA_AES_CMD_SET_MAC_KEY - Load the HMAC-SHA256 key of a context
+ * param[0] (memref) key data, 24 to 128 bytes
+ * param[1] unused
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ */
+#define TA_AES_CMD_SET_MAC_KEY		19
+
+/*
+ * TA_AES_CMD_CIPHER_MAC - Encrypt a message in place and MAC it
+ * param[0] (memref) input/output buffer, the whole message
+ * param[1] (memref) IV, TA_AES_BLOCK_SIZE bytes
+ * param[2] (memref) output tag, TA_AES_MAC_TAG_SIZE bytes
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The context shall be prepared with TA_AES_MODE_ENCODE.
+ */
+#define TA_AES_CMD_CIPHER_MAC		20
+
+/*
+ * TA_AES_CMD_DECRYPT_VERIFY - Check the MAC of a message then decrypt it
+ * param[0] (memref) input buffer, the whole ciphertext
+ * param[1] (memref) output buffer, size updated with the plaintext length
+ * param[2] (memref) IV followed by the TA_AES_MAC_TAG_SIZE bytes tag
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The context shall be prepared with TA_AES_MODE_DECODE. Returns
+ * TEE_ERROR_MAC_INVALID if the tag does not match, before any plaintext
+ * is written to the output buffer.
+ */
+#define TA_AES_CMD_DECRYPT_VERIFY	21
+
+/*
+ * TA_AES_CMD_CIPHER_AUTO_IV - Cipher a message in place with a TA nonce
+ * param[0] (memref) input/output buffer, the whole message
+ * param[1] (memref) encode: output IV, decode: input IV, 16 bytes
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * No TA_AES_CMD_SET_IV is needed. When encoding, the TA picks the IV and
+ * returns it with the ciphertext: a random IV for CBC, and for CTR an
+ * 8 byte random salt drawn for each key, a 4 byte big endian message
+ * counter and a zero block counter. Once the message counter is
+ * exhausted, the command returns TEE_ERROR_OVERFLOW until a new key is
+ * loaded. With CBC, the message size shall be a multiple of the AES block
+ * size. ECB, XTS and GCM contexts are not supported.
+ */
+#define TA_AES_CMD_CIPHER_AUTO_IV	22
+
+/*
+ * TA_AES_CMD_CIPHER_MULTI - Cipher segments of independent streams
+ * param[0] (memref) table of struct aes_multi_request, status updated
+ * param[1] (memref) data buffer, each segment is ciphered in place
+ * param[2] unused
+ * param[3] unused
+ *
+ * Each request targets its own context and is processed in table order.
+ * A request flagged with TA_AES_MULTI_FLAG_IV first resets its context
+ * with its own initial vector. A request flagged TA_AES_MULTI_FLAG_FINAL
+ * ends its message and may have any size for CTR, other sizes shall be a
+ * multiple of the AES block size, else the request fails with
+ * TEE_ERROR_BAD_PARAMETERS. A failed request does not stop the others:
+ * the command succeeds and the status field of each request gets its own
+ * result. Once a request fails, the next ones of the same context fail
+ * with TEE_ERROR_BAD_STATE, until one flagged with TA_AES_MULTI_FLAG_IV.
+ */
+#define TA_AES_CMD_CIPHER_MULTI		23
+
+#define TA_AES_MULTI_FLAG_IV		(1 << 0)
+#define TA_AES_MULTI_FLAG_FINAL		(1 << 1)
+
+struct aes_multi_request {
+	uint32_t handle;		/* Context handle */
+	uint32_t flags;			/* TA_AES_MULTI_FLAG_xxx */
+	uint32_t offset;		/* Segment offset in data buffer */
+	uint32_t size;			/* Segment size in bytes */
+	uint8_t iv[TA_AES_BLOCK_SIZE];	/* Initial vector, if flagged */
+	uint32_t status;		/* Output: TEE_Result of the request */
+	uint32_t reserved;
+};
+
+/*
+ * Framed container: a header then the plaintext cut in frames of
+ * frame_size bytes, the last one possibly shorter. Each frame is stored
+ * as its AES-GCM ciphertext followed by a TA_AES_FRAME_TAG_SIZE bytes
+ * tag, so frame i lies at offset
+ *	sizeof(struct aes_frame_header) +
+ *	i * (frame_size + TA_AES_FRAME_TAG_SIZE)
+ * and any range of frames can be opened on its own.
+ *
+ * Frame i nonce is the header nonce prefix followed by i as a 32bit big
+ * endian integer. Its AAD is the header, i as a 32bit big endian integer
+ * and a byte set to 1 for the last frame, 0 otherwise: frames cannot be
+ * moved, swapped between containers or truncated away. Header fields are
+ * in the TA native byte order.
+ */
+#define TA_AES_FRAME_MAGIC		0x46534541	/* "AESF" */
+#define TA_AES_FRAME_VERSION		1
+#define TA_AES_FRAME_NONCE_PREFIX_SIZE	8
+#define TA_AES_FRAME_TAG_SIZE		16
+#define TA_AES_FRAME_MAX_SIZE		(1024 * 1024)
+
+struct aes_frame_header {
+	uint32_t magic;			/* TA_AES_FRAME_MAGIC */
+	uint32_t version;		/* TA_AES_FRAME_VERSION */
+	uint32_t frame_size;		/* Plaintext bytes per frame */
+	uint32_t reserved;
+	uint64_t plain_size;		/* Plaintext bytes in the container */
+	uint8_t nonce_prefix[TA_AES_FRAME_NONCE_PREFIX_SIZE];
+};
+
+/*
+ * TA_AES_CMD_FRAME_INIT - Start a new container, get its header
+ * param[0] (value) a: frame size in bytes, b: unused
+ * param[1] (value) a: plaintext size low 32bit, b: high 32bit
+ * param[2] (memref) output header, struct aes_frame_header
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The context shall be prepared with TA_AES_ALGO_GCM and
+ * TA_AES_MODE_ENCODE and hold its key. The TA draws a random nonce
+ * prefix for each container.
+ */
+#define TA_AES_CMD_FRAME_INIT		24
+
+/*
+ * TA_AES_CMD_FRAME_LOAD - Load the header of a container to open
+ * param[0] (memref) input header, struct aes_frame_header
+ * param[1] unused
+ * param[2] unused
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * The context shall be prepared with TA_AES_ALGO_GCM and
+ * TA_AES_MODE_DECODE and hold its key.
+ */
+#define TA_AES_CMD_FRAME_LOAD		25
+
+/*
+ * TA_AES_CMD_FRAME_SEAL - Seal a range of frames
+ * param[0] (value) a: index of the first frame, b: unused
+ * param[1] (memref) input plaintext of the frames
+ * param[2] (memref) output sealed frames, size updated
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * Plaintext holds whole frames, the last frame of the container may be
+ * shorter. Each frame is sealed once, in increasing index order: an index
+ * below the next frame to seal would reuse a nonce and fails with
+ * TEE_ERROR_BAD_PARAMETERS.
+ */
+#define TA_AES_CMD_FRAME_SEAL		26
+
+/*
+ * TA_AES_CMD_FRAME_OPEN - Open a range of frames
+ * param[0] (value) a: index of the first frame, b: unused
+ * param[1] (memref) input sealed frames
+ * param[2] (memref) output plaintext, size updated
+ * param[3] (value) a: context handle, or unused for the default context
+ *
+ * Returns TEE_ERROR_MAC_INVALID if a frame does not authenticate, the
+ * plaintext output of that frame is then wiped.
+ */
+#define TA_AES_CMD_FRAME_OPEN		27
+
 #endif /* __AES_TA_H */
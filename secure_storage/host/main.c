@@ -26,8 +26,14 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* OP-TEE TEE client API (built by optee_client) */
 #include <tee_client_api.h>
@@ -35,6 +41,8 @@
 /* TA API: UUID and command IDs */
 #include <secure_storage_ta.h>
 
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
+
 /* TEE resources */
 struct test_ctx {
 	TEEC_Context ctx;
@@ -135,6 +143,36 @@ TEEC_Result write_secure_object(struct test_ctx *ctx, char *id,
 	return res;
 }
 
+TEEC_Result write_compressed_secure_object(struct test_ctx *ctx, char *id,
+					   char *data, size_t data_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+	size_t id_len = strlen(id);
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = id_len;
+
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = data_len;
+
+	op.params[2].value.a = TA_SECURE_STORAGE_FLAG_COMPRESS;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_WRITE_RAW,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Command WRITE_RAW failed: 0x%x / %u\n", res, origin);
+
+	return res;
+}
+
 TEEC_Result delete_secure_object(struct test_ctx *ctx, char *id)
 {
 	TEEC_Operation op;
@@ -164,78 +202,1618 @@ TEEC_Result delete_secure_object(struct test_ctx *ctx, char *id)
 	return res;
 }
 
-#define TEST_OBJECT_SIZE	7000
+TEEC_Result read_secure_object_range(struct test_ctx *ctx, char *id,
+				     uint32_t offset, char *data,
+				     size_t *data_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+	size_t id_len = strlen(id);
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INPUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = id_len;
+
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = *data_len;
+
+	op.params[2].value.a = offset;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_READ_RANGE,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Command READ_RANGE failed: 0x%x / %u\n", res, origin);
+	else
+		*data_len = op.params[1].tmpref.size;
+
+	return res;
+}
 
-int main(void)
+TEEC_Result write_secure_object_range(struct test_ctx *ctx, char *id,
+				      uint32_t offset, char *data,
+				      size_t data_len)
 {
-	struct test_ctx ctx;
-	char obj1_id[] = "object#1";		/* string identification for the object */
-	char obj2_id[] = "object#2";		/* string identification for the object */
-	char obj1_data[TEST_OBJECT_SIZE];
-	char read_data[TEST_OBJECT_SIZE];
+	TEEC_Operation op;
+	uint32_t origin;
 	TEEC_Result res;
+	size_t id_len = strlen(id);
 
-	printf("Prepare session with the TA\n");
-	prepare_tee_session(&ctx);
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT, TEEC_NONE);
 
-	/*
-	 * Create object, read it, delete it.
-	 */
-	printf("\nTest on object \"%s\"\n", obj1_id);
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = id_len;
 
-	printf("- Create and load object in the TA secure storage\n");
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = data_len;
 
-	memset(obj1_data, 0xA1, sizeof(obj1_data));
+	op.params[2].value.a = offset;
 
-	res = write_secure_object(&ctx, obj1_id,
-				  obj1_data, sizeof(obj1_data));
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_WRITE_RANGE,
+				 &op, &origin);
 	if (res != TEEC_SUCCESS)
-		errx(1, "Failed to create an object in the secure storage");
+		printf("Command WRITE_RANGE failed: 0x%x / %u\n", res, origin);
 
-	printf("- Read back the object\n");
+	return res;
+}
 
-	res = read_secure_object(&ctx, obj1_id,
-				 read_data, sizeof(read_data));
+TEEC_Result truncate_secure_object(struct test_ctx *ctx, char *id,
+				   uint32_t size)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+	size_t id_len = strlen(id);
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = id_len;
+
+	op.params[1].value.a = size;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_TRUNCATE,
+				 &op, &origin);
 	if (res != TEEC_SUCCESS)
-		errx(1, "Failed to read an object from the secure storage");
-	if (memcmp(obj1_data, read_data, sizeof(obj1_data)))
-		errx(1, "Unexpected content found in secure storage");
+		printf("Command TRUNCATE failed: 0x%x / %u\n", res, origin);
 
-	printf("- Delete the object\n");
+	return res;
+}
 
-	res = delete_secure_object(&ctx, obj1_id);
+TEEC_Result stream_secure_object(struct test_ctx *ctx, uint32_t cmd,
+				 char *buf, size_t len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	if (buf) {
+		op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+						 TEEC_NONE, TEEC_NONE,
+						 TEEC_NONE);
+		op.params[0].tmpref.buffer = buf;
+		op.params[0].tmpref.size = len;
+	} else {
+		op.paramTypes = TEEC_PARAM_TYPES(TEEC_NONE, TEEC_NONE,
+						 TEEC_NONE, TEEC_NONE);
+	}
+
+	res = TEEC_InvokeCommand(&ctx->sess, cmd, &op, &origin);
 	if (res != TEEC_SUCCESS)
-		errx(1, "Failed to delete the object: 0x%x", res);
+		printf("Stream command %u failed: 0x%x / %u\n",
+		       cmd, res, origin);
 
-	/*
-	 * Non volatile storage: create object2 if not found, delete it if found
-	 */
-	printf("\nTest on object \"%s\"\n", obj2_id);
+	return res;
+}
 
-	res = read_secure_object(&ctx, obj2_id,
-				  read_data, sizeof(read_data));
-	if (res != TEEC_SUCCESS && res != TEEC_ERROR_ITEM_NOT_FOUND)
-		errx(1, "Unexpected status when reading an object : 0x%x", res);
+/* Invoke transaction command @cmd, with object @id and @data for TX_PUT */
+TEEC_Result tx_secure_objects(struct test_ctx *ctx, uint32_t cmd, char *id,
+			      char *data, size_t data_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
 
-	if (res == TEEC_ERROR_ITEM_NOT_FOUND) {
-		char data[] = "This is data stored in the secure storage.\n";
+	memset(&op, 0, sizeof(op));
+	if (id) {
+		op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+						 TEEC_MEMREF_TEMP_INPUT,
+						 TEEC_NONE, TEEC_NONE);
+		op.params[0].tmpref.buffer = id;
+		op.params[0].tmpref.size = strlen(id);
+		op.params[1].tmpref.buffer = data;
+		op.params[1].tmpref.size = data_len;
+	} else {
+		op.paramTypes = TEEC_PARAM_TYPES(TEEC_NONE, TEEC_NONE,
+						 TEEC_NONE, TEEC_NONE);
+	}
 
-		printf("- Object not found in TA secure storage, create it.\n");
+	res = TEEC_InvokeCommand(&ctx->sess, cmd, &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Transaction command %u failed: 0x%x / %u\n",
+		       cmd, res, origin);
 
-		res = write_secure_object(&ctx, obj2_id,
-					  data, sizeof(data));
-		if (res != TEEC_SUCCESS)
-			errx(1, "Failed to create/load an object");
+	return res;
+}
 
-	} else if (res == TEEC_SUCCESS) {
-		printf("- Object found in TA secure storage, delete it.\n");
+/*
+ * List objects in @list. @cursor is 0 to start listing and is updated for
+ * the next call, it comes back to 0 once all objects are listed.
+ */
+TEEC_Result list_secure_objects(struct test_ctx *ctx, char *list,
+				size_t *list_len, uint32_t *cursor,
+				uint32_t *count)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
 
-		res = delete_secure_object(&ctx, obj2_id);
-		if (res != TEEC_SUCCESS)
-			errx(1, "Failed to delete an object");
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INOUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = list;
+	op.params[0].tmpref.size = *list_len;
+
+	op.params[1].value.a = *cursor;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_LIST,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS) {
+		printf("Command LIST failed: 0x%x / %u\n", res, origin);
+		return res;
 	}
 
-	printf("\nWe're done, close and release TEE resources\n");
-	terminate_tee_session(&ctx);
+	*list_len = op.params[0].tmpref.size;
+	*cursor = op.params[1].value.a;
+	*count = op.params[1].value.b;
+
+	return res;
+}
+
+TEEC_Result stat_secure_object(struct test_ctx *ctx, char *id,
+			       size_t *data_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+	size_t id_len = strlen(id);
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = id_len;
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_STAT,
+				 &op, &origin);
+	switch (res) {
+	case TEEC_SUCCESS:
+		*data_len = op.params[1].value.a;
+		break;
+	case TEEC_ERROR_ITEM_NOT_FOUND:
+		break;
+	default:
+		printf("Command STAT failed: 0x%x / %u\n", res, origin);
+	}
+
+	return res;
+}
+
+TEEC_Result put_kv_record(struct test_ctx *ctx, char *key, char *val,
+			  size_t val_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = key;
+	op.params[0].tmpref.size = strlen(key);
+
+	op.params[1].tmpref.buffer = val;
+	op.params[1].tmpref.size = val_len;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_SECURE_STORAGE_CMD_KV_PUT,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Command KV_PUT failed: 0x%x / %u\n", res, origin);
+
+	return res;
+}
+
+TEEC_Result get_kv_record(struct test_ctx *ctx, char *key, char *val,
+			  size_t *val_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = key;
+	op.params[0].tmpref.size = strlen(key);
+
+	op.params[1].tmpref.buffer = val;
+	op.params[1].tmpref.size = *val_len;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_SECURE_STORAGE_CMD_KV_GET,
+				 &op, &origin);
+	switch (res) {
+	case TEEC_SUCCESS:
+	case TEEC_ERROR_SHORT_BUFFER:
+		*val_len = op.params[1].tmpref.size;
+		break;
+	case TEEC_ERROR_ITEM_NOT_FOUND:
+		break;
+	default:
+		printf("Command KV_GET failed: 0x%x / %u\n", res, origin);
+	}
+
+	return res;
+}
+
+TEEC_Result delete_kv_record(struct test_ctx *ctx, char *key)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = key;
+	op.params[0].tmpref.size = strlen(key);
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_SECURE_STORAGE_CMD_KV_DELETE,
+				 &op, &origin);
+	switch (res) {
+	case TEEC_SUCCESS:
+	case TEEC_ERROR_ITEM_NOT_FOUND:
+		break;
+	default:
+		printf("Command KV_DELETE failed: 0x%x / %u\n", res, origin);
+	}
+
+	return res;
+}
+
+TEEC_Result compact_kv_store(struct test_ctx *ctx, uint32_t *freed)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_OUTPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_SECURE_STORAGE_CMD_KV_COMPACT,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Command KV_COMPACT failed: 0x%x / %u\n", res, origin);
+	else
+		*freed = op.params[0].value.a;
+
+	return res;
+}
+
+TEEC_Result set_write_back(struct test_ctx *ctx, bool enable)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].value.a = enable;
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_SECURE_STORAGE_CMD_WRITE_BACK,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Command WRITE_BACK failed: 0x%x / %u\n", res, origin);
+
+	return res;
+}
+
+TEEC_Result flush_secure_objects(struct test_ctx *ctx)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_NONE, TEEC_NONE,
+					 TEEC_NONE, TEEC_NONE);
+
+	res = TEEC_InvokeCommand(&ctx->sess, TA_SECURE_STORAGE_CMD_FLUSH,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Command FLUSH failed: 0x%x / %u\n", res, origin);
+
+	return res;
+}
+
+TEEC_Result get_cache_stats(struct test_ctx *ctx, uint32_t *hits,
+			    uint32_t *misses)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_OUTPUT, TEEC_VALUE_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	res = TEEC_InvokeCommand(&ctx->sess,
+				 TA_SECURE_STORAGE_CMD_CACHE_STATS,
+				 &op, &origin);
+	if (res != TEEC_SUCCESS) {
+		printf("Command CACHE_STATS failed: 0x%x / %u\n", res, origin);
+		return res;
+	}
+
+	*hits = op.params[0].value.a;
+	*misses = op.params[0].value.b;
+
+	return res;
+}
+
+/*
+ * Pack a record for the multi-object commands at @buf. @data may be NULL
+ * to only reserve @data_len bytes. Return the offset of the next record.
+ */
+size_t pack_record(char *buf, char *id, char *data, size_t data_len)
+{
+	struct secure_storage_record rec = {
+		.status = TEEC_SUCCESS,
+		.id_size = strlen(id),
+		.data_size = data_len,
+	};
+
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), id, rec.id_size);
+	if (data)
+		memcpy(buf + sizeof(rec) + rec.id_size, data, data_len);
+
+	return TA_SECURE_STORAGE_RECORD_SIZE(rec.id_size, data_len);
+}
+
+TEEC_Result process_secure_objects(struct test_ctx *ctx, uint32_t cmd,
+				   char *list, size_t list_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = list;
+	op.params[0].tmpref.size = list_len;
+
+	res = TEEC_InvokeCommand(&ctx->sess, cmd, &op, &origin);
+	if (res != TEEC_SUCCESS)
+		printf("Multi-object command %u failed: 0x%x / %u\n",
+		       cmd, res, origin);
+
+	return res;
+}
+
+#define TEST_OBJECT_SIZE	7000
+#define MULTI_OBJECT_COUNT	8
+#define MULTI_OBJECT_SIZE	512
+
+#define RANGE_OFFSET		4096
+#define RANGE_SIZE		64
+
+/*
+ * Patch a few bytes in the middle of an object, then shrink it, without
+ * rewriting the whole object.
+ */
+void test_object_range(struct test_ctx *ctx)
+{
+	char id[] = "object#range";
+	char data[TEST_OBJECT_SIZE];
+	char patch[RANGE_SIZE];
+	char read_data[2 * RANGE_SIZE];
+	size_t read_len;
+	TEEC_Result res;
+
+	printf("\nTest on object \"%s\"\n", id);
+
+	printf("- Create and load object in the TA secure storage\n");
+
+	memset(data, 0xA1, sizeof(data));
+	res = write_secure_object(ctx, id, data, sizeof(data));
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to create an object in the secure storage");
+
+	printf("- Update %u bytes at offset %u\n", RANGE_SIZE, RANGE_OFFSET);
+
+	memset(patch, 0x5A, sizeof(patch));
+	res = write_secure_object_range(ctx, id, RANGE_OFFSET,
+					patch, sizeof(patch));
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to update the object");
+
+	printf("- Read back the bytes around the update\n");
+
+	read_len = sizeof(read_data);
+	res = read_secure_object_range(ctx, id, RANGE_OFFSET - RANGE_SIZE / 2,
+				       read_data, &read_len);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to read the object");
+
+	memcpy(data + RANGE_OFFSET, patch, sizeof(patch));
+	if (read_len != sizeof(read_data) ||
+	    memcmp(read_data, data + RANGE_OFFSET - RANGE_SIZE / 2, read_len))
+		errx(1, "Unexpected content found in secure storage");
+
+	printf("- Truncate the object to %u bytes\n", RANGE_OFFSET);
+
+	res = truncate_secure_object(ctx, id, RANGE_OFFSET);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to truncate the object");
+
+	read_len = sizeof(read_data);
+	res = read_secure_object_range(ctx, id, RANGE_OFFSET - RANGE_SIZE / 2,
+				       read_data, &read_len);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to read the object");
+	if (read_len != RANGE_SIZE / 2)
+		errx(1, "Unexpected size %zu of truncated object", read_len);
+
+	printf("- Delete the object\n");
+
+	res = delete_secure_object(ctx, id);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to delete the object: 0x%x", res);
+}
+
+#define STREAM_OBJECT_SIZE	(256 * 1024)
+#define STREAM_PIECE_SIZE	(16 * 1024)
+
+static char stream_byte(size_t pos)
+{
+	return (char)(pos * 7 + pos / 251);
+}
+
+/*
+ * Build an object much larger than the TA heap over several invocations,
+ * read it back piece by piece, then check an aborted stream leaves it
+ * untouched.
+ */
+void test_object_stream(struct test_ctx *ctx)
+{
+	char id[] = "object#stream";
+	char piece[STREAM_PIECE_SIZE];
+	size_t read_len;
+	TEEC_Result res;
+	size_t pos;
+	size_t n;
+
+	printf("\nTest on object \"%s\"\n", id);
+
+	printf("- Stream %u bytes in the TA secure storage\n",
+	       STREAM_OBJECT_SIZE);
+
+	res = stream_secure_object(ctx, TA_SECURE_STORAGE_CMD_STREAM_OPEN,
+				   id, strlen(id));
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to open the stream");
+
+	for (pos = 0; pos < STREAM_OBJECT_SIZE; pos += sizeof(piece)) {
+		for (n = 0; n < sizeof(piece); n++)
+			piece[n] = stream_byte(pos + n);
+
+		res = stream_secure_object(ctx,
+					   TA_SECURE_STORAGE_CMD_STREAM_APPEND,
+					   piece, sizeof(piece));
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to append to the stream");
+	}
+
+	res = stream_secure_object(ctx, TA_SECURE_STORAGE_CMD_STREAM_COMMIT,
+				   NULL, 0);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to commit the stream");
+
+	printf("- Abort a stream replacing the object\n");
+
+	res = stream_secure_object(ctx, TA_SECURE_STORAGE_CMD_STREAM_OPEN,
+				   id, strlen(id));
+	if (res == TEEC_SUCCESS)
+		res = stream_secure_object(ctx,
+					   TA_SECURE_STORAGE_CMD_STREAM_APPEND,
+					   piece, sizeof(piece));
+	if (res == TEEC_SUCCESS)
+		res = stream_secure_object(ctx,
+					   TA_SECURE_STORAGE_CMD_STREAM_ABORT,
+					   NULL, 0);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to abort the stream");
+
+	printf("- Read back the object\n");
+
+	for (pos = 0; pos < STREAM_OBJECT_SIZE; pos += read_len) {
+		read_len = sizeof(piece);
+		res = read_secure_object_range(ctx, id, pos, piece, &read_len);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to read the object");
+		if (!read_len)
+			errx(1, "Object is %zu bytes, expected %u",
+			     pos, STREAM_OBJECT_SIZE);
+
+		for (n = 0; n < read_len; n++)
+			if (piece[n] != stream_byte(pos + n))
+				errx(1, "Unexpected content at offset %zu",
+				     pos + n);
+	}
+
+	printf("- Delete the object\n");
+
+	res = delete_secure_object(ctx, id);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to delete the object: 0x%x", res);
+}
+
+#define LIST_OBJECT_COUNT	5
+#define LIST_PAGE_SIZE		64
+
+/*
+ * List the objects a few entries at a time, then read some of them back
+ * in buffers sized from their metadata.
+ */
+void test_object_list(struct test_ctx *ctx)
+{
+	char id[LIST_OBJECT_COUNT][16];
+	struct secure_storage_list_entry entry;
+	char page[LIST_PAGE_SIZE];
+	unsigned int found = 0;
+	uint32_t cursor = 0;
+	uint32_t count;
+	size_t page_len;
+	size_t data_len;
+	char *data;
+	size_t off;
+	TEEC_Result res;
+	unsigned int n;
+
+	printf("\nTest on listing %u objects\n", LIST_OBJECT_COUNT);
+
+	printf("- Create and load the objects\n");
+
+	data = calloc(1, LIST_OBJECT_COUNT * 100);
+	if (!data)
+		errx(1, "Out of memory");
+
+	for (n = 0; n < LIST_OBJECT_COUNT; n++) {
+		snprintf(id[n], sizeof(id[n]), "list#%u", n);
+		res = write_secure_object(ctx, id[n], data, (n + 1) * 100);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to create %s", id[n]);
+	}
+	free(data);
+
+	printf("- List the objects %u bytes at a time\n", LIST_PAGE_SIZE);
+
+	do {
+		page_len = sizeof(page);
+		res = list_secure_objects(ctx, page, &page_len, &cursor, &count);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to list the objects");
+
+		for (off = 0; count; count--) {
+			memcpy(&entry, page + off, sizeof(entry));
+			off += sizeof(entry);
+
+			if (entry.id_size > 5 && !memcmp(page + off, "list#", 5))
+				found++;
+
+			printf("  %.*s: %u bytes\n", (int)entry.id_size,
+			       page + off, entry.data_size);
+
+			off += TA_SECURE_STORAGE_LIST_ENTRY_SIZE(entry.id_size) -
+			       sizeof(entry);
+		}
+	} while (cursor);
+
+	if (found != LIST_OBJECT_COUNT)
+		errx(1, "Listed %u objects, expected %u", found,
+		     LIST_OBJECT_COUNT);
+
+	printf("- Read back the objects in buffers of their size\n");
+
+	for (n = 0; n < LIST_OBJECT_COUNT; n++) {
+		res = stat_secure_object(ctx, id[n], &data_len);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to get size of %s", id[n]);
+		if (data_len != (n + 1) * 100)
+			errx(1, "Unexpected size %zu of %s", data_len, id[n]);
+
+		data = malloc(data_len);
+		if (!data)
+			errx(1, "Out of memory");
+
+		res = read_secure_object(ctx, id[n], data, data_len);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to read %s", id[n]);
+		free(data);
+
+		res = delete_secure_object(ctx, id[n]);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to delete %s", id[n]);
+	}
+}
+
+#define KV_RECORD_COUNT		1000
+
+/* Value of record @n, version @gen */
+static size_t kv_value(char *val, unsigned int n, unsigned int gen)
+{
+	return snprintf(val, TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE,
+			"value %u of record %u", gen, n);
+}
+
+/*
+ * Check each record holds version @gen of its value, records which
+ * n % @del_mod == 0 being deleted.
+ */
+static void kv_check(struct test_ctx *ctx, unsigned int gen,
+		     unsigned int del_mod)
+{
+	char expected[TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE];
+	char val[TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE];
+	char key[16];
+	size_t exp_len;
+	size_t val_len;
+	TEEC_Result res;
+	unsigned int n;
+
+	for (n = 0; n < KV_RECORD_COUNT; n++) {
+		snprintf(key, sizeof(key), "kv#%u", n);
+		val_len = sizeof(val);
+		res = get_kv_record(ctx, key, val, &val_len);
+
+		if (del_mod && !(n % del_mod)) {
+			if (res != TEEC_ERROR_ITEM_NOT_FOUND)
+				errx(1, "Record %s not deleted", key);
+			continue;
+		}
+
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to get record %s", key);
+
+		exp_len = kv_value(expected, n, n % 2 ? gen : 0);
+		if (val_len != exp_len || memcmp(val, expected, val_len))
+			errx(1, "Unexpected value of record %s", key);
+	}
+}
+
+/*
+ * Store many small records in the key-value store: insert them, replace
+ * half of them, delete some, then check the store survives a new session.
+ */
+void test_kv_store(struct test_ctx *ctx)
+{
+	char val[TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE];
+	char key[16];
+	size_t val_len;
+	uint32_t freed;
+	TEEC_Result res;
+	unsigned int n;
+
+	printf("\nTest on %u records in the key-value store\n",
+	       KV_RECORD_COUNT);
+
+	printf("- Put the records\n");
+
+	for (n = 0; n < KV_RECORD_COUNT; n++) {
+		snprintf(key, sizeof(key), "kv#%u", n);
+		val_len = kv_value(val, n, 0);
+		if (put_kv_record(ctx, key, val, val_len) != TEEC_SUCCESS)
+			errx(1, "Failed to put record %s", key);
+	}
+
+	printf("- Replace odd records, delete one record over 3\n");
+
+	for (n = 0; n < KV_RECORD_COUNT; n++) {
+		snprintf(key, sizeof(key), "kv#%u", n);
+		if (n % 2) {
+			val_len = kv_value(val, n, 1);
+			if (put_kv_record(ctx, key, val, val_len) != TEEC_SUCCESS)
+				errx(1, "Failed to put record %s", key);
+		}
+		if (!(n % 3) && delete_kv_record(ctx, key) != TEEC_SUCCESS)
+			errx(1, "Failed to delete record %s", key);
+	}
+
+	kv_check(ctx, 1, 3);
+
+	printf("- Compact the store\n");
+
+	res = compact_kv_store(ctx, &freed);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to compact the store");
+	printf("  %u segments reclaimed\n", freed);
+
+	printf("- Check the records in a new session\n");
+
+	terminate_tee_session(ctx);
+	prepare_tee_session(ctx);
+
+	kv_check(ctx, 1, 3);
+
+	printf("- Delete the records\n");
+
+	for (n = 0; n < KV_RECORD_COUNT; n++) {
+		snprintf(key, sizeof(key), "kv#%u", n);
+		res = delete_kv_record(ctx, key);
+		if (res != TEEC_SUCCESS && res != TEEC_ERROR_ITEM_NOT_FOUND)
+			errx(1, "Failed to delete record %s", key);
+	}
+
+	res = compact_kv_store(ctx, &freed);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to compact the store");
+}
+
+#define COUNTER_UPDATES		200
+
+static double elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* Rewrite a counter object COUNTER_UPDATES times, return time spent */
+static double update_counter(struct test_ctx *ctx, char *id)
+{
+	struct timespec start;
+	uint32_t counter;
+	uint32_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (n = 1; n <= COUNTER_UPDATES; n++) {
+		counter = n;
+		if (write_secure_object(ctx, id, (char *)&counter,
+					sizeof(counter)) != TEEC_SUCCESS)
+			errx(1, "Failed to write the counter");
+	}
+
+	return elapsed_ms(&start);
+}
+
+static void check_counter(struct test_ctx *ctx, char *id)
+{
+	uint32_t counter = 0;
+	size_t read_len = sizeof(counter);
+
+	if (read_secure_object_range(ctx, id, 0, (char *)&counter,
+				     &read_len) != TEEC_SUCCESS ||
+	    read_len != sizeof(counter) || counter != COUNTER_UPDATES)
+		errx(1, "Unexpected counter value %u", counter);
+}
+
+/*
+ * Rewrite a small object many times, written through then in write-back
+ * mode where the successive writes coalesce in the TA.
+ */
+void test_write_back(struct test_ctx *ctx)
+{
+	char id[] = "object#counter";
+	uint32_t counter;
+	double ms;
+
+	printf("\nTest on object \"%s\"\n", id);
+
+	printf("- Update the object %u times, written through\n",
+	       COUNTER_UPDATES);
+
+	ms = update_counter(ctx, id);
+	check_counter(ctx, id);
+	printf("  %.1f ms\n", ms);
+
+	printf("- Update the object %u times, in write-back mode\n",
+	       COUNTER_UPDATES);
+
+	if (set_write_back(ctx, true) != TEEC_SUCCESS)
+		errx(1, "Failed to enable write-back mode");
+
+	ms = update_counter(ctx, id);
+
+	counter = 0;
+	if (read_secure_object(ctx, id, (char *)&counter,
+			       sizeof(counter)) != TEEC_SUCCESS ||
+	    counter != COUNTER_UPDATES)
+		errx(1, "Unexpected cached counter value %u", counter);
+
+	if (flush_secure_objects(ctx) != TEEC_SUCCESS)
+		errx(1, "Failed to flush the object");
+	check_counter(ctx, id);
+	printf("  %.1f ms\n", ms);
+
+	if (set_write_back(ctx, false) != TEEC_SUCCESS)
+		errx(1, "Failed to disable write-back mode");
+
+	printf("- Delete the object\n");
+
+	if (delete_secure_object(ctx, id) != TEEC_SUCCESS)
+		errx(1, "Failed to delete the object");
+}
+
+#define HOT_OBJECT_SIZE		2048
+#define HOT_OBJECT_READS	100
+
+/*
+ * Read an object many times: all reads but the first one come from the
+ * TA read cache, until the object is written again.
+ */
+void test_read_cache(struct test_ctx *ctx)
+{
+	char id[] = "object#certificate";
+	char data[HOT_OBJECT_SIZE];
+	char read_data[HOT_OBJECT_SIZE];
+	uint32_t hits, hits0;
+	uint32_t misses, misses0;
+	unsigned int n;
+
+	printf("\nTest on object \"%s\"\n", id);
+
+	if (get_cache_stats(ctx, &hits0, &misses0) != TEEC_SUCCESS)
+		errx(1, "Failed to get cache statistics");
+
+	memset(data, 0xC1, sizeof(data));
+	if (write_secure_object(ctx, id, data, sizeof(data)) != TEEC_SUCCESS)
+		errx(1, "Failed to create an object in the secure storage");
+
+	printf("- Read the object %u times\n", HOT_OBJECT_READS);
+
+	for (n = 0; n < HOT_OBJECT_READS; n++) {
+		if (read_secure_object(ctx, id, read_data,
+				       sizeof(read_data)) != TEEC_SUCCESS)
+			errx(1, "Failed to read an object from the secure storage");
+		if (memcmp(data, read_data, sizeof(data)))
+			errx(1, "Unexpected content found in secure storage");
+	}
+
+	if (get_cache_stats(ctx, &hits, &misses) != TEEC_SUCCESS)
+		errx(1, "Failed to get cache statistics");
+	printf("  %u hits, %u misses\n", hits - hits0, misses - misses0);
+	if (hits - hits0 != HOT_OBJECT_READS - 1)
+		errx(1, "Unexpected cache hits");
+
+	printf("- Update the object and read it back\n");
+
+	memset(data, 0xC2, sizeof(data));
+	if (write_secure_object(ctx, id, data, sizeof(data)) != TEEC_SUCCESS)
+		errx(1, "Failed to update the object");
+	if (read_secure_object(ctx, id, read_data,
+			       sizeof(read_data)) != TEEC_SUCCESS)
+		errx(1, "Failed to read an object from the secure storage");
+	if (memcmp(data, read_data, sizeof(data)))
+		errx(1, "Stale content read from the cache");
+
+	printf("- Delete the object\n");
+
+	if (delete_secure_object(ctx, id) != TEEC_SUCCESS)
+		errx(1, "Failed to delete the object");
+	if (read_secure_object(ctx, id, read_data,
+			       sizeof(read_data)) != TEEC_ERROR_ITEM_NOT_FOUND)
+		errx(1, "Deleted object still read");
+}
+
+#define POLICY_OBJECT_SIZE	(12 * 1024)
+
+/*
+ * Store a text policy blob compressed and read it back: the TA returns
+ * the original data and size.
+ */
+void test_compressed_object(struct test_ctx *ctx)
+{
+	char id[] = "object#policy";
+	char *data;
+	char *read_data;
+	size_t data_len = 0;
+	size_t read_len;
+	unsigned int n;
+
+	printf("\nTest on object \"%s\"\n", id);
+
+	data = malloc(POLICY_OBJECT_SIZE);
+	read_data = malloc(POLICY_OBJECT_SIZE);
+	if (!data || !read_data)
+		errx(1, "Out of memory");
+
+	for (n = 0; data_len < POLICY_OBJECT_SIZE - 128; n++)
+		data_len += snprintf(data + data_len,
+				     POLICY_OBJECT_SIZE - data_len,
+				     "{\"rule\": %u, \"path\": \"/data/app/%u\", "
+				     "\"allow\": %s},\n", n, n % 37,
+				     n % 3 ? "true" : "false");
+
+	printf("- Create and load a %zu bytes object, compressed\n", data_len);
+
+	if (write_compressed_secure_object(ctx, id, data,
+					   data_len) != TEEC_SUCCESS)
+		errx(1, "Failed to create an object in the secure storage");
+
+	printf("- Read back the object in a buffer of its size\n");
+
+	if (stat_secure_object(ctx, id, &read_len) != TEEC_SUCCESS)
+		errx(1, "Failed to get the object size");
+	if (read_len != data_len)
+		errx(1, "Unexpected size %zu, expected %zu", read_len, data_len);
+
+	if (read_secure_object(ctx, id, read_data,
+			       read_len - 1) != TEEC_ERROR_SHORT_BUFFER)
+		errx(1, "Short buffer not reported");
+	if (read_secure_object(ctx, id, read_data, read_len) != TEEC_SUCCESS)
+		errx(1, "Failed to read an object from the secure storage");
+	if (memcmp(data, read_data, data_len))
+		errx(1, "Unexpected content found in secure storage");
+
+	printf("- Delete the object\n");
+
+	if (delete_secure_object(ctx, id) != TEEC_SUCCESS)
+		errx(1, "Failed to delete the object");
+
+	free(read_data);
+	free(data);
+}
+
+#define TX_OBJECT_COUNT		4
+#define TX_OBJECT_SIZE		256
+
+static void tx_check(struct test_ctx *ctx, char id[][16], char gen)
+{
+	char data[TX_OBJECT_SIZE];
+	char read_data[TX_OBJECT_SIZE];
+	unsigned int n;
+
+	memset(data, gen, sizeof(data));
+	for (n = 0; n < TX_OBJECT_COUNT; n++) {
+		if (read_secure_object(ctx, id[n], read_data,
+				       sizeof(read_data)) != TEEC_SUCCESS)
+			errx(1, "Failed to read %s", id[n]);
+		if (memcmp(data, read_data, sizeof(data)))
+			errx(1, "Unexpected content found in %s", id[n]);
+	}
+}
+
+/*
+ * Update TX_OBJECT_COUNT related objects in transactions: the objects
+ * keep their content until the commit, an aborted update leaves them
+ * untouched.
+ */
+void test_transaction(struct test_ctx *ctx)
+{
+	char id[TX_OBJECT_COUNT][16];
+	char data[TX_OBJECT_SIZE];
+	unsigned int n;
+
+	printf("\nTest on %u objects updated in transactions\n",
+	       TX_OBJECT_COUNT);
+
+	printf("- Create and load the objects\n");
+
+	memset(data, 'A', sizeof(data));
+	for (n = 0; n < TX_OBJECT_COUNT; n++) {
+		snprintf(id[n], sizeof(id[n]), "config#%u", n);
+		if (write_secure_object(ctx, id[n], data,
+					sizeof(data)) != TEEC_SUCCESS)
+			errx(1, "Failed to create %s", id[n]);
+	}
+
+	printf("- Update the objects in a transaction\n");
+
+	if (tx_secure_objects(ctx, TA_SECURE_STORAGE_CMD_TX_BEGIN,
+			      NULL, NULL, 0) != TEEC_SUCCESS)
+		errx(1, "Failed to begin a transaction");
+
+	memset(data, 'B', sizeof(data));
+	for (n = 0; n < TX_OBJECT_COUNT; n++)
+		if (tx_secure_objects(ctx, TA_SECURE_STORAGE_CMD_TX_PUT,
+				      id[n], data, sizeof(data)) != TEEC_SUCCESS)
+			errx(1, "Failed to put %s", id[n]);
+
+	tx_check(ctx, id, 'A');
+
+	if (tx_secure_objects(ctx, TA_SECURE_STORAGE_CMD_TX_COMMIT,
+			      NULL, NULL, 0) != TEEC_SUCCESS)
+		errx(1, "Failed to commit the transaction");
+
+	tx_check(ctx, id, 'B');
+
+	printf("- Abort an update of the objects\n");
+
+	if (tx_secure_objects(ctx, TA_SECURE_STORAGE_CMD_TX_BEGIN,
+			      NULL, NULL, 0) != TEEC_SUCCESS)
+		errx(1, "Failed to begin a transaction");
+
+	memset(data, 'C', sizeof(data));
+	for (n = 0; n < TX_OBJECT_COUNT; n++)
+		if (tx_secure_objects(ctx, TA_SECURE_STORAGE_CMD_TX_PUT,
+				      id[n], data, sizeof(data)) != TEEC_SUCCESS)
+			errx(1, "Failed to put %s", id[n]);
+
+	if (tx_secure_objects(ctx, TA_SECURE_STORAGE_CMD_TX_ABORT,
+			      NULL, NULL, 0) != TEEC_SUCCESS)
+		errx(1, "Failed to abort the transaction");
+
+	tx_check(ctx, id, 'B');
+
+	printf("- Delete the objects\n");
+
+	for (n = 0; n < TX_OBJECT_COUNT; n++)
+		if (delete_secure_object(ctx, id[n]) != TEEC_SUCCESS)
+			errx(1, "Failed to delete %s", id[n]);
+}
+
+/*
+ * Write, read back and delete MULTI_OBJECT_COUNT objects with a single
+ * invocation of the TA for each step.
+ */
+void test_multi_objects(struct test_ctx *ctx)
+{
+	char id[MULTI_OBJECT_COUNT][16];
+	char data[MULTI_OBJECT_SIZE];
+	struct secure_storage_record rec;
+	size_t list_len = 0;
+	size_t off;
+	char *list;
+	TEEC_Result res;
+	unsigned int n;
+
+	printf("\nTest on %u objects in single invocations\n",
+	       MULTI_OBJECT_COUNT);
+
+	for (n = 0; n < MULTI_OBJECT_COUNT; n++) {
+		snprintf(id[n], sizeof(id[n]), "multi#%u", n);
+		list_len += TA_SECURE_STORAGE_RECORD_SIZE(strlen(id[n]),
+							  sizeof(data));
+	}
+
+	list = malloc(list_len);
+	if (!list)
+		errx(1, "Out of memory");
+
+	printf("- Create and load the objects\n");
+
+	for (n = 0, off = 0; n < MULTI_OBJECT_COUNT; n++) {
+		memset(data, 0xB0 + n, sizeof(data));
+		off += pack_record(list + off, id[n], data, sizeof(data));
+	}
+
+	res = process_secure_objects(ctx, TA_SECURE_STORAGE_CMD_WRITE_MULTI,
+				     list, list_len);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to create the objects");
+
+	for (n = 0, off = 0; n < MULTI_OBJECT_COUNT; n++) {
+		memcpy(&rec, list + off, sizeof(rec));
+		if (rec.status != TEEC_SUCCESS)
+			errx(1, "Failed to create %s: 0x%x", id[n], rec.status);
+		off += TA_SECURE_STORAGE_RECORD_SIZE(rec.id_size, sizeof(data));
+	}
+
+	printf("- Read back the objects\n");
+
+	memset(list, 0, list_len);
+	for (n = 0, off = 0; n < MULTI_OBJECT_COUNT; n++)
+		off += pack_record(list + off, id[n], NULL, sizeof(data));
+
+	res = process_secure_objects(ctx, TA_SECURE_STORAGE_CMD_READ_MULTI,
+				     list, list_len);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to read the objects");
+
+	for (n = 0, off = 0; n < MULTI_OBJECT_COUNT; n++) {
+		memcpy(&rec, list + off, sizeof(rec));
+		if (rec.status != TEEC_SUCCESS)
+			errx(1, "Failed to read %s: 0x%x", id[n], rec.status);
+
+		memset(data, 0xB0 + n, sizeof(data));
+		if (rec.data_size != sizeof(data) ||
+		    memcmp(list + off + sizeof(rec) + rec.id_size, data,
+			   sizeof(data)))
+			errx(1, "Unexpected content found in %s", id[n]);
+
+		off += TA_SECURE_STORAGE_RECORD_SIZE(rec.id_size, sizeof(data));
+	}
+
+	printf("- Delete the objects\n");
+
+	for (n = 0, off = 0; n < MULTI_OBJECT_COUNT; n++)
+		off += pack_record(list + off, id[n], NULL, 0);
+
+	res = process_secure_objects(ctx, TA_SECURE_STORAGE_CMD_DELETE_MULTI,
+				     list, off);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to delete the objects");
+
+	for (n = 0, off = 0; n < MULTI_OBJECT_COUNT; n++) {
+		memcpy(&rec, list + off, sizeof(rec));
+		if (rec.status != TEEC_SUCCESS)
+			errx(1, "Failed to delete %s: 0x%x", id[n], rec.status);
+		off += TA_SECURE_STORAGE_RECORD_SIZE(rec.id_size, 0);
+	}
+
+	free(list);
+}
+
+/*
+ * Storage benchmark (--bench): for each backend and object size, time each
+ * operation over a set of objects, then a mix of reads and overwrites.
+ * Objects are accessed in an explicit storage so that the TA caches do not
+ * serve them: the figures are the ones of the backend.
+ */
+#define BENCH_MIN_SIZE		256
+#define BENCH_MAX_SIZE		(64 * 1024)
+#define BENCH_OBJECTS		100
+#define BENCH_READ_PCT		80
+
+enum bench_op {
+	BENCH_CREATE,
+	BENCH_OVERWRITE,
+	BENCH_READ,
+	BENCH_EXISTS,
+	BENCH_MIX,		/* reads and overwrites, see --read-pct */
+	BENCH_DELETE,
+	BENCH_OP_COUNT,
+};
+
+struct bench_cfg {
+	size_t min_sz;
+	size_t max_sz;
+	unsigned int objects;
+	unsigned int read_pct;
+	const char *storage;	/* NULL for all backends */
+};
+
+static const char * const bench_op_names[] = {
+	[BENCH_CREATE] = "create",
+	[BENCH_OVERWRITE] = "overwrite",
+	[BENCH_READ] = "read",
+	[BENCH_EXISTS] = "exists",
+	[BENCH_MIX] = "mix",
+	[BENCH_DELETE] = "delete",
+};
+
+static const struct {
+	const char *name;
+	uint32_t id;
+} bench_storages[] = {
+	{ "ree", TA_SECURE_STORAGE_PRIVATE_REE },
+	{ "rpmb", TA_SECURE_STORAGE_PRIVATE_RPMB },
+};
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Percentile @p (per thousand) of @count sorted values, in microseconds */
+static double bench_percentile(uint64_t *lat, size_t count, unsigned int p)
+{
+	size_t idx = (count * p + 999) / 1000;
+
+	if (idx)
+		idx--;
+
+	return lat[idx] / 1000.0;
+}
+
+/* Invoke @cmd on object @id of @storage */
+static TEEC_Result bench_invoke(struct test_ctx *ctx, uint32_t cmd,
+				uint32_t storage, char *id,
+				char *data, size_t data_len)
+{
+	TEEC_Operation op;
+	uint32_t origin;
+	uint32_t type;
+
+	memset(&op, 0, sizeof(op));
+	op.params[0].tmpref.buffer = id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = data_len;
+	op.params[3].value.a = storage;
+
+	switch (cmd) {
+	case TA_SECURE_STORAGE_CMD_WRITE_RAW:
+		type = TEEC_MEMREF_TEMP_INPUT;
+		break;
+	case TA_SECURE_STORAGE_CMD_READ_RAW:
+		type = TEEC_MEMREF_TEMP_OUTPUT;
+		break;
+	case TA_SECURE_STORAGE_CMD_STAT:
+		type = TEEC_VALUE_OUTPUT;
+		break;
+	default:
+		type = TEEC_NONE;
+	}
+
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, type,
+					 TEEC_NONE, TEEC_VALUE_INPUT);
+
+	return TEEC_InvokeCommand(&ctx->sess, cmd, &op, &origin);
+}
+
+/*
+ * Run operation @op of @sz bytes on the objects of @storage, latencies in
+ * @lat. Return the wall time in seconds, negative on failure.
+ */
+/* Next object size, 0 past --max-size */
+static size_t bench_next_size(struct bench_cfg *cfg, size_t sz)
+{
+	/* Checked before doubling, which could wrap around */
+	if (sz > cfg->max_sz / 2)
+		return 0;
+
+	return sz * 2;
+}
+
+static double bench_run_op(struct test_ctx *ctx, struct bench_cfg *cfg,
+			   uint32_t storage, enum bench_op op,
+			   char *data, size_t sz, uint64_t *lat)
+{
+	char id[16];
+	uint64_t start = bench_now_ns();
+	uint64_t t;
+	TEEC_Result res;
+	uint32_t cmd;
+	unsigned int n;
+
+	for (n = 0; n < cfg->objects; n++) {
+		snprintf(id, sizeof(id), "bench#%u", n);
+
+		switch (op) {
+		case BENCH_CREATE:
+		case BENCH_OVERWRITE:
+			cmd = TA_SECURE_STORAGE_CMD_WRITE_RAW;
+			break;
+		case BENCH_READ:
+			cmd = TA_SECURE_STORAGE_CMD_READ_RAW;
+			break;
+		case BENCH_EXISTS:
+			cmd = TA_SECURE_STORAGE_CMD_STAT;
+			break;
+		case BENCH_MIX:
+			cmd = (unsigned int)rand() % 100 < cfg->read_pct ?
+			      TA_SECURE_STORAGE_CMD_READ_RAW :
+			      TA_SECURE_STORAGE_CMD_WRITE_RAW;
+			break;
+		default:
+			cmd = TA_SECURE_STORAGE_CMD_DELETE;
+		}
+
+		t = bench_now_ns();
+		res = bench_invoke(ctx, cmd, storage, id, data, sz);
+		lat[n] = bench_now_ns() - t;
+		if (res != TEEC_SUCCESS) {
+			fprintf(stderr, "%s of %s failed: 0x%x\n",
+				bench_op_names[op], id, res);
+			return -1;
+		}
+	}
+
+	return (bench_now_ns() - start) / 1e9;
+}
+
+/* Delete the objects left in @storage by a failed operation */
+static void bench_cleanup(struct test_ctx *ctx, struct bench_cfg *cfg,
+			  uint32_t storage)
+{
+	char id[16];
+	unsigned int n;
+
+	for (n = 0; n < cfg->objects; n++) {
+		snprintf(id, sizeof(id), "bench#%u", n);
+		bench_invoke(ctx, TA_SECURE_STORAGE_CMD_DELETE, storage, id,
+			     NULL, 0);
+	}
+}
+
+void run_bench(struct bench_cfg *cfg)
+{
+	struct test_ctx ctx;
+	bool first = true;
+	uint64_t *lat;
+	size_t bytes;
+	double secs;
+	char *data;
+	unsigned int n;
+	unsigned int op;
+	size_t sz;
+
+	data = malloc(cfg->max_sz);
+	lat = calloc(cfg->objects, sizeof(*lat));
+	if (!data || !lat)
+		errx(1, "Cannot allocate benchmark state");
+	memset(data, 0x5a, cfg->max_sz);
+
+	prepare_tee_session(&ctx);
+
+	printf("{\n");
+	printf("  \"objects\": %u,\n", cfg->objects);
+	printf("  \"read_pct\": %u,\n", cfg->read_pct);
+	printf("  \"results\": [");
+
+	for (n = 0; n < ARRAY_SIZE(bench_storages); n++) {
+		if (cfg->storage && strcmp(cfg->storage, bench_storages[n].name))
+			continue;
+
+		for (sz = cfg->min_sz; sz; sz = bench_next_size(cfg, sz)) {
+			for (op = 0; op < BENCH_OP_COUNT; op++) {
+				secs = bench_run_op(&ctx, cfg,
+						    bench_storages[n].id, op,
+						    data, sz, lat);
+				if (secs < 0)
+					break;
+
+				bytes = op == BENCH_EXISTS ||
+					op == BENCH_DELETE ? 0 : sz;
+				qsort(lat, cfg->objects, sizeof(*lat),
+				      bench_cmp_u64);
+
+				printf("%s\n    { \"storage\": \"%s\", "
+				       "\"size\": %zu, \"op\": \"%s\", "
+				       "\"ops\": %u, \"seconds\": %.6f, "
+				       "\"mb_per_s\": %.2f, "
+				       "\"ops_per_s\": %.1f, \"p50_us\": %.1f, "
+				       "\"p99_us\": %.1f, \"p999_us\": %.1f }",
+				       first ? "" : ",", bench_storages[n].name,
+				       sz, bench_op_names[op], cfg->objects,
+				       secs, cfg->objects * bytes / secs / 1e6,
+				       cfg->objects / secs,
+				       bench_percentile(lat, cfg->objects, 500),
+				       bench_percentile(lat, cfg->objects, 990),
+				       bench_percentile(lat, cfg->objects, 999));
+				fflush(stdout);
+				first = false;
+			}
+
+			/* Backend failing or not available: skip it */
+			if (op != BENCH_OP_COUNT) {
+				bench_cleanup(&ctx, cfg, bench_storages[n].id);
+				break;
+			}
+		}
+	}
+
+	printf("\n  ]\n}\n");
+
+	terminate_tee_session(&ctx);
+	free(lat);
+	free(data);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--bench [options]]\n"
+		"Without argument, run the secure storage examples.\n"
+		"\n"
+		"Benchmark options:\n"
+		"  --storage NAME    ree or rpmb (default both)\n"
+		"  --min-size BYTES  smallest object size (default %d)\n"
+		"  --max-size BYTES  largest object size (default %d),\n"
+		"                    sizes double from the smallest one\n"
+		"  --objects N       objects per size (default %d)\n"
+		"  --read-pct P      percentage of reads in the mixed\n"
+		"                    operations (default %d)\n",
+		prog, BENCH_MIN_SIZE, BENCH_MAX_SIZE, BENCH_OBJECTS,
+		BENCH_READ_PCT);
+	exit(1);
+}
+
+static unsigned long parse_num(const char *prog, const char *arg,
+			       unsigned long min, unsigned long max)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 0);
+	if (!*arg || *end || errno || val < min || val > max)
+		usage(prog);
+
+	return val;
+}
+
+static void run_demo(void)
+{
+	struct test_ctx ctx;
+	char obj1_id[] = "object#1";		/* string identification for the object */
+	char obj2_id[] = "object#2";		/* string identification for the object */
+	char obj1_data[TEST_OBJECT_SIZE];
+	char read_data[TEST_OBJECT_SIZE];
+	TEEC_Result res;
+
+	printf("Prepare session with the TA\n");
+	prepare_tee_session(&ctx);
+
+	/*
+	 * Create object, read it, delete it.
+	 */
+	printf("\nTest on object \"%s\"\n", obj1_id);
+
+	printf("- Create and load object in the TA secure storage\n");
+
+	memset(obj1_data, 0xA1, sizeof(obj1_data));
+
+	res = write_secure_object(&ctx, obj1_id,
+				  obj1_data, sizeof(obj1_data));
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to create an object in the secure storage");
+
+	printf("- Read back the object\n");
+
+	res = read_secure_object(&ctx, obj1_id,
+				 read_data, sizeof(read_data));
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to read an object from the secure storage");
+	if (memcmp(obj1_data, read_data, sizeof(obj1_data)))
+		errx(1, "Unexpected content found in secure storage");
+
+	printf("- Delete the object\n");
+
+	res = delete_secure_object(&ctx, obj1_id);
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to delete the object: 0x%x", res);
+
+	/*
+	 * Non volatile storage: create object2 if not found, delete it if found
+	 */
+	printf("\nTest on object \"%s\"\n", obj2_id);
+
+	res = read_secure_object(&ctx, obj2_id,
+				  read_data, sizeof(read_data));
+	if (res != TEEC_SUCCESS && res != TEEC_ERROR_ITEM_NOT_FOUND)
+		errx(1, "Unexpected status when reading an object : 0x%x", res);
+
+	if (res == TEEC_ERROR_ITEM_NOT_FOUND) {
+		char data[] = "This is data stored in the secure storage.\n";
+
+		printf("- Object not found in TA secure storage, create it.\n");
+
+		res = write_secure_object(&ctx, obj2_id,
+					  data, sizeof(data));
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to create/load an object");
+
+	} else if (res == TEEC_SUCCESS) {
+		printf("- Object found in TA secure storage, delete it.\n");
+
+		res = delete_secure_object(&ctx, obj2_id);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to delete an object");
+	}
+
+	test_multi_objects(&ctx);
+	test_object_range(&ctx);
+	test_object_stream(&ctx);
+	test_object_list(&ctx);
+	test_kv_store(&ctx);
+	test_write_back(&ctx);
+	test_read_cache(&ctx);
+	test_compressed_object(&ctx);
+	test_transaction(&ctx);
+
+	printf("\nWe're done, close and release TEE resources\n");
+	terminate_tee_session(&ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{ "bench", no_argument, NULL, 'b' },
+		{ "storage", required_argument, NULL, 's' },
+		{ "min-size", required_argument, NULL, 'm' },
+		{ "max-size", required_argument, NULL, 'M' },
+		{ "objects", required_argument, NULL, 'o' },
+		{ "read-pct", required_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct bench_cfg cfg = {
+		.min_sz = BENCH_MIN_SIZE,
+		.max_sz = BENCH_MAX_SIZE,
+		.objects = BENCH_OBJECTS,
+		.read_pct = BENCH_READ_PCT,
+	};
+	bool bench = false;
+	size_t n;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = true;
+			break;
+		case 's':
+			for (n = 0; n < ARRAY_SIZE(bench_storages); n++)
+				if (!strcmp(optarg, bench_storages[n].name))
+					break;
+			if (n == ARRAY_SIZE(bench_storages))
+				usage(argv[0]);
+			cfg.storage = bench_storages[n].name;
+			break;
+		case 'm':
+			cfg.min_sz = parse_num(argv[0], optarg, 1, SIZE_MAX);
+			break;
+		case 'M':
+			cfg.max_sz = parse_num(argv[0], optarg, 1, SIZE_MAX);
+			break;
+		case 'o':
+			cfg.objects = parse_num(argv[0], optarg, 1, UINT_MAX);
+			break;
+		case 'r':
+			cfg.read_pct = parse_num(argv[0], optarg, 0, 100);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (!bench) {
+		run_demo();
+		return 0;
+	}
+
+	if (cfg.min_sz > cfg.max_sz)
+		usage(argv[0]);
+
+	run_bench(&cfg);
 	return 0;
 }
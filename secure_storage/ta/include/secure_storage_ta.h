@@ -27,16 +27,37 @@
 #ifndef __SECURE_STORAGE_H__
 #define __SECURE_STORAGE_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* UUID of the trusted application */
 #define TA_SECURE_STORAGE_UUID \
 		{ 0xf4e750bb, 0x1437, 0x4fbf, \
 			{ 0x87, 0x85, 0x8d, 0x35, 0x80, 0xc3, 0x49, 0x94 } }
+
+/*
+ * Storage of the object for READ_RAW, WRITE_RAW, DELETE and STAT: the
+ * default private storage, or a given OP-TEE backend. The read cache and
+ * the write-back cache only serve the default private storage.
+ */
+#define TA_SECURE_STORAGE_PRIVATE	0x00000001
+#define TA_SECURE_STORAGE_PRIVATE_REE	0x80000000
+#define TA_SECURE_STORAGE_PRIVATE_RPMB	0x80000100
+
+/*
+ * Object IDs starting with TA_SECURE_STORAGE_RESERVED_ID are reserved to the
+ * objects the TA manages itself: the object commands fail with
+ * TEE_ERROR_ACCESS_DENIED on such IDs and TA_SECURE_STORAGE_CMD_LIST skips
+ * them.
+ */
+#define TA_SECURE_STORAGE_RESERVED_ID	".ss/"
+
 /*
  * TA_SECURE_STORAGE_CMD_READ_RAW - Create and fill a secure storage file
  * param[0] (memref) ID used the identify the persistent object
  * param[1] (memref) Raw data dumped from the persistent object
  * param[2] unused
- * param[3] unused
+ * param[3] (value) Optional, a: TA_SECURE_STORAGE_PRIVATE_xxx
  */
 #define TA_SECURE_STORAGE_CMD_READ_RAW		0
 
@@ -44,18 +65,331 @@
  * TA_SECURE_STORAGE_CMD_WRITE_RAW - Create and fill a secure storage file
  * param[0] (memref) ID used the identify the persistent object
  * param[1] (memref) Raw data to be writen in the persistent object
- * param[2] unused
- * param[3] unused
+ * param[2] (value) Optional, a: TA_SECURE_STORAGE_FLAG_xxx
+ * param[3] (value) Optional, a: TA_SECURE_STORAGE_PRIVATE_xxx
  */
 #define TA_SECURE_STORAGE_CMD_WRITE_RAW		1
 
+/*
+ * Store the object data compressed. READ_RAW, READ_MULTI and STAT return
+ * the original data and size. Compressed objects are read and written
+ * whole: READ_RANGE, WRITE_RANGE and TRUNCATE fail with
+ * TEE_ERROR_NOT_SUPPORTED and LIST reports their size in storage.
+ */
+#define TA_SECURE_STORAGE_FLAG_COMPRESS		(1 << 0)
+
 /*
  * TA_SECURE_STORAGE_CMD_DELETE - Delete a persistent object
  * param[0] (memref) ID used the identify the persistent object
  * param[1] unused
  * param[2] unused
- * param[3] unused
+ * param[3] (value) Optional, a: TA_SECURE_STORAGE_PRIVATE_xxx
  */
 #define TA_SECURE_STORAGE_CMD_DELETE		2
 
+/*
+ * Multi-object commands process a list of records packed in a single
+ * memref. Each record is a struct secure_storage_record followed by the
+ * object ID then the object data, the next record starting at the next
+ * 4 bytes aligned offset (see TA_SECURE_STORAGE_RECORD_SIZE()). Records
+ * are processed in order, each one getting its own status: the command
+ * itself only fails on a malformed list. The layout of the list is the
+ * one built by the caller: the TA updates status and data_size in place
+ * but never moves the records.
+ */
+struct secure_storage_record {
+	uint32_t status;	/* Output: TEE_Result of the record */
+	uint32_t id_size;	/* Object ID size in bytes */
+	uint32_t data_size;	/* Data size in bytes, see commands */
+};
+
+#define TA_SECURE_STORAGE_RECORD_SIZE(id_size, data_size) \
+	((sizeof(struct secure_storage_record) + (id_size) + (data_size) + 3) & \
+	 ~(size_t)3)
+
+/*
+ * TA_SECURE_STORAGE_CMD_WRITE_MULTI - Create and fill several objects
+ * param[0] (memref) records, data_size is the size of the object data
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_WRITE_MULTI	3
+
+/*
+ * TA_SECURE_STORAGE_CMD_READ_MULTI - Read several objects
+ * param[0] (memref) records, data_size is the room reserved for the
+ *                   object data. It is updated with the object size,
+ *                   also when the status is TEE_ERROR_SHORT_BUFFER.
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_READ_MULTI	4
+
+/*
+ * TA_SECURE_STORAGE_CMD_DELETE_MULTI - Delete several objects
+ * param[0] (memref) records, data_size shall be 0
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_DELETE_MULTI	5
+
+/*
+ * TA_SECURE_STORAGE_CMD_READ_RANGE - Read part of a persistent object
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (memref) Data read from the object, size is updated with the
+ *                   bytes read: less than requested past end of object
+ * param[2] (value) a: offset in bytes of the first byte to read
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_READ_RANGE	6
+
+/*
+ * TA_SECURE_STORAGE_CMD_WRITE_RANGE - Write part of an existing object
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (memref) Data to be written in the object
+ * param[2] (value) a: offset in bytes of the first byte to write. The
+ *                  object grows as needed, a gap past the previous end of
+ *                  object reads as zeros.
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_WRITE_RANGE	7
+
+/*
+ * TA_SECURE_STORAGE_CMD_TRUNCATE - Change the size of a persistent object
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (value) a: new size in bytes, extending the object with zeros
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_TRUNCATE		8
+
+/*
+ * Streaming commands build an object larger than a single shared memory
+ * buffer over several invocations. Data goes to a temporary object that
+ * replaces the target object on commit: the target object keeps its
+ * previous content until then. One stream at most is open per session,
+ * closing the session aborts it. Large objects are read back with
+ * TA_SECURE_STORAGE_CMD_READ_RANGE.
+ */
+
+/*
+ * TA_SECURE_STORAGE_CMD_STREAM_OPEN - Start streaming data to an object
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_STREAM_OPEN	9
+
+/*
+ * TA_SECURE_STORAGE_CMD_STREAM_APPEND - Append data to the open stream
+ * param[0] (memref) Data to be appended. On error the stream is aborted.
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_STREAM_APPEND	10
+
+/*
+ * TA_SECURE_STORAGE_CMD_STREAM_COMMIT - Replace the object with the
+ * streamed data and close the stream. On error, or if the TA is reset
+ * meanwhile, the object keeps its previous content.
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_STREAM_COMMIT	11
+
+/*
+ * TA_SECURE_STORAGE_CMD_STREAM_ABORT - Drop the streamed data, the object
+ * is left unchanged
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_STREAM_ABORT	12
+
+/*
+ * Entry returned by TA_SECURE_STORAGE_CMD_LIST: the struct is followed by
+ * the object ID, the next entry starting at the next 4 bytes aligned
+ * offset (see TA_SECURE_STORAGE_LIST_ENTRY_SIZE()).
+ */
+struct secure_storage_list_entry {
+	uint32_t id_size;	/* Object ID size in bytes */
+	uint32_t data_size;	/* Object data size in bytes */
+};
+
+#define TA_SECURE_STORAGE_LIST_ENTRY_SIZE(id_size) \
+	((sizeof(struct secure_storage_list_entry) + (id_size) + 3) & \
+	 ~(size_t)3)
+
+/*
+ * TA_SECURE_STORAGE_CMD_LIST - List the persistent objects of the TA
+ * param[0] (memref) Entries, size is updated with the bytes filled. If not
+ *                   even one entry fits, TEE_ERROR_SHORT_BUFFER is returned
+ *                   with the size needed.
+ * param[1] (value) a: [in] 0 to start listing, else the cursor returned by
+ *                  the previous call. [out] cursor for the next call, 0
+ *                  once all objects are listed.
+ *                  b: [out] number of entries returned
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_LIST		13
+
+/*
+ * TA_SECURE_STORAGE_CMD_STAT - Get the size of a persistent object
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (value) a: [out] object data size in bytes
+ * param[2] unused
+ * param[3] (value) Optional, a: TA_SECURE_STORAGE_PRIVATE_xxx
+ */
+#define TA_SECURE_STORAGE_CMD_STAT		14
+
+/*
+ * Key-value store commands keep small records packed in large segment
+ * objects rather than one object per record. The store objects have
+ * reserved IDs: object commands cannot access them.
+ */
+#define TA_SECURE_STORAGE_KV_MAX_KEY_SIZE	64
+#define TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE	1024
+
+/*
+ * TA_SECURE_STORAGE_CMD_KV_PUT - Insert or replace a record
+ * param[0] (memref) Key, 1 to TA_SECURE_STORAGE_KV_MAX_KEY_SIZE bytes
+ * param[1] (memref) Value, up to TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE bytes
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_KV_PUT		15
+
+/*
+ * TA_SECURE_STORAGE_CMD_KV_GET - Get the value of a record
+ * param[0] (memref) Key
+ * param[1] (memref) Value, size is updated with the value size, also when
+ *                   TEE_ERROR_SHORT_BUFFER is returned
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_KV_GET		16
+
+/*
+ * TA_SECURE_STORAGE_CMD_KV_DELETE - Delete a record
+ * param[0] (memref) Key
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_KV_DELETE		17
+
+/*
+ * TA_SECURE_STORAGE_CMD_KV_COMPACT - Reclaim the space of the replaced
+ * and deleted records. The store also compacts its segments on its own
+ * as they fill up.
+ * param[0] (value) a: [out] number of segments reclaimed
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_KV_COMPACT	18
+
+/*
+ * TA_SECURE_STORAGE_CMD_WRITE_BACK - Enable or disable write-back mode
+ * param[0] (value) a: 1 to enable, 0 to disable and flush
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ *
+ * In write-back mode, TA_SECURE_STORAGE_CMD_WRITE_RAW of small objects
+ * completes in a bounded cache of the session, successive writes of an
+ * object replacing each other there. Cached objects are written to the
+ * secure storage on TA_SECURE_STORAGE_CMD_FLUSH, when the cache is full,
+ * when disabling write-back mode and when closing the session. Until
+ * then, a failure loses them. Other commands see the cached content.
+ */
+#define TA_SECURE_STORAGE_CMD_WRITE_BACK	19
+
+/*
+ * TA_SECURE_STORAGE_CMD_FLUSH - Write the cached objects to the secure
+ * storage
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_FLUSH		20
+
+/*
+ * TA_SECURE_STORAGE_CMD_CACHE_STATS - Get read cache statistics
+ * param[0] (value) a: [out] reads served from the cache
+ *                  b: [out] reads from the secure storage
+ * param[1] (value) a: [out] objects in the cache
+ *                  b: [out] bytes in the cache
+ * param[2] unused
+ * param[3] unused
+ *
+ * TA_SECURE_STORAGE_CMD_READ_RAW and TA_SECURE_STORAGE_CMD_READ_MULTI keep
+ * the small objects they read in a cache of the TA instance, invalidated
+ * by the commands writing or deleting them.
+ */
+#define TA_SECURE_STORAGE_CMD_CACHE_STATS	21
+
+/*
+ * Transaction commands update a set of objects atomically. Data put in
+ * the transaction goes to temporary objects with reserved IDs, published
+ * on commit: all the objects get their new content or,
+ * on abort or on a failure before the commit records its journal, none of
+ * them. Once the journal is recorded, a commit interrupted by a failure or
+ * a reset is completed when the TA is next loaded or before it serves any
+ * other command, which fails while it cannot. The other commands see the
+ * previous content until the commit.
+ * One transaction at most is open in the TA, closing its session aborts
+ * it.
+ */
+
+/*
+ * TA_SECURE_STORAGE_CMD_TX_BEGIN - Open a transaction, TEE_ERROR_BUSY if
+ * another session has one open
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_TX_BEGIN		22
+
+/*
+ * TA_SECURE_STORAGE_CMD_TX_PUT - Write an object in the transaction, up to
+ * TA_SECURE_STORAGE_TX_MAX_OBJECTS objects
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (memref) Raw data to be writen in the persistent object
+ * param[2] (value) Optional, a: TA_SECURE_STORAGE_FLAG_xxx
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_TX_PUT		23
+
+/*
+ * TA_SECURE_STORAGE_CMD_TX_COMMIT - Publish the objects of the transaction
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_TX_COMMIT		24
+
+/*
+ * TA_SECURE_STORAGE_CMD_TX_ABORT - Discard the objects of the transaction
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_TX_ABORT		25
+
+#define TA_SECURE_STORAGE_TX_MAX_OBJECTS	16
+
 #endif /* __SECURE_STORAGE_H__ */
@@ -0,0 +1,1040 @@
+/*
+ * Copyright (c) 2017, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <secure_storage_ta.h>
+#include <stdio.h>
+#include <string.h>
+#include <tee_internal_api.h>
+#include <tee_internal_api_extensions.h>
+
+#include "kv_store.h"
+
+/*
+ * Records are appended to the active segment, the last one of the segment
+ * list. When it is full, the active segment is sealed and a new one is
+ * created. A record replacing or deleting a key makes the previous record
+ * of the key dead: compaction copies the live records of a sealed segment
+ * to the active segment then deletes the sealed segment.
+ *
+ * The index maps the key hashes to the record locations. It is kept in
+ * TA memory and checkpointed in the index object on compaction and on
+ * kv_close(). Opening the store loads the checkpoint then replays the
+ * records appended since then. The index lives in the TA heap: its size,
+ * 16 bytes per slot with at most 3/4 of the slots used, bounds the number
+ * of keys.
+ */
+#define KV_SEGMENT_SIZE		(64 * 1024)
+#define KV_MAX_SEGMENTS		32
+#define KV_MIN_SLOTS		64
+
+#define KV_RECORD_MAGIC		0x4b565231	/* "KVR1" */
+#define KV_INDEX_MAGIC		0x4b564931	/* "KVI1" */
+
+#define KV_RECORD_TOMBSTONE	0x1
+
+/* Store objects are reserved: clients cannot access them */
+#define KV_ID_PREFIX		TA_SECURE_STORAGE_RESERVED_ID "kv."
+#define KV_INDEX_ID		KV_ID_PREFIX "index"
+#define KV_INDEX_NEW_ID		KV_ID_PREFIX "index.new"
+#define KV_SEGMENT_ID_FMT	KV_ID_PREFIX "seg.%08" PRIx32
+#define KV_SEGMENT_ID_LEN	(sizeof(KV_ID_PREFIX) + 12)
+
+#define KV_MAX_KEY_SIZE		TA_SECURE_STORAGE_KV_MAX_KEY_SIZE
+#define KV_MAX_VALUE_SIZE	TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE
+
+/* Record header in segments, followed by the key then the value */
+struct kv_record {
+	uint32_t magic;
+	uint16_t key_sz;
+	uint16_t flags;
+	uint32_t val_sz;
+};
+
+struct kv_segment {
+	uint32_t id;
+	uint32_t size;		/* Bytes appended */
+	uint32_t live;		/* Bytes of the live records */
+};
+
+/* Index slot, seg_id is 0 for a free slot */
+struct kv_slot {
+	uint32_t hash;
+	uint32_t seg_id;
+	uint32_t offset;
+	uint32_t rec_sz;
+};
+
+/* Index object: header, segment list then slots */
+struct kv_index_header {
+	uint32_t magic;
+	uint32_t next_seg_id;
+	uint32_t dead_seg_id;	/* Segment compacted, to be deleted */
+	uint32_t nb_segs;
+	uint32_t nb_slots;
+	uint32_t nb_keys;
+};
+
+struct kv_store {
+	bool ready;
+	bool dirty;		/* Index changed since last checkpoint */
+	bool compacting;
+	struct kv_segment segs[KV_MAX_SEGMENTS];
+	uint32_t nb_segs;
+	uint32_t next_seg_id;
+	TEE_ObjectHandle active;	/* Active segment */
+	TEE_ObjectHandle reader;	/* Last sealed segment read */
+	uint32_t reader_id;
+	struct kv_slot *slots;
+	uint32_t nb_slots;		/* Power of 2 */
+	uint32_t nb_keys;
+	char key[KV_MAX_KEY_SIZE];
+	uint8_t rec[sizeof(struct kv_record) + KV_MAX_KEY_SIZE +
+		    KV_MAX_VALUE_SIZE];
+};
+
+static struct kv_store kv;
+
+static TEE_Result compact_segment(bool force, bool *freed);
+
+/* FNV-1a */
+static uint32_t kv_hash(const void *key, size_t key_sz)
+{
+	const uint8_t *p = key;
+	uint32_t h = 0x811c9dc5;
+
+	while (key_sz--)
+		h = (h ^ *p++) * 0x01000193;
+
+	return h;
+}
+
+static TEE_Result open_segment(uint32_t id, uint32_t flags,
+			       TEE_ObjectHandle *object)
+{
+	char obj_id[KV_SEGMENT_ID_LEN];
+
+	snprintf(obj_id, sizeof(obj_id), KV_SEGMENT_ID_FMT, id);
+
+	return TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					obj_id, strlen(obj_id),
+					flags, object);
+}
+
+static TEE_Result create_segment(uint32_t id, TEE_ObjectHandle *object)
+{
+	char obj_id[KV_SEGMENT_ID_LEN];
+
+	snprintf(obj_id, sizeof(obj_id), KV_SEGMENT_ID_FMT, id);
+
+	return TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+					  obj_id, strlen(obj_id),
+					  TEE_DATA_FLAG_ACCESS_READ |
+					  TEE_DATA_FLAG_ACCESS_WRITE |
+					  TEE_DATA_FLAG_ACCESS_WRITE_META |
+					  TEE_DATA_FLAG_OVERWRITE,
+					  TEE_HANDLE_NULL, NULL, 0, object);
+}
+
+static struct kv_segment *find_segment(uint32_t id)
+{
+	uint32_t n;
+
+	for (n = 0; n < kv.nb_segs; n++)
+		if (kv.segs[n].id == id)
+			return kv.segs + n;
+
+	return NULL;
+}
+
+static struct kv_segment *active_segment(void)
+{
+	return kv.segs + kv.nb_segs - 1;
+}
+
+static TEE_Result read_at(TEE_ObjectHandle object, uint32_t offset,
+			  void *buf, size_t sz)
+{
+	uint32_t count;
+	TEE_Result res;
+
+	res = TEE_SeekObjectData(object, offset, TEE_DATA_SEEK_SET);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_ReadObjectData(object, buf, sz, &count);
+	if (res == TEE_SUCCESS && count != sz)
+		return TEE_ERROR_CORRUPT_OBJECT;
+
+	return res;
+}
+
+/* Read from a segment, the active one or a sealed one */
+static TEE_Result read_segment(uint32_t seg_id, uint32_t offset,
+			       void *buf, size_t sz)
+{
+	TEE_Result res;
+
+	if (seg_id == active_segment()->id)
+		return read_at(kv.active, offset, buf, sz);
+
+	if (kv.reader == TEE_HANDLE_NULL || kv.reader_id != seg_id) {
+		if (kv.reader != TEE_HANDLE_NULL)
+			TEE_CloseObject(kv.reader);
+		kv.reader = TEE_HANDLE_NULL;
+
+		res = open_segment(seg_id, TEE_DATA_FLAG_ACCESS_READ |
+					   TEE_DATA_FLAG_SHARE_READ,
+				   &kv.reader);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to open segment %" PRIu32 ", res=0x%08x",
+			     seg_id, res);
+			return res;
+		}
+		kv.reader_id = seg_id;
+	}
+
+	return read_at(kv.reader, offset, buf, sz);
+}
+
+static bool record_is_valid(const struct kv_record *hdr, size_t room)
+{
+	if (hdr->magic != KV_RECORD_MAGIC || !hdr->key_sz ||
+	    hdr->key_sz > KV_MAX_KEY_SIZE || hdr->val_sz > KV_MAX_VALUE_SIZE)
+		return false;
+	if ((hdr->flags & KV_RECORD_TOMBSTONE) && hdr->val_sz)
+		return false;
+
+	return sizeof(*hdr) + hdr->key_sz + hdr->val_sz <= room;
+}
+
+/*
+ * Look @key up in the index. Return the slot of the key in @pos, or the
+ * free slot ending the probe when not found. A record found is left in
+ * kv.rec.
+ */
+static TEE_Result lookup(const void *key, size_t key_sz, uint32_t hash,
+			 uint32_t *pos, bool *found)
+{
+	struct kv_record *hdr = (struct kv_record *)kv.rec;
+	uint32_t mask = kv.nb_slots - 1;
+	struct kv_slot *slot;
+	TEE_Result res;
+	uint32_t n;
+
+	*found = false;
+	for (n = hash & mask; kv.slots[n].seg_id; n = (n + 1) & mask) {
+		slot = kv.slots + n;
+		if (slot->hash != hash)
+			continue;
+
+		res = read_segment(slot->seg_id, slot->offset, kv.rec,
+				   slot->rec_sz);
+		if (res != TEE_SUCCESS)
+			return res;
+		if (!record_is_valid(hdr, slot->rec_sz))
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		if (hdr->key_sz == key_sz &&
+		    !TEE_MemCompare(kv.rec + sizeof(*hdr), key, key_sz)) {
+			*found = true;
+			break;
+		}
+	}
+
+	*pos = n;
+	return TEE_SUCCESS;
+}
+
+/* Remove slot @n, moving back the slots of its probe sequence */
+static void remove_slot(uint32_t n)
+{
+	uint32_t mask = kv.nb_slots - 1;
+	uint32_t next = n;
+	uint32_t home;
+
+	while (true) {
+		kv.slots[n].seg_id = 0;
+		do {
+			next = (next + 1) & mask;
+			if (!kv.slots[next].seg_id)
+				return;
+			home = kv.slots[next].hash & mask;
+		} while (n <= next ? (n < home && home <= next) :
+				     (n < home || home <= next));
+
+		kv.slots[n] = kv.slots[next];
+		n = next;
+	}
+}
+
+/*
+ * The index shares the TA heap with the TA caches: on failure, have them
+ * released and retry.
+ */
+static struct kv_slot *alloc_slots(uint32_t nb_slots)
+{
+	struct kv_slot *slots = TEE_Malloc(nb_slots * sizeof(*slots), 0);
+
+	if (!slots) {
+		kv_release_memory();
+		slots = TEE_Malloc(nb_slots * sizeof(*slots), 0);
+	}
+
+	return slots;
+}
+
+/* Make room for one more key, keeping the index load under 3/4 */
+static TEE_Result reserve_slot(void)
+{
+	uint32_t nb_slots = kv.nb_slots * 2;
+	struct kv_slot *slots;
+	uint32_t mask;
+	uint32_t n;
+	uint32_t m;
+
+	if ((kv.nb_keys + 1) * 4 <= kv.nb_slots * 3)
+		return TEE_SUCCESS;
+
+	slots = alloc_slots(nb_slots);
+	if (!slots)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	mask = nb_slots - 1;
+	for (n = 0; n < kv.nb_slots; n++) {
+		if (!kv.slots[n].seg_id)
+			continue;
+
+		for (m = kv.slots[n].hash & mask; slots[m].seg_id;
+		     m = (m + 1) & mask)
+			;
+		slots[m] = kv.slots[n];
+	}
+
+	TEE_Free(kv.slots);
+	kv.slots = slots;
+	kv.nb_slots = nb_slots;
+
+	return TEE_SUCCESS;
+}
+
+/* Seal the active segment and start a new one */
+static TEE_Result roll_segment(void)
+{
+	TEE_ObjectHandle object;
+	TEE_Result res;
+
+	if (kv.nb_segs == KV_MAX_SEGMENTS)
+		return TEE_ERROR_STORAGE_NO_SPACE;
+
+	res = create_segment(kv.next_seg_id, &object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to create segment, res=0x%08x", res);
+		return res;
+	}
+
+	if (kv.active != TEE_HANDLE_NULL)
+		TEE_CloseObject(kv.active);
+	kv.active = object;
+
+	kv.segs[kv.nb_segs].id = kv.next_seg_id;
+	kv.segs[kv.nb_segs].size = 0;
+	kv.segs[kv.nb_segs].live = 0;
+	kv.nb_segs++;
+	kv.next_seg_id++;
+	kv.dirty = true;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Make sure the active segment can hold @rec_sz more bytes. Sealing a
+ * segment is the time to compact the segment with the most dead records,
+ * always done when the segment list is about to be full.
+ */
+static TEE_Result reserve_room(size_t rec_sz)
+{
+	TEE_Result res;
+	bool freed;
+
+	if (active_segment()->size + rec_sz <= KV_SEGMENT_SIZE)
+		return TEE_SUCCESS;
+
+	if (!kv.compacting) {
+		res = compact_segment(kv.nb_segs >= KV_MAX_SEGMENTS - 1,
+				      &freed);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		if (active_segment()->size + rec_sz <= KV_SEGMENT_SIZE)
+			return TEE_SUCCESS;
+	}
+
+	return roll_segment();
+}
+
+/* Append the record staged in kv.rec to the active segment */
+static TEE_Result append_record(size_t rec_sz, uint32_t *seg_id,
+				uint32_t *offset)
+{
+	struct kv_segment *seg = active_segment();
+	TEE_Result res;
+
+	res = TEE_SeekObjectData(kv.active, seg->size, TEE_DATA_SEEK_SET);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_WriteObjectData(kv.active, kv.rec, rec_sz);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_WriteObjectData failed 0x%08x", res);
+		return res;
+	}
+
+	*seg_id = seg->id;
+	*offset = seg->size;
+	seg->size += rec_sz;
+	kv.dirty = true;
+
+	return TEE_SUCCESS;
+}
+
+static void drop_record(const struct kv_slot *slot)
+{
+	struct kv_segment *seg = find_segment(slot->seg_id);
+
+	if (seg)
+		seg->live -= slot->rec_sz;
+}
+
+/* Update the index with the record at @offset of segment @seg_id */
+static TEE_Result apply_record(const struct kv_record *hdr, const char *key,
+			       uint32_t seg_id, uint32_t offset)
+{
+	uint32_t rec_sz = sizeof(*hdr) + hdr->key_sz + hdr->val_sz;
+	uint32_t hash = kv_hash(key, hdr->key_sz);
+	struct kv_slot *slot;
+	TEE_Result res;
+	bool found;
+	uint32_t n;
+
+	res = reserve_slot();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = lookup(key, hdr->key_sz, hash, &n, &found);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	slot = kv.slots + n;
+	if (found)
+		drop_record(slot);
+
+	if (hdr->flags & KV_RECORD_TOMBSTONE) {
+		if (found) {
+			remove_slot(n);
+			kv.nb_keys--;
+		}
+		return TEE_SUCCESS;
+	}
+
+	if (!found)
+		kv.nb_keys++;
+
+	slot->hash = hash;
+	slot->seg_id = seg_id;
+	slot->offset = offset;
+	slot->rec_sz = rec_sz;
+	find_segment(seg_id)->live += rec_sz;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Replay the records of the active segment from @offset. A record cut by
+ * a failure while appending it ends the segment.
+ */
+static TEE_Result replay_segment(uint32_t offset)
+{
+	struct kv_segment *seg = active_segment();
+	struct kv_record hdr;
+	TEE_ObjectInfo info;
+	TEE_Result res;
+
+	res = TEE_GetObjectInfo1(kv.active, &info);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	while (info.dataSize - offset >= sizeof(hdr)) {
+		res = read_at(kv.active, offset, &hdr, sizeof(hdr));
+		if (res != TEE_SUCCESS)
+			return res;
+		if (!record_is_valid(&hdr, info.dataSize - offset))
+			break;
+
+		res = read_at(kv.active, offset + sizeof(hdr), kv.key,
+			      hdr.key_sz);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		res = apply_record(&hdr, kv.key, seg->id, offset);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		offset += sizeof(hdr) + hdr.key_sz + hdr.val_sz;
+	}
+
+	seg->size = offset;
+	if (offset != info.dataSize) {
+		EMSG("Segment %" PRIu32 " truncated to %" PRIu32 " bytes",
+		     seg->id, offset);
+		kv.dirty = true;
+		return TEE_TruncateObjectData(kv.active, offset);
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Load the last checkpoint, if any. A checkpoint is renamed to KV_INDEX_ID
+ * once complete: a KV_INDEX_NEW_ID object alone is either complete, the
+ * rename only missing, or the first checkpoint ever written was cut. In
+ * the latter case all segments are still there to replay.
+ */
+static TEE_Result load_index(void)
+{
+	struct kv_index_header hdr;
+	TEE_ObjectHandle object;
+	TEE_ObjectInfo info;
+	TEE_ObjectHandle dead;
+	bool pending = false;
+	TEE_Result res;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+				       KV_INDEX_ID, strlen(KV_INDEX_ID),
+				       TEE_DATA_FLAG_ACCESS_READ, &object);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		pending = true;
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					       KV_INDEX_NEW_ID,
+					       strlen(KV_INDEX_NEW_ID),
+					       TEE_DATA_FLAG_ACCESS_READ |
+					       TEE_DATA_FLAG_ACCESS_WRITE_META,
+					       &object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			return TEE_SUCCESS;
+	}
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_GetObjectInfo1(object, &info);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	if (info.dataSize < sizeof(hdr)) {
+		res = TEE_ERROR_CORRUPT_OBJECT;
+		goto out;
+	}
+
+	res = read_at(object, 0, &hdr, sizeof(hdr));
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	if (hdr.magic != KV_INDEX_MAGIC || !hdr.nb_segs ||
+	    hdr.nb_segs > KV_MAX_SEGMENTS || hdr.nb_slots < KV_MIN_SLOTS ||
+	    hdr.nb_slots & (hdr.nb_slots - 1) ||
+	    hdr.nb_slots > TEE_DATA_MAX_POSITION / sizeof(struct kv_slot) ||
+	    info.dataSize != sizeof(hdr) +
+			     hdr.nb_segs * sizeof(struct kv_segment) +
+			     hdr.nb_slots * sizeof(struct kv_slot)) {
+		res = TEE_ERROR_CORRUPT_OBJECT;
+		goto out;
+	}
+
+	kv.slots = alloc_slots(hdr.nb_slots);
+	if (!kv.slots) {
+		res = TEE_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	res = read_at(object, sizeof(hdr), kv.segs,
+		      hdr.nb_segs * sizeof(struct kv_segment));
+	if (res == TEE_SUCCESS)
+		res = read_at(object,
+			      sizeof(hdr) +
+			      hdr.nb_segs * sizeof(struct kv_segment),
+			      kv.slots, hdr.nb_slots * sizeof(struct kv_slot));
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	if (pending) {
+		res = TEE_RenamePersistentObject(object, KV_INDEX_ID,
+						 strlen(KV_INDEX_ID));
+		if (res != TEE_SUCCESS)
+			goto out;
+	}
+
+	kv.nb_segs = hdr.nb_segs;
+	kv.nb_slots = hdr.nb_slots;
+	kv.nb_keys = hdr.nb_keys;
+	kv.next_seg_id = hdr.next_seg_id;
+
+	/* Complete the compaction of the checkpoint */
+	if (hdr.dead_seg_id &&
+	    open_segment(hdr.dead_seg_id, TEE_DATA_FLAG_ACCESS_WRITE_META,
+			 &dead) == TEE_SUCCESS)
+		TEE_CloseAndDeletePersistentObject1(dead);
+out:
+	if (res == TEE_ERROR_CORRUPT_OBJECT && pending) {
+		/* First checkpoint cut: replay all segments */
+		TEE_CloseAndDeletePersistentObject1(object);
+		TEE_Free(kv.slots);
+		kv.slots = NULL;
+		return TEE_SUCCESS;
+	}
+
+	TEE_CloseObject(object);
+	return res;
+}
+
+static TEE_Result save_index(uint32_t dead_seg_id)
+{
+	struct kv_index_header hdr = {
+		.magic = KV_INDEX_MAGIC,
+		.next_seg_id = kv.next_seg_id,
+		.dead_seg_id = dead_seg_id,
+		.nb_segs = kv.nb_segs,
+		.nb_slots = kv.nb_slots,
+		.nb_keys = kv.nb_keys,
+	};
+	TEE_ObjectHandle object;
+	TEE_ObjectHandle old;
+	TEE_Result res;
+
+	/*
+	 * Write the new checkpoint aside then rename it over the previous
+	 * one so that a failure leaves one complete checkpoint.
+	 */
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+					 KV_INDEX_NEW_ID,
+					 strlen(KV_INDEX_NEW_ID),
+					 TEE_DATA_FLAG_ACCESS_WRITE |
+					 TEE_DATA_FLAG_ACCESS_WRITE_META |
+					 TEE_DATA_FLAG_OVERWRITE,
+					 TEE_HANDLE_NULL, NULL, 0, &object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to create index, res=0x%08x", res);
+		return res;
+	}
+
+	res = TEE_WriteObjectData(object, &hdr, sizeof(hdr));
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(object, kv.segs,
+					  kv.nb_segs * sizeof(*kv.segs));
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(object, kv.slots,
+					  kv.nb_slots * sizeof(*kv.slots));
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to write index, res=0x%08x", res);
+		TEE_CloseAndDeletePersistentObject1(object);
+		return res;
+	}
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+				       KV_INDEX_ID, strlen(KV_INDEX_ID),
+				       TEE_DATA_FLAG_ACCESS_WRITE_META, &old);
+	if (res == TEE_SUCCESS)
+		TEE_CloseAndDeletePersistentObject1(old);
+	else if (res != TEE_ERROR_ITEM_NOT_FOUND)
+		goto out;
+
+	res = TEE_RenamePersistentObject(object, KV_INDEX_ID,
+					 strlen(KV_INDEX_ID));
+	if (res == TEE_SUCCESS)
+		kv.dirty = false;
+out:
+	if (res != TEE_SUCCESS)
+		EMSG("Failed to commit index, res=0x%08x", res);
+	TEE_CloseObject(object);
+	return res;
+}
+
+static void release_store(void)
+{
+	if (kv.active != TEE_HANDLE_NULL)
+		TEE_CloseObject(kv.active);
+	if (kv.reader != TEE_HANDLE_NULL)
+		TEE_CloseObject(kv.reader);
+	TEE_Free(kv.slots);
+
+	TEE_MemFill(&kv, 0, sizeof(kv));
+	kv.active = TEE_HANDLE_NULL;
+	kv.reader = TEE_HANDLE_NULL;
+}
+
+/*
+ * Load the checkpoint then replay the records appended to the segment
+ * active at checkpoint time and to the segments created since then.
+ */
+static TEE_Result open_store(void)
+{
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	uint32_t id;
+
+	if (kv.ready)
+		return TEE_SUCCESS;
+
+	release_store();
+	kv.next_seg_id = 1;
+
+	res = load_index();
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to load index, res=0x%08x", res);
+		goto err;
+	}
+
+	if (!kv.slots) {
+		kv.slots = alloc_slots(KV_MIN_SLOTS);
+		if (!kv.slots) {
+			res = TEE_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+		kv.nb_slots = KV_MIN_SLOTS;
+	}
+
+	if (kv.nb_segs) {
+		res = open_segment(active_segment()->id,
+				   TEE_DATA_FLAG_ACCESS_READ |
+				   TEE_DATA_FLAG_ACCESS_WRITE |
+				   TEE_DATA_FLAG_ACCESS_WRITE_META,
+				   &kv.active);
+		if (res == TEE_SUCCESS)
+			res = replay_segment(active_segment()->size);
+		if (res != TEE_SUCCESS)
+			goto err;
+	}
+
+	for (id = kv.next_seg_id; ; id++) {
+		res = open_segment(id, TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_ACCESS_WRITE |
+				       TEE_DATA_FLAG_ACCESS_WRITE_META,
+				   &object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			break;
+		if (res != TEE_SUCCESS || kv.nb_segs == KV_MAX_SEGMENTS) {
+			if (res == TEE_SUCCESS) {
+				TEE_CloseObject(object);
+				res = TEE_ERROR_CORRUPT_OBJECT;
+			}
+			goto err;
+		}
+
+		if (kv.active != TEE_HANDLE_NULL)
+			TEE_CloseObject(kv.active);
+		kv.active = object;
+		kv.segs[kv.nb_segs].id = id;
+		kv.segs[kv.nb_segs].size = 0;
+		kv.segs[kv.nb_segs].live = 0;
+		kv.nb_segs++;
+		kv.next_seg_id = id + 1;
+		kv.dirty = true;
+
+		res = replay_segment(0);
+		if (res != TEE_SUCCESS)
+			goto err;
+	}
+
+	if (!kv.nb_segs) {
+		res = roll_segment();
+		if (res != TEE_SUCCESS)
+			goto err;
+	}
+
+	kv.ready = true;
+	return TEE_SUCCESS;
+err:
+	release_store();
+	return res;
+}
+
+/*
+ * Copy the live records of the sealed segment with the most dead bytes to
+ * the active segment, then delete it. Unless @force, the segment shall be
+ * at least half dead.
+ */
+static TEE_Result compact_segment(bool force, bool *freed)
+{
+	struct kv_record *hdr = (struct kv_record *)kv.rec;
+	struct kv_segment *victim = NULL;
+	struct kv_slot *slot;
+	TEE_ObjectHandle object;
+	uint32_t victim_id;
+	uint32_t offset;
+	uint32_t rec_sz;
+	uint32_t seg_id;
+	uint32_t n;
+	TEE_Result res;
+	bool found;
+
+	*freed = false;
+
+	for (n = 0; n + 1 < kv.nb_segs; n++)
+		if (kv.segs[n].live < kv.segs[n].size &&
+		    (!victim || kv.segs[n].live < victim->live))
+			victim = kv.segs + n;
+
+	if (!victim || (!force && victim->live > victim->size / 2))
+		return TEE_SUCCESS;
+
+	victim_id = victim->id;
+	kv.compacting = true;
+
+	for (offset = 0; offset < victim->size; offset += rec_sz) {
+		res = read_segment(victim_id, offset, hdr, sizeof(*hdr));
+		if (res != TEE_SUCCESS)
+			goto out;
+		if (!record_is_valid(hdr, victim->size - offset)) {
+			res = TEE_ERROR_CORRUPT_OBJECT;
+			goto out;
+		}
+
+		rec_sz = sizeof(*hdr) + hdr->key_sz + hdr->val_sz;
+		if (hdr->flags & KV_RECORD_TOMBSTONE)
+			continue;
+
+		res = read_segment(victim_id, offset + sizeof(*hdr), kv.key,
+				   hdr->key_sz);
+		if (res != TEE_SUCCESS)
+			goto out;
+
+		res = lookup(kv.key, hdr->key_sz, kv_hash(kv.key, hdr->key_sz),
+			     &n, &found);
+		if (res != TEE_SUCCESS)
+			goto out;
+
+		slot = kv.slots + n;
+		if (!found || slot->seg_id != victim_id ||
+		    slot->offset != offset)
+			continue;
+
+		/* Live record, left in kv.rec by lookup() */
+		res = reserve_room(rec_sz);
+		if (res != TEE_SUCCESS)
+			goto out;
+
+		res = append_record(rec_sz, &seg_id, &slot->offset);
+		if (res != TEE_SUCCESS)
+			goto out;
+
+		slot->seg_id = seg_id;
+		active_segment()->live += rec_sz;
+		victim = find_segment(victim_id);
+		victim->live -= rec_sz;
+	}
+
+	if (kv.reader != TEE_HANDLE_NULL && kv.reader_id == victim_id) {
+		TEE_CloseObject(kv.reader);
+		kv.reader = TEE_HANDLE_NULL;
+	}
+
+	n = victim - kv.segs;
+	TEE_MemMove(victim, victim + 1,
+		    (kv.nb_segs - n - 1) * sizeof(*victim));
+	kv.nb_segs--;
+
+	/* The segment is deleted once the index no longer refers to it */
+	res = save_index(victim_id);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	if (open_segment(victim_id, TEE_DATA_FLAG_ACCESS_WRITE_META,
+			 &object) == TEE_SUCCESS)
+		TEE_CloseAndDeletePersistentObject1(object);
+
+	*freed = true;
+out:
+	kv.compacting = false;
+	return res;
+}
+
+TEE_Result kv_put(const void *key, size_t key_sz,
+		  const void *val, size_t val_sz)
+{
+	struct kv_record *hdr = (struct kv_record *)kv.rec;
+	size_t rec_sz = sizeof(*hdr) + key_sz + val_sz;
+	struct kv_slot *slot;
+	uint32_t hash;
+	uint32_t n;
+	TEE_Result res;
+	bool found;
+
+	if (!key_sz || key_sz > KV_MAX_KEY_SIZE || val_sz > KV_MAX_VALUE_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = open_store();
+	if (res == TEE_SUCCESS)
+		res = reserve_room(rec_sz);
+	if (res == TEE_SUCCESS)
+		res = reserve_slot();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	hash = kv_hash(key, key_sz);
+	res = lookup(key, key_sz, hash, &n, &found);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	hdr->magic = KV_RECORD_MAGIC;
+	hdr->key_sz = key_sz;
+	hdr->flags = 0;
+	hdr->val_sz = val_sz;
+	TEE_MemMove(kv.rec + sizeof(*hdr), key, key_sz);
+	TEE_MemMove(kv.rec + sizeof(*hdr) + key_sz, val, val_sz);
+
+	slot = kv.slots + n;
+	if (found)
+		drop_record(slot);
+
+	res = append_record(rec_sz, &slot->seg_id, &slot->offset);
+	if (res != TEE_SUCCESS) {
+		if (found)
+			find_segment(slot->seg_id)->live += slot->rec_sz;
+		return res;
+	}
+
+	if (!found)
+		kv.nb_keys++;
+	slot->hash = hash;
+	slot->rec_sz = rec_sz;
+	active_segment()->live += rec_sz;
+
+	return TEE_SUCCESS;
+}
+
+TEE_Result kv_get(const void *key, size_t key_sz, void *val, size_t *val_sz)
+{
+	struct kv_record *hdr = (struct kv_record *)kv.rec;
+	TEE_Result res;
+	bool found;
+	uint32_t n;
+
+	if (!key_sz || key_sz > KV_MAX_KEY_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = open_store();
+	if (res == TEE_SUCCESS)
+		res = lookup(key, key_sz, kv_hash(key, key_sz), &n, &found);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (!found)
+		return TEE_ERROR_ITEM_NOT_FOUND;
+
+	if (hdr->val_sz > *val_sz) {
+		*val_sz = hdr->val_sz;
+		return TEE_ERROR_SHORT_BUFFER;
+	}
+
+	TEE_MemMove(val, kv.rec + sizeof(*hdr) + key_sz, hdr->val_sz);
+	*val_sz = hdr->val_sz;
+
+	return TEE_SUCCESS;
+}
+
+TEE_Result kv_delete(const void *key, size_t key_sz)
+{
+	struct kv_record *hdr = (struct kv_record *)kv.rec;
+	size_t rec_sz = sizeof(*hdr) + key_sz;
+	uint32_t seg_id;
+	uint32_t offset;
+	TEE_Result res;
+	bool found;
+	uint32_t n;
+
+	if (!key_sz || key_sz > KV_MAX_KEY_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = open_store();
+	if (res == TEE_SUCCESS)
+		res = reserve_room(rec_sz);
+	if (res == TEE_SUCCESS)
+		res = lookup(key, key_sz, kv_hash(key, key_sz), &n, &found);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (!found)
+		return TEE_ERROR_ITEM_NOT_FOUND;
+
+	/* Tombstone, needed until the next checkpoint */
+	hdr->magic = KV_RECORD_MAGIC;
+	hdr->key_sz = key_sz;
+	hdr->flags = KV_RECORD_TOMBSTONE;
+	hdr->val_sz = 0;
+	TEE_MemMove(kv.rec + sizeof(*hdr), key, key_sz);
+
+	res = append_record(rec_sz, &seg_id, &offset);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	drop_record(kv.slots + n);
+	remove_slot(n);
+	kv.nb_keys--;
+
+	return TEE_SUCCESS;
+}
+
+TEE_Result kv_compact(uint32_t *freed)
+{
+	TEE_Result res;
+	uint32_t n;
+	bool done;
+
+	*freed = 0;
+
+	res = open_store();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Segments written by compaction are all live: this terminates */
+	for (n = 0; n < KV_MAX_SEGMENTS; n++) {
+		res = compact_segment(true, &done);
+		if (res != TEE_SUCCESS || !done)
+			break;
+		(*freed)++;
+	}
+
+	return res;
+}
+
+void kv_close(void)
+{
+	if (!kv.ready)
+		return;
+
+	if (kv.dirty)
+		save_index(0);
+
+	release_store();
+}
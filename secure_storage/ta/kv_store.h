@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tee_internal_api.h>
+
+/*
+ * Log-structured key-value store of the secure_storage TA. Records are
+ * appended to segment objects, an index object checkpoints the location
+ * of the live records. Keys and values shall lie in TA memory.
+ *
+ * The store is opened on first use and kv_close() checkpoints the index
+ * and releases the store resources.
+ *
+ * The store suits thousands of small records, not millions: its limits are
+ * - keys: the whole index lives in the TA heap, 16 bytes per slot at most
+ *   3/4 full, and growing it holds the old and new slots at once. With the
+ *   64 KiB TA_DATA_SIZE the index stops at 2048 slots, that is 1536 keys,
+ *   fewer while sessions hold their buffers. kv_put() then returns
+ *   TEE_ERROR_OUT_OF_MEMORY.
+ * - data: 32 segments of 64 KiB, 2 MiB holding the records, 12 bytes of
+ *   header each plus key and value, and the dead records not compacted
+ *   yet. kv_put() returns TEE_ERROR_STORAGE_NO_SPACE when full.
+ */
+TEE_Result kv_put(const void *key, size_t key_sz,
+		  const void *val, size_t val_sz);
+
+/*
+ * Get the value of @key into @val of @val_sz bytes. @val_sz is updated with
+ * the value size, also on TEE_ERROR_SHORT_BUFFER.
+ */
+TEE_Result kv_get(const void *key, size_t key_sz, void *val, size_t *val_sz);
+
+TEE_Result kv_delete(const void *key, size_t key_sz);
+
+/* Compact all segments holding dead records, @freed segments reclaimed */
+TEE_Result kv_compact(uint32_t *freed);
+
+void kv_close(void);
+
+/*
+ * Provided by the TA: release the memory it can do without, called before
+ * the store retries an allocation which failed.
+ */
+void kv_release_memory(void);
+
+#endif /* KV_STORE_H */
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2017, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <tee_internal_api.h>
+
+#include "lz.h"
+
+/*
+ * A sequence is a token, the literal length extension, the literals, the
+ * match offset then the match length extension. The token holds the
+ * literal length in its high nibble and the match length minus
+ * LZ_MIN_MATCH in its low nibble, 15 meaning extension bytes follow. The
+ * last sequence holds only literals.
+ */
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+/* Last match starts before the last LZ_MF_LIMIT bytes of the block */
+#define LZ_MF_LIMIT		12
+/* Last LZ_LAST_LITERALS bytes of the block are literals */
+#define LZ_LAST_LITERALS	5
+
+static uint32_t read32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Room needed by a length of @len with a nibble in the token */
+static size_t length_size(size_t len)
+{
+	return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+	if (len < 15)
+		return op;
+
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend,
+			     const uint8_t *lit, size_t lit_sz,
+			     size_t offset, size_t match_sz)
+{
+	size_t mlen = match_sz - LZ_MIN_MATCH;
+	size_t sz;
+
+	sz = 1 + length_size(lit_sz) + lit_sz;
+	if (match_sz)
+		sz += 2 + length_size(mlen);
+	if (sz > (size_t)(oend - op))
+		return NULL;
+
+	*op++ = (lit_sz < 15 ? lit_sz : 15) << 4 |
+		(match_sz ? (mlen < 15 ? mlen : 15) : 0);
+	op = put_length(op, lit_sz);
+	memcpy(op, lit, lit_sz);
+	op += lit_sz;
+
+	if (match_sz) {
+		*op++ = offset;
+		*op++ = offset >> 8;
+		op = put_length(op, mlen);
+	}
+
+	return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t src_sz, uint8_t *dst,
+		   size_t dst_sz, uint16_t *table)
+{
+	uint8_t *oend = dst + dst_sz;
+	uint8_t *op = dst;
+	size_t anchor = 0;
+	size_t ip = 1;
+	size_t match;
+	size_t mlen;
+	uint32_t h;
+
+	memset(table, 0, LZ_TABLE_SIZE * sizeof(*table));
+
+	while (src_sz > LZ_MF_LIMIT && ip < src_sz - LZ_MF_LIMIT) {
+		h = lz_hash(read32(src + ip));
+		match = table[h];
+		table[h] = ip;
+
+		if (match >= ip || ip - match > LZ_MAX_OFFSET ||
+		    read32(src + match) != read32(src + ip)) {
+			ip++;
+			continue;
+		}
+
+		while (ip > anchor && match && src[ip - 1] == src[match - 1]) {
+			ip--;
+			match--;
+		}
+
+		for (mlen = LZ_MIN_MATCH;
+		     ip + mlen < src_sz - LZ_LAST_LITERALS &&
+		     src[ip + mlen] == src[match + mlen]; mlen++)
+			;
+
+		op = put_sequence(op, oend, src + anchor, ip - anchor,
+				  ip - match, mlen);
+		if (!op)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+
+		if (ip < src_sz - LZ_MF_LIMIT)
+			table[lz_hash(read32(src + ip - 2))] = ip - 2;
+	}
+
+	op = put_sequence(op, oend, src + anchor, src_sz - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - dst;
+}
+
+static TEE_Result get_length(const uint8_t **ip, const uint8_t *iend,
+			     size_t *len)
+{
+	uint8_t b;
+
+	if (*len < 15)
+		return TEE_SUCCESS;
+
+	do {
+		if (*ip == iend)
+			return TEE_ERROR_CORRUPT_OBJECT;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return TEE_SUCCESS;
+}
+
+TEE_Result lz_decompress(const uint8_t *src, size_t src_sz, uint8_t *dst,
+			 size_t dst_sz)
+{
+	const uint8_t *iend = src + src_sz;
+	const uint8_t *ip = src;
+	uint8_t *oend = dst + dst_sz;
+	uint8_t *op = dst;
+	size_t offset;
+	size_t len;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (get_length(&ip, iend, &len) != TEE_SUCCESS ||
+		    len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* Last sequence */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return TEE_ERROR_CORRUPT_OBJECT;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > (size_t)(op - dst))
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		len = token & 15;
+		if (get_length(&ip, iend, &len) != TEE_SUCCESS)
+			return TEE_ERROR_CORRUPT_OBJECT;
+		len += LZ_MIN_MATCH;
+		if (len > (size_t)(oend - op))
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		/* Match may overlap the bytes it produces */
+		for (; len; len--, op++)
+			*op = *(op - offset);
+	}
+
+	if (op != oend)
+		return TEE_ERROR_CORRUPT_OBJECT;
+
+	return TEE_SUCCESS;
+}
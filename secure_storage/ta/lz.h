@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2017, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tee_internal_api.h>
+
+/*
+ * Fast LZ77 codec producing the LZ4 block format, for blocks up to 64 KiB.
+ * The compressor uses a caller provided hash table of LZ_TABLE_SIZE
+ * entries.
+ */
+#define LZ_HASH_BITS		10
+#define LZ_TABLE_SIZE		(1 << LZ_HASH_BITS)
+
+/*
+ * Compress @src_sz bytes of @src into @dst. Return the compressed size, or
+ * 0 if it does not fit in @dst_sz bytes.
+ */
+size_t lz_compress(const uint8_t *src, size_t src_sz, uint8_t *dst,
+		   size_t dst_sz, uint16_t *table);
+
+/* Decompress @src into exactly @dst_sz bytes of @dst */
+TEE_Result lz_decompress(const uint8_t *src, size_t src_sz, uint8_t *dst,
+			 size_t dst_sz);
+
+#endif /* LZ_H */
@@ -30,17 +30,1953 @@
 #include <tee_internal_api.h>
 #include <tee_internal_api_extensions.h>
 
-static TEE_Result delete_object(uint32_t param_types, TEE_Param params[4])
+#include "kv_store.h"
+#include "lz.h"
+
+/*
+ * The storage API does not accept client shared memory: object ID and
+ * data shall lie in TA memory. Data moves between the client memref and
+ * the object through a fixed size chunk buffer so that the TA heap usage
+ * does not depend on the object size.
+ */
+#define STORAGE_CHUNK_SIZE	4096
+
+/*
+ * Write-back cache bounds: objects larger than WB_MAX_OBJECT_SIZE are
+ * always written through.
+ */
+#define WB_MAX_OBJECTS		8
+#define WB_MAX_OBJECT_SIZE	1024
+#define WB_MAX_SIZE		(4 * 1024)
+
+/*
+ * Read cache bounds: objects larger than RC_MAX_OBJECT_SIZE are always
+ * read from the secure storage.
+ */
+#define RC_MAX_OBJECTS		16
+#define RC_MAX_OBJECT_SIZE	4096
+#define RC_MAX_SIZE		(16 * 1024)
+
+/*
+ * Each object created for a client starts with a struct object_header
+ * telling how its content is stored: as is, or in blocks of at most
+ * STORAGE_CHUNK_SIZE bytes of data, each one compressed independently so
+ * that the TA heap usage does not depend on the object size.
+ */
+#define OBJECT_MAGIC		0x314f5353	/* "SSO1" */
+#define OBJECT_CODEC_NONE	0
+#define OBJECT_CODEC_LZ4	1
+
+struct object_header {
+	uint32_t magic;
+	uint32_t codec;
+	uint32_t data_sz;	/* Size of the original data, if compressed */
+};
+
+/* Header of a block, stored as is when stored_sz equals data_sz */
+struct compress_block {
+	uint16_t data_sz;
+	uint16_t stored_sz;
+};
+
+#define RESERVED_ID_LEN		(sizeof(TA_SECURE_STORAGE_RESERVED_ID) - 1)
+
+/* Prefix of the temporary object holding the data of an open stream */
+#define STREAM_ID_PREFIX	TA_SECURE_STORAGE_RESERVED_ID "part/"
+#define STREAM_ID_PREFIX_LEN	(sizeof(STREAM_ID_PREFIX) - 1)
+
+/* Prefix of the previous content of an object while a stream replaces it */
+#define BACKUP_ID_PREFIX	TA_SECURE_STORAGE_RESERVED_ID "bak/"
+#define BACKUP_ID_PREFIX_LEN	(sizeof(BACKUP_ID_PREFIX) - 1)
+
+/* Prefix of the temporary objects holding the data of a transaction */
+#define TX_ID_PREFIX		TA_SECURE_STORAGE_RESERVED_ID "tx/"
+#define TX_ID_PREFIX_LEN	(sizeof(TX_ID_PREFIX) - 1)
+
+/*
+ * Journal of the transaction being committed, listing its objects: it
+ * exists from the commit point until all the objects are published.
+ */
+#define TX_JOURNAL_ID		TA_SECURE_STORAGE_RESERVED_ID "tx.journal"
+
+/* Object written in write-back mode, not in the secure storage yet */
+struct wb_object {
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	size_t id_sz;
+	void *data;
+	size_t data_sz;
+	bool compress;
+};
+
+/* Object content kept in the read cache */
+struct rc_object {
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	size_t id_sz;
+	void *data;
+	size_t data_sz;
+};
+
+/*
+ * Read cache, least recently used object first. The TA instance is kept
+ * alive: the cache serves the successive sessions.
+ */
+static struct rc_object rc[RC_MAX_OBJECTS];
+static size_t rc_count;
+static size_t rc_size;
+static uint32_t rc_hits;
+static uint32_t rc_misses;
+
+/* Object written in the open transaction, also the journal entry */
+struct tx_object {
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t id_sz;
+};
+
+/*
+ * Open transaction. A single one is open in the TA instance: sessions
+ * share the journal.
+ */
+static struct storage_session *tx_owner;
+static struct tx_object tx[TA_SECURE_STORAGE_TX_MAX_OBJECTS];
+static size_t tx_count;
+/* Journal left by a commit that failed to publish its objects */
+static bool tx_pending;
+
+struct storage_session {
+	char chunk[STORAGE_CHUNK_SIZE];
+	/* Compressed block and compressor state */
+	uint8_t lz_block[sizeof(struct compress_block) + STORAGE_CHUNK_SIZE];
+	uint16_t lz_table[LZ_TABLE_SIZE];
+	/* Write-back cache, least recently written object first */
+	bool write_back;
+	struct wb_object wb[WB_MAX_OBJECTS];
+	size_t wb_count;
+	size_t wb_size;
+	/* Stream opened by TA_SECURE_STORAGE_CMD_STREAM_OPEN */
+	TEE_ObjectHandle stream;
+	char stream_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t stream_id_sz;
+	/* Cursor of TA_SECURE_STORAGE_CMD_LIST */
+	TEE_ObjectEnumHandle list_enum;
+	uint32_t list_pos;		/* Objects returned so far */
+	bool list_pending;		/* Object fetched, not returned yet */
+	char list_id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t list_id_sz;
+	uint32_t list_data_sz;
+};
+
+/* Write @data_sz bytes from @data at @object data position */
+static TEE_Result write_chunks(struct storage_session *sess,
+			       TEE_ObjectHandle object,
+			       const char *data, size_t data_sz)
+{
+	TEE_Result res;
+	size_t sz;
+
+	while (data_sz) {
+		sz = data_sz;
+		if (sz > sizeof(sess->chunk))
+			sz = sizeof(sess->chunk);
+		TEE_MemMove(sess->chunk, data, sz);
+
+		res = TEE_WriteObjectData(object, sess->chunk, sz);
+		if (res != TEE_SUCCESS) {
+			EMSG("TEE_WriteObjectData failed 0x%08x", res);
+			return res;
+		}
+
+		data += sz;
+		data_sz -= sz;
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Read up to @data_sz bytes from @object data position into client memory
+ * @data. @read_sz is set to the bytes read, less than @data_sz at end of
+ * object.
+ */
+static TEE_Result read_chunks(struct storage_session *sess,
+			      TEE_ObjectHandle object,
+			      char *data, size_t data_sz, size_t *read_sz)
+{
+	uint32_t read_bytes;
+	TEE_Result res;
+	size_t sz;
+
+	*read_sz = 0;
+	while (data_sz) {
+		sz = data_sz;
+		if (sz > sizeof(sess->chunk))
+			sz = sizeof(sess->chunk);
+
+		res = TEE_ReadObjectData(object, sess->chunk, sz, &read_bytes);
+		if (res != TEE_SUCCESS) {
+			EMSG("TEE_ReadObjectData failed 0x%08x", res);
+			return res;
+		}
+
+		TEE_MemMove(data, sess->chunk, read_bytes);
+		*read_sz += read_bytes;
+		if (read_bytes < sz)
+			break;
+
+		data += sz;
+		data_sz -= sz;
+	}
+
+	return TEE_SUCCESS;
+}
+
+static struct rc_object *rc_find(const char *obj_id, size_t obj_id_sz)
+{
+	size_t n;
+
+	for (n = 0; n < rc_count; n++)
+		if (rc[n].id_sz == obj_id_sz &&
+		    !TEE_MemCompare(rc[n].id, obj_id, obj_id_sz))
+			return rc + n;
+
+	return NULL;
+}
+
+static void rc_remove(struct rc_object *obj)
+{
+	size_t n = obj - rc;
+
+	rc_size -= obj->data_sz;
+	TEE_Free(obj->data);
+
+	TEE_MemMove(obj, obj + 1, (rc_count - n - 1) * sizeof(*obj));
+	rc_count--;
+}
+
+/* Invalidate object @obj_id, on write or delete */
+static void rc_drop_id(const char *obj_id, size_t obj_id_sz)
+{
+	struct rc_object *obj = rc_find(obj_id, obj_id_sz);
+
+	if (obj)
+		rc_remove(obj);
+}
+
+static void rc_release(void)
+{
+	while (rc_count)
+		rc_remove(rc);
+}
+
+void kv_release_memory(void)
+{
+	rc_release();
+}
+
+/* Move @obj to the most recently used end, return its new location */
+static struct rc_object *rc_touch(struct rc_object *obj)
+{
+	struct rc_object tmp = *obj;
+	size_t n = obj - rc;
+
+	TEE_MemMove(obj, obj + 1, (rc_count - n - 1) * sizeof(*obj));
+	rc[rc_count - 1] = tmp;
+
+	return rc + rc_count - 1;
+}
+
+/*
+ * Add a @data_sz bytes entry for object @obj_id in the read cache, to be
+ * filled by the caller. Return TEE_ERROR_OUT_OF_MEMORY if it does not fit.
+ */
+static TEE_Result rc_alloc(const char *obj_id, size_t obj_id_sz,
+			   size_t data_sz, struct rc_object **obj)
+{
+	void *buf;
+
+	while (rc_count == RC_MAX_OBJECTS || rc_size + data_sz > RC_MAX_SIZE)
+		rc_remove(rc);
+
+	buf = TEE_Malloc(data_sz ? data_sz : 1, 0);
+	if (!buf) {
+		/* Memory pressure: release the cache and retry */
+		rc_release();
+		buf = TEE_Malloc(data_sz ? data_sz : 1, 0);
+		if (!buf)
+			return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	*obj = rc + rc_count;
+	TEE_MemMove((*obj)->id, obj_id, obj_id_sz);
+	(*obj)->id_sz = obj_id_sz;
+	(*obj)->data = buf;
+	(*obj)->data_sz = data_sz;
+	rc_count++;
+	rc_size += data_sz;
+
+	return TEE_SUCCESS;
+}
+
+/* Write the header of @object just created, for content of @data_sz bytes */
+static TEE_Result write_header(TEE_ObjectHandle object, bool compress,
+			       size_t data_sz)
+{
+	struct object_header hdr = {
+		.magic = OBJECT_MAGIC,
+		.codec = compress ? OBJECT_CODEC_LZ4 : OBJECT_CODEC_NONE,
+		.data_sz = compress ? data_sz : 0,
+	};
+	TEE_Result res;
+
+	res = TEE_WriteObjectData(object, &hdr, sizeof(hdr));
+	if (res != TEE_SUCCESS)
+		EMSG("TEE_WriteObjectData failed 0x%08x", res);
+
+	return res;
+}
+
+/* Write @data_sz bytes from @data at @object data position, compressed */
+static TEE_Result write_compressed(struct storage_session *sess,
+				   TEE_ObjectHandle object,
+				   const char *data, size_t data_sz)
+{
+	uint8_t *payload = sess->lz_block + sizeof(struct compress_block);
+	struct compress_block blk;
+	TEE_Result res;
+	size_t sz;
+
+	while (data_sz) {
+		sz = data_sz;
+		if (sz > sizeof(sess->chunk))
+			sz = sizeof(sess->chunk);
+		TEE_MemMove(sess->chunk, data, sz);
+
+		/* Keep the block as is unless compression saves room */
+		blk.data_sz = sz;
+		blk.stored_sz = lz_compress((uint8_t *)sess->chunk, sz,
+					    payload, sz - 1, sess->lz_table);
+		if (!blk.stored_sz) {
+			blk.stored_sz = sz;
+			TEE_MemMove(payload, sess->chunk, sz);
+		}
+		TEE_MemMove(sess->lz_block, &blk, sizeof(blk));
+
+		res = TEE_WriteObjectData(object, sess->lz_block,
+					  sizeof(blk) + blk.stored_sz);
+		if (res != TEE_SUCCESS) {
+			EMSG("TEE_WriteObjectData failed 0x%08x", res);
+			return res;
+		}
+
+		data += sz;
+		data_sz -= sz;
+	}
+
+	return TEE_SUCCESS;
+}
+
+/* Read @data_sz bytes of compressed data into @data */
+static TEE_Result read_compressed(struct storage_session *sess,
+				  TEE_ObjectHandle object,
+				  char *data, size_t data_sz)
+{
+	struct compress_block blk;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	while (data_sz) {
+		res = TEE_ReadObjectData(object, &blk, sizeof(blk),
+					 &read_bytes);
+		if (res != TEE_SUCCESS)
+			goto err;
+		if (read_bytes != sizeof(blk) || !blk.data_sz ||
+		    blk.data_sz > data_sz ||
+		    blk.data_sz > sizeof(sess->chunk) ||
+		    blk.stored_sz > blk.data_sz)
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		res = TEE_ReadObjectData(object, sess->lz_block,
+					 blk.stored_sz, &read_bytes);
+		if (res != TEE_SUCCESS)
+			goto err;
+		if (read_bytes != blk.stored_sz)
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		if (blk.stored_sz == blk.data_sz) {
+			TEE_MemMove(data, sess->lz_block, blk.data_sz);
+		} else {
+			/* Decompress in TA memory, out of reach of the client */
+			res = lz_decompress(sess->lz_block, blk.stored_sz,
+					    (uint8_t *)sess->chunk,
+					    blk.data_sz);
+			if (res != TEE_SUCCESS)
+				return res;
+			TEE_MemMove(data, sess->chunk, blk.data_sz);
+		}
+
+		data += blk.data_sz;
+		data_sz -= blk.data_sz;
+	}
+
+	return TEE_SUCCESS;
+err:
+	EMSG("TEE_ReadObjectData failed 0x%08x", res);
+	return res;
+}
+
+/*
+ * Get the size of the data of @object just opened, original size for a
+ * compressed object, and leave the data position at the start of the
+ * content.
+ */
+static TEE_Result get_data_size(TEE_ObjectHandle object, uint32_t *data_sz,
+				bool *compressed)
+{
+	TEE_ObjectInfo object_info;
+	struct object_header hdr;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	res = TEE_GetObjectInfo1(object, &object_info);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_GetObjectInfo1 failed 0x%08x", res);
+		return res;
+	}
+
+	res = TEE_ReadObjectData(object, &hdr, sizeof(hdr), &read_bytes);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_ReadObjectData failed 0x%08x", res);
+		return res;
+	}
+
+	if (read_bytes != sizeof(hdr) || hdr.magic != OBJECT_MAGIC)
+		return TEE_ERROR_CORRUPT_OBJECT;
+
+	switch (hdr.codec) {
+	case OBJECT_CODEC_NONE:
+		*data_sz = object_info.dataSize - sizeof(hdr);
+		*compressed = false;
+		return TEE_SUCCESS;
+	case OBJECT_CODEC_LZ4:
+		*data_sz = hdr.data_sz;
+		*compressed = true;
+		return TEE_SUCCESS;
+	default:
+		return TEE_ERROR_CORRUPT_OBJECT;
+	}
+}
+
+/* Read @data_sz bytes of content from @object, compressed or not */
+static TEE_Result read_content(struct storage_session *sess,
+			       TEE_ObjectHandle object, bool compressed,
+			       char *data, size_t data_sz)
+{
+	TEE_Result res;
+	size_t read_sz;
+
+	if (compressed)
+		return read_compressed(sess, object, data, data_sz);
+
+	res = read_chunks(sess, object, data, data_sz, &read_sz);
+	if (res == TEE_SUCCESS && read_sz != data_sz) {
+		EMSG("Read %zu over %zu bytes", read_sz, data_sz);
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	}
+
+	return res;
+}
+
+/*
+ * Ranged commands address the stored data: reject compressed objects. The
+ * data position is left at the start of the content.
+ */
+static TEE_Result check_uncompressed(TEE_ObjectHandle object)
+{
+	bool compressed;
+	TEE_Result res;
+	uint32_t size;
+
+	res = get_data_size(object, &size, &compressed);
+	if (res == TEE_SUCCESS && compressed)
+		return TEE_ERROR_NOT_SUPPORTED;
+
+	return res;
+}
+
+/*
+ * Object helpers, shared by the single and multi-object commands. Object
+ * ID lies in TA memory, data in client memory.
+ */
+static TEE_Result remove_object(uint32_t storage_id,
+				const char *obj_id, size_t obj_id_sz)
+{
+	TEE_ObjectHandle object;
+	TEE_Result res;
+
+	rc_drop_id(obj_id, obj_id_sz);
+
+	/*
+	 * Check object exists and delete it
+	 */
+	res = TEE_OpenPersistentObject(storage_id,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_ACCESS_WRITE_META, /* we must be allowed to delete it */
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	TEE_CloseAndDeletePersistentObject1(object);
+
+	return res;
+}
+
+static TEE_Result create_object(uint32_t storage_id,
+				const char *obj_id, size_t obj_id_sz,
+				TEE_ObjectHandle *object)
+{
+	uint32_t obj_data_flag;
+	TEE_Result res;
+
+	/*
+	 * Create object in secure storage
+	 */
+	obj_data_flag = TEE_DATA_FLAG_ACCESS_READ |		/* we can later read the oject */
+			TEE_DATA_FLAG_ACCESS_WRITE |		/* we can later write into the object */
+			TEE_DATA_FLAG_ACCESS_WRITE_META |	/* we can later destroy or rename the object */
+			TEE_DATA_FLAG_OVERWRITE;		/* destroy existing object of same ID */
+
+	res = TEE_CreatePersistentObject(storage_id,
+					obj_id, obj_id_sz,
+					obj_data_flag,
+					TEE_HANDLE_NULL,
+					NULL, 0,		/* we may not fill it right now */
+					object);
+	if (res != TEE_SUCCESS)
+		EMSG("TEE_CreatePersistentObject failed 0x%08x", res);
+
+	return res;
+}
+
+static TEE_Result write_object(struct storage_session *sess,
+			       uint32_t storage_id,
+			       const char *obj_id, size_t obj_id_sz,
+			       const char *data, size_t data_sz, bool compress)
+{
+	TEE_ObjectHandle object;
+	TEE_Result res;
+
+	rc_drop_id(obj_id, obj_id_sz);
+
+	res = create_object(storage_id, obj_id, obj_id_sz, &object);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = write_header(object, compress, data_sz);
+	if (res == TEE_SUCCESS) {
+		if (compress)
+			res = write_compressed(sess, object, data, data_sz);
+		else
+			res = write_chunks(sess, object, data, data_sz);
+	}
+	if (res != TEE_SUCCESS)
+		TEE_CloseAndDeletePersistentObject1(object);
+	else
+		TEE_CloseObject(object);
+
+	return res;
+}
+
+/*
+ * Read object into @data of @data_sz bytes. @data_sz is updated with the
+ * bytes read, or with the object size on TEE_ERROR_SHORT_BUFFER. The read
+ * cache only serves TEE_STORAGE_PRIVATE.
+ */
+static TEE_Result read_object(struct storage_session *sess,
+			      uint32_t storage_id,
+			      const char *obj_id, size_t obj_id_sz,
+			      char *data, size_t *data_sz)
+{
+	bool cached = storage_id == TEE_STORAGE_PRIVATE;
+	struct rc_object *obj = NULL;
+	TEE_ObjectHandle object;
+	bool compressed;
+	TEE_Result res;
+	uint32_t size;
+
+	if (cached)
+		obj = rc_find(obj_id, obj_id_sz);
+	if (obj) {
+		rc_hits++;
+		obj = rc_touch(obj);
+		if (obj->data_sz > *data_sz) {
+			*data_sz = obj->data_sz;
+			return TEE_ERROR_SHORT_BUFFER;
+		}
+
+		TEE_MemMove(data, obj->data, obj->data_sz);
+		*data_sz = obj->data_sz;
+		return TEE_SUCCESS;
+	}
+	if (cached)
+		rc_misses++;
+
+	/*
+	 * Check the object exist and can be dumped into output buffer
+	 * then dump it.
+	 */
+	res = TEE_OpenPersistentObject(storage_id,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_SHARE_READ,
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = get_data_size(object, &size, &compressed);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	if (size > *data_sz) {
+		/*
+		 * Provided buffer is too short.
+		 * Return the expected size together with status "short buffer"
+		 */
+		*data_sz = size;
+		res = TEE_ERROR_SHORT_BUFFER;
+		goto exit;
+	}
+
+	/* Cached copy lies in TA memory, out of reach of the client */
+	if (cached && size <= RC_MAX_OBJECT_SIZE) {
+		res = rc_alloc(obj_id, obj_id_sz, size, &obj);
+		if (res == TEE_SUCCESS) {
+			res = read_content(sess, object, compressed,
+					   obj->data, size);
+			if (res != TEE_SUCCESS) {
+				rc_remove(obj);
+				goto exit;
+			}
+
+			TEE_MemMove(data, obj->data, size);
+			*data_sz = size;
+			goto exit;
+		}
+		if (res != TEE_ERROR_OUT_OF_MEMORY)
+			goto exit;
+	}
+
+	res = read_content(sess, object, compressed, data, size);
+	if (res == TEE_SUCCESS)
+		*data_sz = size;
+exit:
+	TEE_CloseObject(object);
+	return res;
+}
+
+static struct wb_object *wb_find(struct storage_session *sess,
+				 const char *obj_id, size_t obj_id_sz)
+{
+	size_t n;
+
+	for (n = 0; n < sess->wb_count; n++)
+		if (sess->wb[n].id_sz == obj_id_sz &&
+		    !TEE_MemCompare(sess->wb[n].id, obj_id, obj_id_sz))
+			return sess->wb + n;
+
+	return NULL;
+}
+
+static void wb_remove(struct storage_session *sess, struct wb_object *wb)
+{
+	size_t n = wb - sess->wb;
+
+	sess->wb_size -= wb->data_sz;
+	TEE_Free(wb->data);
+
+	TEE_MemMove(wb, wb + 1, (sess->wb_count - n - 1) * sizeof(*wb));
+	sess->wb_count--;
+}
+
+/* Write a cached object to the secure storage */
+static TEE_Result wb_flush_object(struct storage_session *sess,
+				  struct wb_object *wb)
+{
+	TEE_Result res;
+
+	res = write_object(sess, TEE_STORAGE_PRIVATE, wb->id, wb->id_sz,
+			   wb->data, wb->data_sz, wb->compress);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to flush object, res=0x%08x", res);
+		return res;
+	}
+
+	wb_remove(sess, wb);
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result wb_flush(struct storage_session *sess)
+{
+	TEE_Result res;
+
+	while (sess->wb_count) {
+		res = wb_flush_object(sess, sess->wb);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	return TEE_SUCCESS;
+}
+
+/* Flush object @obj_id if cached, before accessing it in the storage */
+static TEE_Result wb_flush_id(struct storage_session *sess,
+			      const char *obj_id, size_t obj_id_sz)
+{
+	struct wb_object *wb = wb_find(sess, obj_id, obj_id_sz);
+
+	if (!wb)
+		return TEE_SUCCESS;
+
+	return wb_flush_object(sess, wb);
+}
+
+/*
+ * Drop object @obj_id if cached, when overwritten or deleted. Return
+ * whether it was cached.
+ */
+static bool wb_drop_id(struct storage_session *sess,
+		       const char *obj_id, size_t obj_id_sz)
+{
+	struct wb_object *wb = wb_find(sess, obj_id, obj_id_sz);
+
+	if (!wb)
+		return false;
+
+	wb_remove(sess, wb);
+
+	return true;
+}
+
+/*
+ * Cache @data_sz bytes of client memory @data as the content of object
+ * @obj_id, flushing the least recently written objects to make room.
+ */
+static TEE_Result wb_write(struct storage_session *sess,
+			   const char *obj_id, size_t obj_id_sz,
+			   const char *data, size_t data_sz, bool compress)
+{
+	struct wb_object *wb;
+	void *buf;
+
+	/* Coalesce with the cached content */
+	wb_drop_id(sess, obj_id, obj_id_sz);
+
+	while (sess->wb_count == WB_MAX_OBJECTS ||
+	       sess->wb_size + data_sz > WB_MAX_SIZE)
+		if (wb_flush_object(sess, sess->wb) != TEE_SUCCESS)
+			return TEE_ERROR_OUT_OF_MEMORY;
+
+	buf = TEE_Malloc(data_sz ? data_sz : 1, 0);
+	if (!buf) {
+		/* Memory pressure: release the cache and retry */
+		if (wb_flush(sess) == TEE_SUCCESS)
+			buf = TEE_Malloc(data_sz ? data_sz : 1, 0);
+		if (!buf)
+			return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	TEE_MemMove(buf, data, data_sz);
+
+	wb = sess->wb + sess->wb_count;
+	TEE_MemMove(wb->id, obj_id, obj_id_sz);
+	wb->id_sz = obj_id_sz;
+	wb->data = buf;
+	wb->data_sz = data_sz;
+	wb->compress = compress;
+	sess->wb_count++;
+	sess->wb_size += data_sz;
+
+	return TEE_SUCCESS;
+}
+
+static bool is_reserved_id(const char *obj_id, size_t obj_id_sz)
+{
+	return obj_id_sz >= RESERVED_ID_LEN &&
+	       !TEE_MemCompare(obj_id, TA_SECURE_STORAGE_RESERVED_ID,
+			       RESERVED_ID_LEN);
+}
+
+/*
+ * Copy the object ID from client memref @param into @obj_id. IDs of the
+ * objects managed by the TA are denied to the client.
+ */
+static TEE_Result get_object_id(TEE_Param *param,
+				char obj_id[TEE_OBJECT_ID_MAX_LEN],
+				size_t *obj_id_sz)
+{
+	if (!param->memref.size || param->memref.size > TEE_OBJECT_ID_MAX_LEN)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	TEE_MemMove(obj_id, param->memref.buffer, param->memref.size);
+	*obj_id_sz = param->memref.size;
+
+	if (is_reserved_id(obj_id, *obj_id_sz))
+		return TEE_ERROR_ACCESS_DENIED;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Get the storage of the object from the optional value param[3],
+ * TEE_STORAGE_PRIVATE by default. Clear param[3] from @param_types for the
+ * checks of the other parameters.
+ */
+static TEE_Result get_storage_id(uint32_t *param_types, TEE_Param params[4],
+				 uint32_t *storage_id)
+{
+	switch (TEE_PARAM_TYPE_GET(*param_types, 3)) {
+	case TEE_PARAM_TYPE_NONE:
+		*storage_id = TEE_STORAGE_PRIVATE;
+		return TEE_SUCCESS;
+	case TEE_PARAM_TYPE_VALUE_INPUT:
+		break;
+	default:
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	switch (params[3].value.a) {
+	case TA_SECURE_STORAGE_PRIVATE:
+		*storage_id = TEE_STORAGE_PRIVATE;
+		break;
+	case TA_SECURE_STORAGE_PRIVATE_REE:
+		*storage_id = TEE_STORAGE_PRIVATE_REE;
+		break;
+	case TA_SECURE_STORAGE_PRIVATE_RPMB:
+		*storage_id = TEE_STORAGE_PRIVATE_RPMB;
+		break;
+	default:
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	*param_types &= ~TEE_PARAM_TYPES(0, 0, 0, 0xf);
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Flush object @obj_id if cached before accessing it in another storage
+ * than TEE_STORAGE_PRIVATE: that storage may hold the same objects.
+ */
+static TEE_Result wb_flush_storage(struct storage_session *sess,
+				   uint32_t storage_id,
+				   const char *obj_id, size_t obj_id_sz)
+{
+	if (storage_id == TEE_STORAGE_PRIVATE)
+		return TEE_SUCCESS;
+
+	return wb_flush_id(sess, obj_id, obj_id_sz);
+}
+
+/*
+ * Check the parameters of a command writing object ID param[0] with data
+ * param[1], optionally followed by TA_SECURE_STORAGE_FLAG_xxx in param[2].
+ */
+static TEE_Result get_write_flags(uint32_t param_types, TEE_Param params[4],
+				  bool *compress)
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_param_types_flags =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE);
+
+	*compress = false;
+	if (param_types == exp_param_types)
+		return TEE_SUCCESS;
+
+	if (param_types != exp_param_types_flags ||
+	    params[2].value.a & ~TA_SECURE_STORAGE_FLAG_COMPRESS)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	*compress = params[2].value.a & TA_SECURE_STORAGE_FLAG_COMPRESS;
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result delete_object(void *session, uint32_t param_types,
+				TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t storage_id;
+	size_t obj_id_sz;
+	TEE_Result res;
+	bool cached;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	res = get_storage_id(&param_types, params, &storage_id);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (storage_id != TEE_STORAGE_PRIVATE) {
+		res = wb_flush_storage(sess, storage_id, obj_id, obj_id_sz);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		return remove_object(storage_id, obj_id, obj_id_sz);
+	}
+
+	/* A cached object may not be in the secure storage yet */
+	cached = wb_drop_id(sess, obj_id, obj_id_sz);
+	res = remove_object(storage_id, obj_id, obj_id_sz);
+	if (cached && res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+
+	return res;
+}
+
+static TEE_Result create_raw_object(void *session, uint32_t param_types,
+				    TEE_Param params[4])
+{
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t storage_id;
+	size_t obj_id_sz;
+	TEE_Result res;
+	bool compress;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	res = get_storage_id(&param_types, params, &storage_id);
+	if (res != TEE_SUCCESS)
+		return res;
+	res = get_write_flags(param_types, params, &compress);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (storage_id != TEE_STORAGE_PRIVATE) {
+		res = wb_flush_storage(sess, storage_id, obj_id, obj_id_sz);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		return write_object(sess, storage_id, obj_id, obj_id_sz,
+				    params[1].memref.buffer,
+				    params[1].memref.size, compress);
+	}
+
+	if (sess->write_back &&
+	    params[1].memref.size <= WB_MAX_OBJECT_SIZE) {
+		res = wb_write(sess, obj_id, obj_id_sz,
+			       params[1].memref.buffer, params[1].memref.size,
+			       compress);
+		if (res != TEE_ERROR_OUT_OF_MEMORY)
+			return res;
+	}
+
+	wb_drop_id(sess, obj_id, obj_id_sz);
+
+	return write_object(sess, storage_id, obj_id, obj_id_sz,
+			    params[1].memref.buffer, params[1].memref.size,
+			    compress);
+}
+
+static TEE_Result read_raw_object(void *session, uint32_t param_types,
+				  TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	struct wb_object *wb = NULL;
+	uint32_t storage_id;
+	size_t obj_id_sz;
+	size_t data_sz;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	res = get_storage_id(&param_types, params, &storage_id);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	data_sz = params[1].memref.size;
+
+	res = wb_flush_storage(sess, storage_id, obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (storage_id == TEE_STORAGE_PRIVATE)
+		wb = wb_find(sess, obj_id, obj_id_sz);
+	if (wb) {
+		params[1].memref.size = wb->data_sz;
+		if (wb->data_sz > data_sz)
+			return TEE_ERROR_SHORT_BUFFER;
+
+		TEE_MemMove(params[1].memref.buffer, wb->data, wb->data_sz);
+		return TEE_SUCCESS;
+	}
+
+	res = read_object(sess, storage_id, obj_id, obj_id_sz,
+			  params[1].memref.buffer, &data_sz);
+	if (res == TEE_SUCCESS || res == TEE_ERROR_SHORT_BUFFER)
+		params[1].memref.size = data_sz;
+
+	return res;
+}
+
+/*
+ * Move the data position of @object from the start of the content, where
+ * check_uncompressed() leaves it, to @offset. Seek offset is a signed
+ * 32bit value.
+ */
+static TEE_Result seek_object(TEE_ObjectHandle object, uint32_t offset)
+{
+	TEE_Result res;
+
+	if (offset > INT32_MAX) {
+		res = TEE_SeekObjectData(object, INT32_MAX, TEE_DATA_SEEK_CUR);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		offset -= INT32_MAX;
+	}
+
+	return TEE_SeekObjectData(object, offset, TEE_DATA_SEEK_CUR);
+}
+
+static TEE_Result read_object_range(void *session, uint32_t param_types,
+				    TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	size_t obj_id_sz;
+	size_t read_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = wb_flush_id(sess, obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_SHARE_READ,
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = check_uncompressed(object);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	res = seek_object(object, params[2].value.a);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_SeekObjectData failed 0x%08x", res);
+		goto out;
+	}
+
+	res = read_chunks(sess, object, params[1].memref.buffer,
+			  params[1].memref.size, &read_sz);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	/* Return the number of byte effectively filled */
+	params[1].memref.size = read_sz;
+out:
+	TEE_CloseObject(object);
+	return res;
+}
+
+static TEE_Result write_object_range(void *session, uint32_t param_types,
+				     TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	size_t obj_id_sz;
+	uint32_t offset;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = wb_flush_id(sess, obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	rc_drop_id(obj_id, obj_id_sz);
+
+	offset = params[2].value.a;
+	if (offset > TEE_DATA_MAX_POSITION - sizeof(struct object_header) ||
+	    params[1].memref.size > TEE_DATA_MAX_POSITION -
+				    sizeof(struct object_header) - offset)
+		return TEE_ERROR_OVERFLOW;
+
+	/*
+	 * Update the object in place: only the written range reaches the
+	 * storage, unlike WRITE_RAW which recreates the whole object.
+	 */
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_ACCESS_WRITE,
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = check_uncompressed(object);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	res = seek_object(object, offset);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_SeekObjectData failed 0x%08x", res);
+		goto out;
+	}
+
+	res = write_chunks(sess, object, params[1].memref.buffer,
+			   params[1].memref.size);
+out:
+	TEE_CloseObject(object);
+	return res;
+}
+
+static TEE_Result truncate_object(void *session, uint32_t param_types,
+				  TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	size_t obj_id_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = wb_flush_id(sess, obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	rc_drop_id(obj_id, obj_id_sz);
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_ACCESS_WRITE,
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = check_uncompressed(object);
+	if (res == TEE_SUCCESS && params[1].value.a >
+	    TEE_DATA_MAX_POSITION - sizeof(struct object_header))
+		res = TEE_ERROR_OVERFLOW;
+	if (res == TEE_SUCCESS) {
+		res = TEE_TruncateObjectData(object, params[1].value.a +
+					     sizeof(struct object_header));
+		if (res != TEE_SUCCESS)
+			EMSG("TEE_TruncateObjectData failed 0x%08x", res);
+	}
+
+	TEE_CloseObject(object);
+	return res;
+}
+
+/*
+ * Process the records of a TA_SECURE_STORAGE_CMD_xxx_MULTI command, see
+ * secure_storage_ta.h.
+ */
+static TEE_Result process_multi(void *session, uint32_t param_types,
+				TEE_Param params[4], uint32_t command)
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	struct secure_storage_record rec;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t list_sz;
+	size_t reserved_sz;
+	size_t data_sz;
+	size_t off = 0;
+	bool cached;
+	char *list;
+	char *data;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	list = params[0].memref.buffer;
+	list_sz = params[0].memref.size;
+
+	while (off < list_sz) {
+		/* Record header lies in shared memory: work on a copy */
+		if (list_sz - off < sizeof(rec))
+			return TEE_ERROR_BAD_PARAMETERS;
+		TEE_MemMove(&rec, list + off, sizeof(rec));
+
+		if (!rec.id_size || rec.id_size > sizeof(obj_id) ||
+		    rec.id_size > list_sz - off - sizeof(rec) ||
+		    rec.data_size > list_sz - off - sizeof(rec) - rec.id_size)
+			return TEE_ERROR_BAD_PARAMETERS;
+
+		TEE_MemMove(obj_id, list + off + sizeof(rec), rec.id_size);
+		if (is_reserved_id(obj_id, rec.id_size))
+			return TEE_ERROR_ACCESS_DENIED;
+		data = list + off + sizeof(rec) + rec.id_size;
+		reserved_sz = rec.data_size;
+		data_sz = rec.data_size;
+
+		switch (command) {
+		case TA_SECURE_STORAGE_CMD_WRITE_MULTI:
+			wb_drop_id(sess, obj_id, rec.id_size);
+			rec.status = write_object(sess, TEE_STORAGE_PRIVATE,
+						  obj_id, rec.id_size,
+						  data, data_sz, false);
+			break;
+		case TA_SECURE_STORAGE_CMD_READ_MULTI:
+			rec.status = wb_flush_id(sess, obj_id, rec.id_size);
+			if (rec.status == TEE_SUCCESS)
+				rec.status = read_object(sess,
+							 TEE_STORAGE_PRIVATE,
+							 obj_id,
+							 rec.id_size,
+							 data, &data_sz);
+			if (rec.status == TEE_SUCCESS ||
+			    rec.status == TEE_ERROR_SHORT_BUFFER)
+				rec.data_size = data_sz;
+			break;
+		default:
+			if (data_sz)
+				return TEE_ERROR_BAD_PARAMETERS;
+			cached = wb_drop_id(sess, obj_id, rec.id_size);
+			rec.status = remove_object(TEE_STORAGE_PRIVATE,
+						   obj_id, rec.id_size);
+			if (cached && rec.status == TEE_ERROR_ITEM_NOT_FOUND)
+				rec.status = TEE_SUCCESS;
+			break;
+		}
+
+		TEE_MemMove(list + off, &rec, sizeof(rec));
+
+		/* Records layout is the one given by the caller */
+		off += TA_SECURE_STORAGE_RECORD_SIZE(rec.id_size, reserved_sz);
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Fetch next object of the listing into the session, if not done yet. The
+ * objects managed by the TA are not listed.
+ */
+static TEE_Result list_fetch(struct storage_session *sess)
+{
+	TEE_ObjectInfo info;
+	TEE_Result res;
+
+	if (sess->list_pending)
+		return TEE_SUCCESS;
+
+	do {
+		sess->list_id_sz = sizeof(sess->list_id);
+		res = TEE_GetNextPersistentObject(sess->list_enum, &info,
+						  sess->list_id,
+						  &sess->list_id_sz);
+		if (res != TEE_SUCCESS)
+			return res;
+	} while (is_reserved_id(sess->list_id, sess->list_id_sz));
+
+	/* Size in storage, past the header */
+	sess->list_data_sz = 0;
+	if (info.dataSize > sizeof(struct object_header))
+		sess->list_data_sz = info.dataSize -
+				     sizeof(struct object_header);
+	sess->list_pending = true;
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Position the listing at @cursor. Following the previous call is
+ * immediate, any other cursor restarts the enumeration and skips the
+ * objects already returned.
+ */
+static TEE_Result list_seek(struct storage_session *sess, uint32_t cursor)
+{
+	TEE_Result res;
+
+	if (cursor && cursor == sess->list_pos)
+		return TEE_SUCCESS;
+
+	if (sess->list_enum == TEE_HANDLE_NULL) {
+		res = TEE_AllocatePersistentObjectEnumerator(&sess->list_enum);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to allocate enumerator, res=0x%08x", res);
+			return res;
+		}
+	}
+
+	TEE_ResetPersistentObjectEnumerator(sess->list_enum);
+	sess->list_pending = false;
+	sess->list_pos = 0;
+
+	res = TEE_StartPersistentObjectEnumerator(sess->list_enum,
+						  TEE_STORAGE_PRIVATE);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	while (sess->list_pos < cursor) {
+		res = list_fetch(sess);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		sess->list_pending = false;
+		sess->list_pos++;
+	}
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result list_objects(void *session, uint32_t param_types,
+			       TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_VALUE_INOUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	struct secure_storage_list_entry entry;
+	char *list = params[0].memref.buffer;
+	size_t list_sz = params[0].memref.size;
+	uint32_t count = 0;
+	size_t off = 0;
+	size_t sz;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/* List the objects as written, cached ones included */
+	res = wb_flush(sess);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = list_seek(sess, params[1].value.a);
+	while (res == TEE_SUCCESS) {
+		res = list_fetch(sess);
+		if (res != TEE_SUCCESS)
+			break;
+
+		sz = sizeof(entry) + sess->list_id_sz;
+		if (sz > list_sz - off) {
+			if (count)
+				break;
+
+			/* Not even one entry fits: return the size needed */
+			params[0].memref.size = sz;
+			return TEE_ERROR_SHORT_BUFFER;
+		}
+
+		entry.id_size = sess->list_id_sz;
+		entry.data_size = sess->list_data_sz;
+		TEE_MemMove(list + off, &entry, sizeof(entry));
+		TEE_MemMove(list + off + sizeof(entry), sess->list_id,
+			    sess->list_id_sz);
+
+		sess->list_pending = false;
+		sess->list_pos++;
+		count++;
+
+		off += TA_SECURE_STORAGE_LIST_ENTRY_SIZE(sess->list_id_sz);
+		if (off > list_sz)
+			off = list_sz;
+	}
+
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		/* End of listing */
+		params[1].value.a = 0;
+		sess->list_pos = 0;
+	} else if (res == TEE_SUCCESS) {
+		params[1].value.a = sess->list_pos;
+	} else {
+		EMSG("Failed to list objects, res=0x%08x", res);
+		return res;
+	}
+
+	params[0].memref.size = off;
+	params[1].value.b = count;
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result stat_object(void *session, uint32_t param_types,
+			      TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectHandle object;
+	uint32_t storage_id;
+	bool compressed;
+	TEE_Result res;
+	size_t obj_id_sz;
+	uint32_t size;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	res = get_storage_id(&param_types, params, &storage_id);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = wb_flush_id(sess, obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_OpenPersistentObject(storage_id,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_SHARE_READ,
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = get_data_size(object, &size, &compressed);
+	if (res == TEE_SUCCESS)
+		params[1].value.a = size;
+
+	TEE_CloseObject(object);
+	return res;
+}
+
+/*
+ * Build in @tmp_id the ID of an object the TA manages for @obj_id, the
+ * caller checks it fits.
+ */
+static size_t prefixed_id(const char *prefix, size_t prefix_sz,
+			  const char *obj_id, size_t obj_id_sz,
+			  char tmp_id[TEE_OBJECT_ID_MAX_LEN])
+{
+	TEE_MemMove(tmp_id, prefix, prefix_sz);
+	TEE_MemMove(tmp_id + prefix_sz, obj_id, obj_id_sz);
+
+	return prefix_sz + obj_id_sz;
+}
+
+/*
+ * Find the first object which ID starts with @prefix, restarting the
+ * enumeration: the caller renames or deletes it before the next call.
+ */
+static bool find_prefixed(TEE_ObjectEnumHandle obj_enum,
+			  const char *prefix, size_t prefix_sz,
+			  char obj_id[TEE_OBJECT_ID_MAX_LEN],
+			  uint32_t *obj_id_sz)
+{
+	TEE_ObjectInfo info;
+	TEE_Result res;
+
+	res = TEE_StartPersistentObjectEnumerator(obj_enum,
+						  TEE_STORAGE_PRIVATE);
+	while (res == TEE_SUCCESS) {
+		*obj_id_sz = TEE_OBJECT_ID_MAX_LEN;
+		res = TEE_GetNextPersistentObject(obj_enum, &info,
+						  obj_id, obj_id_sz);
+		if (res == TEE_SUCCESS && *obj_id_sz > prefix_sz &&
+		    !TEE_MemCompare(obj_id, prefix, prefix_sz))
+			return true;
+	}
+
+	return false;
+}
+
+/* Delete the objects which ID starts with @prefix */
+static void discard_prefixed(const char *prefix, size_t prefix_sz)
+{
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectEnumHandle obj_enum;
+	TEE_ObjectHandle object;
+	uint32_t obj_id_sz;
+
+	if (TEE_AllocatePersistentObjectEnumerator(&obj_enum) != TEE_SUCCESS)
+		return;
+
+	while (find_prefixed(obj_enum, prefix, prefix_sz, obj_id,
+			     &obj_id_sz) &&
+	       TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_WRITE_META,
+					&object) == TEE_SUCCESS) {
+		DMSG("Discard object %.*s", (int)obj_id_sz, obj_id);
+		TEE_CloseAndDeletePersistentObject1(object);
+	}
+
+	TEE_FreePersistentObjectEnumerator(obj_enum);
+}
+
+/*
+ * Complete the stream commits interrupted by a reset: a previous object
+ * left aside is put back if the new one did not take its place, else
+ * deleted. Data of the streams never committed is dropped.
+ */
+static void stream_recover(void)
+{
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectEnumHandle obj_enum;
+	TEE_ObjectHandle object;
+	uint32_t obj_id_sz;
+	TEE_Result res;
+
+	if (TEE_AllocatePersistentObjectEnumerator(&obj_enum) != TEE_SUCCESS)
+		return;
+
+	while (find_prefixed(obj_enum, BACKUP_ID_PREFIX, BACKUP_ID_PREFIX_LEN,
+			     obj_id, &obj_id_sz) &&
+	       TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					obj_id, obj_id_sz,
+					TEE_DATA_FLAG_ACCESS_WRITE_META,
+					&object) == TEE_SUCCESS) {
+		res = TEE_RenamePersistentObject(object,
+						 obj_id + BACKUP_ID_PREFIX_LEN,
+						 obj_id_sz -
+						 BACKUP_ID_PREFIX_LEN);
+		if (res == TEE_SUCCESS) {
+			DMSG("Restore object %.*s", (int)obj_id_sz, obj_id);
+			TEE_CloseObject(object);
+		} else if (res == TEE_ERROR_ACCESS_CONFLICT) {
+			/* The new object is in place */
+			TEE_CloseAndDeletePersistentObject1(object);
+		} else {
+			EMSG("Failed to restore object, res=0x%08x", res);
+			TEE_CloseObject(object);
+			break;
+		}
+	}
+
+	TEE_FreePersistentObjectEnumerator(obj_enum);
+
+	discard_prefixed(STREAM_ID_PREFIX, STREAM_ID_PREFIX_LEN);
+}
+
+/* Drop the stream in progress, if any, with its temporary object */
+static void abort_stream(struct storage_session *sess)
+{
+	if (sess->stream == TEE_HANDLE_NULL)
+		return;
+
+	TEE_CloseAndDeletePersistentObject1(sess->stream);
+	sess->stream = TEE_HANDLE_NULL;
+}
+
+static TEE_Result stream_open(void *session, uint32_t param_types,
+			      TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char tmp_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (sess->stream != TEE_HANDLE_NULL)
+		return TEE_ERROR_BAD_STATE;
+
+	res = get_object_id(&params[0], sess->stream_id, &sess->stream_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/*
+	 * Data is appended to a temporary object renamed at commit time: the
+	 * object keeps its previous content until the stream is complete.
+	 */
+	if (sess->stream_id_sz > sizeof(tmp_id) - STREAM_ID_PREFIX_LEN)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = create_object(TEE_STORAGE_PRIVATE, tmp_id,
+			    prefixed_id(STREAM_ID_PREFIX, STREAM_ID_PREFIX_LEN,
+					sess->stream_id, sess->stream_id_sz,
+					tmp_id),
+			    &sess->stream);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Streamed data is stored as is */
+	res = write_header(sess->stream, false, 0);
+	if (res != TEE_SUCCESS)
+		abort_stream(sess);
+
+	return res;
+}
+
+static TEE_Result stream_append(void *session, uint32_t param_types,
+				TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (sess->stream == TEE_HANDLE_NULL)
+		return TEE_ERROR_BAD_STATE;
+
+	res = write_chunks(sess, sess->stream, params[0].memref.buffer,
+			   params[0].memref.size);
+	if (res != TEE_SUCCESS)
+		abort_stream(sess);
+
+	return res;
+}
+
+static TEE_Result stream_commit(void *session, uint32_t param_types,
+				TEE_Param __unused params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	TEE_ObjectHandle previous = TEE_HANDLE_NULL;
+	char bak_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t bak_id_sz;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (sess->stream == TEE_HANDLE_NULL)
+		return TEE_ERROR_BAD_STATE;
+
+	wb_drop_id(sess, sess->stream_id, sess->stream_id_sz);
+	rc_drop_id(sess->stream_id, sess->stream_id_sz);
+
+	/*
+	 * Renaming does not overwrite: move the previous object aside and
+	 * delete it only once the new one has taken its place. A reset in
+	 * between is handled by stream_recover().
+	 */
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					sess->stream_id, sess->stream_id_sz,
+					TEE_DATA_FLAG_ACCESS_WRITE_META,
+					&previous);
+	if (res == TEE_SUCCESS) {
+		bak_id_sz = prefixed_id(BACKUP_ID_PREFIX, BACKUP_ID_PREFIX_LEN,
+					sess->stream_id, sess->stream_id_sz,
+					bak_id);
+		res = TEE_RenamePersistentObject(previous, bak_id, bak_id_sz);
+		if (res != TEE_SUCCESS)
+			TEE_CloseObject(previous);
+	} else if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		res = TEE_SUCCESS;
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to move previous object aside, res=0x%08x", res);
+		abort_stream(sess);
+		return res;
+	}
+
+	res = TEE_RenamePersistentObject(sess->stream, sess->stream_id,
+					 sess->stream_id_sz);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_RenamePersistentObject failed 0x%08x", res);
+		abort_stream(sess);
+
+		/* Put the previous object back */
+		if (previous != TEE_HANDLE_NULL) {
+			if (TEE_RenamePersistentObject(previous,
+						       sess->stream_id,
+						       sess->stream_id_sz) !=
+			    TEE_SUCCESS)
+				EMSG("Previous object left aside");
+			TEE_CloseObject(previous);
+		}
+		return res;
+	}
+
+	TEE_CloseObject(sess->stream);
+	sess->stream = TEE_HANDLE_NULL;
+	if (previous != TEE_HANDLE_NULL)
+		TEE_CloseAndDeletePersistentObject1(previous);
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result stream_abort(void *session, uint32_t param_types,
+			       TEE_Param __unused params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (sess->stream == TEE_HANDLE_NULL)
+		return TEE_ERROR_BAD_STATE;
+
+	abort_stream(sess);
+
+	return TEE_SUCCESS;
+}
+
+/* Build in @tmp_id the ID of the object staging @obj_id in a transaction */
+static size_t tx_staged_id(const char *obj_id, size_t obj_id_sz,
+			   char tmp_id[TEE_OBJECT_ID_MAX_LEN])
+{
+	return prefixed_id(TX_ID_PREFIX, TX_ID_PREFIX_LEN, obj_id, obj_id_sz,
+			   tmp_id);
+}
+
+/*
+ * Rename the staged objects of tx[] over their target. A staged object
+ * not found was published already, by a commit interrupted later on.
+ */
+static TEE_Result tx_publish(void)
+{
+	char tmp_id[TEE_OBJECT_ID_MAX_LEN];
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	size_t tmp_id_sz;
+	size_t n;
+
+	for (n = 0; n < tx_count; n++) {
+		tmp_id_sz = tx_staged_id(tx[n].id, tx[n].id_sz, tmp_id);
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+						tmp_id, tmp_id_sz,
+						TEE_DATA_FLAG_ACCESS_READ |
+						TEE_DATA_FLAG_ACCESS_WRITE_META,
+						&object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			continue;
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to open persistent object, res=0x%08x",
+			     res);
+			return res;
+		}
+
+		/* Renaming does not overwrite: drop the previous object first */
+		res = remove_object(TEE_STORAGE_PRIVATE, tx[n].id,
+				    tx[n].id_sz);
+		if (res == TEE_SUCCESS || res == TEE_ERROR_ITEM_NOT_FOUND)
+			res = TEE_RenamePersistentObject(object, tx[n].id,
+							 tx[n].id_sz);
+		TEE_CloseObject(object);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to publish object, res=0x%08x", res);
+			return res;
+		}
+	}
+
+	return TEE_SUCCESS;
+}
+
+/* Complete the commit recorded in the journal, if any */
+static TEE_Result tx_recover(void)
+{
+	TEE_ObjectHandle journal;
+	uint32_t read_bytes;
+	TEE_Result res;
+	size_t n;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					TX_JOURNAL_ID, sizeof(TX_JOURNAL_ID) - 1,
+					TEE_DATA_FLAG_ACCESS_READ |
+					TEE_DATA_FLAG_ACCESS_WRITE_META,
+					&journal);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		tx_pending = false;
+		return TEE_SUCCESS;
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open transaction journal, res=0x%08x", res);
+		return res;
+	}
+
+	res = TEE_ReadObjectData(journal, tx, sizeof(tx), &read_bytes);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_ReadObjectData failed 0x%08x", res);
+		goto out;
+	}
+
+	tx_count = read_bytes / sizeof(*tx);
+	res = TEE_ERROR_CORRUPT_OBJECT;
+	if (read_bytes % sizeof(*tx))
+		goto out;
+	for (n = 0; n < tx_count; n++)
+		if (!tx[n].id_sz ||
+		    tx[n].id_sz > sizeof(tx[n].id) - TX_ID_PREFIX_LEN)
+			goto out;
+
+	res = tx_publish();
+	if (res == TEE_SUCCESS) {
+		TEE_CloseAndDeletePersistentObject1(journal);
+		journal = TEE_HANDLE_NULL;
+		tx_pending = false;
+	}
+out:
+	if (journal != TEE_HANDLE_NULL)
+		TEE_CloseObject(journal);
+	tx_count = 0;
+	return res;
+}
+
+/* Delete the staged objects of the transaction of @sess, if any */
+static void abort_tx(struct storage_session *sess)
+{
+	char tmp_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t tmp_id_sz;
+	size_t n;
+
+	if (tx_owner != sess)
+		return;
+
+	for (n = 0; n < tx_count; n++) {
+		tmp_id_sz = tx_staged_id(tx[n].id, tx[n].id_sz, tmp_id);
+		remove_object(TEE_STORAGE_PRIVATE, tmp_id, tmp_id_sz);
+	}
+
+	tx_owner = NULL;
+	tx_count = 0;
+}
+
+static TEE_Result tx_begin(void *session, uint32_t param_types,
+			   TEE_Param __unused params[4])
 {
 	const uint32_t exp_param_types =
-		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
-	TEE_ObjectHandle object;
-	TEE_Result res;
-	char *obj_id;
-	size_t obj_id_sz;
+	struct storage_session *sess = (struct storage_session *)session;
 
 	/*
 	 * Safely get the invocation parameters
@@ -48,47 +1984,172 @@ static TEE_Result delete_object(uint32_t param_types, TEE_Param params[4])
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	obj_id_sz = params[0].memref.size;
-	obj_id = TEE_Malloc(obj_id_sz, 0);
-	if (!obj_id)
-		return TEE_ERROR_OUT_OF_MEMORY;
+	if (tx_owner == sess)
+		return TEE_ERROR_BAD_STATE;
+	if (tx_owner)
+		return TEE_ERROR_BUSY;
+
+	tx_owner = sess;
+	tx_count = 0;
+
+	return TEE_SUCCESS;
+}
 
-	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+static TEE_Result tx_put(void *session, uint32_t param_types,
+			 TEE_Param params[4])
+{
+	struct storage_session *sess = (struct storage_session *)session;
+	char tmp_id[TEE_OBJECT_ID_MAX_LEN];
+	char obj_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t obj_id_sz;
+	size_t tmp_id_sz;
+	TEE_Result res;
+	bool compress;
+	size_t n;
 
 	/*
-	 * Check object exists and delete it
+	 * Safely get the invocation parameters
 	 */
-	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
-					obj_id, obj_id_sz,
-					TEE_DATA_FLAG_ACCESS_READ |
-					TEE_DATA_FLAG_ACCESS_WRITE_META, /* we must be allowed to delete it */
-					&object);
+	res = get_write_flags(param_types, params, &compress);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (tx_owner != sess)
+		return TEE_ERROR_BAD_STATE;
+
+	res = get_object_id(&params[0], obj_id, &obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (obj_id_sz > sizeof(obj_id) - TX_ID_PREFIX_LEN)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/* A new put of an object in the transaction replaces the previous one */
+	for (n = 0; n < tx_count; n++)
+		if (tx[n].id_sz == obj_id_sz &&
+		    !TEE_MemCompare(tx[n].id, obj_id, obj_id_sz))
+			break;
+	if (n == TA_SECURE_STORAGE_TX_MAX_OBJECTS)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	tmp_id_sz = tx_staged_id(obj_id, obj_id_sz, tmp_id);
+	res = write_object(sess, TEE_STORAGE_PRIVATE, tmp_id, tmp_id_sz,
+			   params[1].memref.buffer, params[1].memref.size,
+			   compress);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to open persistent object, res=0x%08x", res);
-		TEE_Free(obj_id);
+		/* The transaction lost its previous put of the object */
+		abort_tx(sess);
 		return res;
 	}
 
-	TEE_CloseAndDeletePersistentObject1(object);
-	TEE_Free(obj_id);
+	if (n == tx_count) {
+		TEE_MemMove(tx[n].id, obj_id, obj_id_sz);
+		tx[n].id_sz = obj_id_sz;
+		tx_count++;
+	}
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result tx_commit(void *session, uint32_t param_types,
+			    TEE_Param __unused params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	TEE_ObjectHandle journal = TEE_HANDLE_NULL;
+	TEE_Result res;
+	size_t n;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (tx_owner != sess)
+		return TEE_ERROR_BAD_STATE;
+
+	/*
+	 * Commit point: the journal is created together with its content.
+	 * Once it exists, the objects are published even across a reset.
+	 */
+	if (tx_count) {
+		res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+						 TX_JOURNAL_ID,
+						 sizeof(TX_JOURNAL_ID) - 1,
+						 TEE_DATA_FLAG_ACCESS_WRITE_META |
+						 TEE_DATA_FLAG_OVERWRITE,
+						 TEE_HANDLE_NULL,
+						 tx, tx_count * sizeof(*tx),
+						 &journal);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to create transaction journal, res=0x%08x",
+			     res);
+			abort_tx(sess);
+			return res;
+		}
+	}
+
+	for (n = 0; n < tx_count; n++)
+		wb_drop_id(sess, tx[n].id, tx[n].id_sz);
+
+	res = tx_publish();
+	if (tx_count) {
+		if (res == TEE_SUCCESS) {
+			TEE_CloseAndDeletePersistentObject1(journal);
+		} else {
+			/* Completed before serving the next command */
+			TEE_CloseObject(journal);
+			tx_pending = true;
+		}
+	}
+
+	tx_owner = NULL;
+	tx_count = 0;
 
 	return res;
 }
 
-static TEE_Result create_raw_object(uint32_t param_types, TEE_Param params[4])
+static TEE_Result tx_abort(void *session, uint32_t param_types,
+			   TEE_Param __unused params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (tx_owner != sess)
+		return TEE_ERROR_BAD_STATE;
+
+	abort_tx(sess);
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result kv_put_record(void *session, uint32_t param_types,
+				TEE_Param params[4])
 {
 	const uint32_t exp_param_types =
 		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
 				TEE_PARAM_TYPE_MEMREF_INPUT,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
-	TEE_ObjectHandle object;
+	struct storage_session *sess = (struct storage_session *)session;
+	char key[TA_SECURE_STORAGE_KV_MAX_KEY_SIZE];
+	size_t key_sz;
+	size_t val_sz;
 	TEE_Result res;
-	char *obj_id;
-	size_t obj_id_sz;
-	char *data;
-	size_t data_sz;
-	uint32_t obj_data_flag;
 
 	/*
 	 * Safely get the invocation parameters
@@ -96,67 +2157,71 @@ static TEE_Result create_raw_object(uint32_t param_types, TEE_Param params[4])
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	obj_id_sz = params[0].memref.size;
-	obj_id = TEE_Malloc(obj_id_sz, 0);
-	if (!obj_id)
-		return TEE_ERROR_OUT_OF_MEMORY;
+	key_sz = params[0].memref.size;
+	val_sz = params[1].memref.size;
+	if (!key_sz || key_sz > sizeof(key) ||
+	    val_sz > TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
 
-	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	TEE_MemMove(key, params[0].memref.buffer, key_sz);
+	TEE_MemMove(sess->chunk, params[1].memref.buffer, val_sz);
 
-	data_sz = params[1].memref.size;
-	data = TEE_Malloc(data_sz, 0);
-	if (!data)
-		return TEE_ERROR_OUT_OF_MEMORY;
-	TEE_MemMove(data, params[1].memref.buffer, data_sz);
+	res = kv_put(key, key_sz, sess->chunk, val_sz);
+	if (res != TEE_SUCCESS)
+		EMSG("kv_put failed 0x%08x", res);
+
+	return res;
+}
+
+static TEE_Result kv_get_record(void *session, uint32_t param_types,
+				TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+	char key[TA_SECURE_STORAGE_KV_MAX_KEY_SIZE];
+	size_t key_sz;
+	size_t val_sz;
+	TEE_Result res;
 
 	/*
-	 * Create object in secure storage and fill with data
+	 * Safely get the invocation parameters
 	 */
-	obj_data_flag = TEE_DATA_FLAG_ACCESS_READ |		/* we can later read the oject */
-			TEE_DATA_FLAG_ACCESS_WRITE |		/* we can later write into the object */
-			TEE_DATA_FLAG_ACCESS_WRITE_META |	/* we can later destroy or rename the object */
-			TEE_DATA_FLAG_OVERWRITE;		/* destroy existing object of same ID */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
 
-	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
-					obj_id, obj_id_sz,
-					obj_data_flag,
-					TEE_HANDLE_NULL,
-					NULL, 0,		/* we may not fill it right now */
-					&object);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_CreatePersistentObject failed 0x%08x", res);
-		TEE_Free(obj_id);
-		TEE_Free(data);
-		return res;
-	}
+	key_sz = params[0].memref.size;
+	if (!key_sz || key_sz > sizeof(key))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	TEE_MemMove(key, params[0].memref.buffer, key_sz);
+
+	val_sz = params[1].memref.size;
+	if (val_sz > TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE)
+		val_sz = TA_SECURE_STORAGE_KV_MAX_VALUE_SIZE;
+
+	res = kv_get(key, key_sz, sess->chunk, &val_sz);
+	if (res == TEE_SUCCESS)
+		TEE_MemMove(params[1].memref.buffer, sess->chunk, val_sz);
+	if (res == TEE_SUCCESS || res == TEE_ERROR_SHORT_BUFFER)
+		params[1].memref.size = val_sz;
 
-	res = TEE_WriteObjectData(object, data, data_sz);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_WriteObjectData failed 0x%08x", res);
-		TEE_CloseAndDeletePersistentObject1(object);
-	} else {
-		TEE_CloseObject(object);
-	}
-	TEE_Free(obj_id);
-	TEE_Free(data);
 	return res;
 }
 
-static TEE_Result read_raw_object(uint32_t param_types, TEE_Param params[4])
+static TEE_Result kv_delete_record(void __unused *session,
+				   uint32_t param_types, TEE_Param params[4])
 {
 	const uint32_t exp_param_types =
 		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
-				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
-	TEE_ObjectHandle object;
-	TEE_ObjectInfo object_info;
-	TEE_Result res;
-	uint32_t read_bytes;
-	char *obj_id;
-	size_t obj_id_sz;
-	char *data;
-	size_t data_sz;
+	char key[TA_SECURE_STORAGE_KV_MAX_KEY_SIZE];
+	size_t key_sz;
 
 	/*
 	 * Safely get the invocation parameters
@@ -164,105 +2229,236 @@ static TEE_Result read_raw_object(uint32_t param_types, TEE_Param params[4])
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	obj_id_sz = params[0].memref.size;
-	obj_id = TEE_Malloc(obj_id_sz, 0);
-	if (!obj_id)
-		return TEE_ERROR_OUT_OF_MEMORY;
+	key_sz = params[0].memref.size;
+	if (!key_sz || key_sz > sizeof(key))
+		return TEE_ERROR_BAD_PARAMETERS;
 
-	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	TEE_MemMove(key, params[0].memref.buffer, key_sz);
 
-	data_sz = params[1].memref.size;
-	data = TEE_Malloc(data_sz, 0);
-	if (!data)
-		return TEE_ERROR_OUT_OF_MEMORY;
+	return kv_delete(key, key_sz);
+}
+
+static TEE_Result kv_compact_store(void __unused *session,
+				   uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
 
 	/*
-	 * Check the object exist and can be dumped into output buffer
-	 * then dump it.
+	 * Safely get the invocation parameters
 	 */
-	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
-					obj_id, obj_id_sz,
-					TEE_DATA_FLAG_ACCESS_READ |
-					TEE_DATA_FLAG_SHARE_READ,
-					&object);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to open persistent object, res=0x%08x", res);
-		TEE_Free(obj_id);
-		TEE_Free(data);
-		return res;
-	}
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
 
-	res = TEE_GetObjectInfo1(object, &object_info);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to create persistent object, res=0x%08x", res);
-		goto exit;
-	}
+	return kv_compact(&params[0].value.a);
+}
 
-	if (object_info.dataSize > data_sz) {
-		/*
-		 * Provided buffer is too short.
-		 * Return the expected size together with status "short buffer"
-		 */
-		params[1].memref.size = object_info.dataSize;
-		res = TEE_ERROR_SHORT_BUFFER;
-		goto exit;
-	}
+static TEE_Result set_write_back(void *session, uint32_t param_types,
+				 TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
 
-	res = TEE_ReadObjectData(object, data, object_info.dataSize,
-				 &read_bytes);
-	if (res == TEE_SUCCESS)
-		TEE_MemMove(params[1].memref.buffer, data, read_bytes);
-	if (res != TEE_SUCCESS || read_bytes != object_info.dataSize) {
-		EMSG("TEE_ReadObjectData failed 0x%08x, read %" PRIu32 " over %u",
-				res, read_bytes, object_info.dataSize);
-		goto exit;
-	}
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types || params[0].value.a > 1)
+		return TEE_ERROR_BAD_PARAMETERS;
 
-	/* Return the number of byte effectively filled */
-	params[1].memref.size = read_bytes;
-exit:
-	TEE_CloseObject(object);
-	TEE_Free(obj_id);
-	TEE_Free(data);
-	return res;
+	sess->write_back = params[0].value.a;
+	if (!sess->write_back)
+		return wb_flush(sess);
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result flush_objects(void *session, uint32_t param_types,
+				TEE_Param __unused params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_session *sess = (struct storage_session *)session;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	return wb_flush(sess);
+}
+
+static TEE_Result get_cache_stats(void __unused *session,
+				  uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	params[0].value.a = rc_hits;
+	params[0].value.b = rc_misses;
+	params[1].value.a = rc_count;
+	params[1].value.b = rc_size;
+
+	return TEE_SUCCESS;
 }
 
 TEE_Result TA_CreateEntryPoint(void)
 {
-	/* Nothing to do */
+	stream_recover();
+
+	/*
+	 * Complete a commit interrupted by a reset, then discard the
+	 * transactions never committed.
+	 */
+	if (tx_recover() == TEE_SUCCESS) {
+		discard_prefixed(TX_ID_PREFIX, TX_ID_PREFIX_LEN);
+	} else {
+		EMSG("Failed to complete the last transaction");
+		tx_pending = true;
+	}
+
 	return TEE_SUCCESS;
 }
 
 void TA_DestroyEntryPoint(void)
 {
-	/* Nothing to do */
+	rc_release();
 }
 
 TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
 				    TEE_Param __unused params[4],
-				    void __unused **session)
+				    void **session)
 {
-	/* Nothing to do */
+	struct storage_session *sess;
+
+	/*
+	 * Allocate the session chunk buffer and stream state. The address
+	 * of the structure is used as session ID for the client.
+	 */
+	sess = TEE_Malloc(sizeof(*sess), 0);
+	if (!sess)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	sess->stream = TEE_HANDLE_NULL;
+	sess->list_enum = TEE_HANDLE_NULL;
+
+	*session = (void *)sess;
+	DMSG("Session %p: newly allocated", *session);
+
 	return TEE_SUCCESS;
 }
 
-void TA_CloseSessionEntryPoint(void __unused *session)
+void TA_CloseSessionEntryPoint(void *session)
 {
-	/* Nothing to do */
+	struct storage_session *sess = (struct storage_session *)session;
+
+	/* A stream or a transaction not committed is lost */
+	abort_stream(sess);
+	abort_tx(sess);
+
+	/* Write the cached objects, lost if this fails */
+	if (wb_flush(sess) != TEE_SUCCESS)
+		EMSG("Session %p: cached objects lost", session);
+	while (sess->wb_count)
+		wb_remove(sess, sess->wb);
+
+	/* Checkpoint the key-value store index */
+	kv_close();
+
+	if (sess->list_enum != TEE_HANDLE_NULL)
+		TEE_FreePersistentObjectEnumerator(sess->list_enum);
+
+	DMSG("Session %p: release session", session);
+	TEE_Free(sess);
 }
 
-TEE_Result TA_InvokeCommandEntryPoint(void __unused *session,
+TEE_Result TA_InvokeCommandEntryPoint(void *session,
 				      uint32_t command,
 				      uint32_t param_types,
 				      TEE_Param params[4])
 {
+	TEE_Result res;
+
+	/*
+	 * A commit left incomplete publishes its objects over whatever the
+	 * other commands would write: complete it before serving any.
+	 */
+	if (tx_pending) {
+		res = tx_recover();
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
 	switch (command) {
 	case TA_SECURE_STORAGE_CMD_WRITE_RAW:
-		return create_raw_object(param_types, params);
+		return create_raw_object(session, param_types, params);
 	case TA_SECURE_STORAGE_CMD_READ_RAW:
-		return read_raw_object(param_types, params);
+		return read_raw_object(session, param_types, params);
 	case TA_SECURE_STORAGE_CMD_DELETE:
-		return delete_object(param_types, params);
+		return delete_object(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_WRITE_MULTI:
+	case TA_SECURE_STORAGE_CMD_READ_MULTI:
+	case TA_SECURE_STORAGE_CMD_DELETE_MULTI:
+		return process_multi(session, param_types, params, command);
+	case TA_SECURE_STORAGE_CMD_READ_RANGE:
+		return read_object_range(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_WRITE_RANGE:
+		return write_object_range(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_TRUNCATE:
+		return truncate_object(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_STREAM_OPEN:
+		return stream_open(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_STREAM_APPEND:
+		return stream_append(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_STREAM_COMMIT:
+		return stream_commit(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_STREAM_ABORT:
+		return stream_abort(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_LIST:
+		return list_objects(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_STAT:
+		return stat_object(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_KV_PUT:
+		return kv_put_record(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_KV_GET:
+		return kv_get_record(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_KV_DELETE:
+		return kv_delete_record(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_KV_COMPACT:
+		return kv_compact_store(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_WRITE_BACK:
+		return set_write_back(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_FLUSH:
+		return flush_objects(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_CACHE_STATS:
+		return get_cache_stats(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_TX_BEGIN:
+		return tx_begin(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_TX_PUT:
+		return tx_put(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_TX_COMMIT:
+		return tx_commit(session, param_types, params);
+	case TA_SECURE_STORAGE_CMD_TX_ABORT:
+		return tx_abort(session, param_types, params);
 	default:
 		EMSG("Command ID 0x%x is not supported", command);
 		return TEE_ERROR_NOT_SUPPORTED;
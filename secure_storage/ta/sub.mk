@@ -1,2 +1,4 @@
 global-incdirs-y += include
+srcs-y += kv_store.c
+srcs-y += lz.c
 srcs-y += secure_storage_ta.c